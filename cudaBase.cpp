@@ -72,8 +72,9 @@ void cuda_stream_sync(const int did)
 { cuda_check (cudaStreamSynchronize (dnnctx[did]->stream_));
 }
 
-int cuda_get_blocks (const int N)
-{ return (N + CUDA_NUM_THREADS - 1) / CUDA_NUM_THREADS;
+// 线程总数不超过2^31，更大的N由kernel_for的跨步循环补齐
+int cuda_get_blocks (const int64_t N)
+{ return (int) std::min ((N + CUDA_NUM_THREADS - 1) / CUDA_NUM_THREADS, (int64_t)(INT_MAX / CUDA_NUM_THREADS));
 }
 
 void cuda_memcpy       (void *dst, const void *src, const size_t size, cudaMemcpyKind kind)
@@ -2,8 +2,34 @@
 #define EXPR_H_
 
 #include <float.h>
+#include <stdint.h>
+#include <type_traits>
 #include "xpu.h"
 
+// bfloat16，只做存储，取出即为float，存入时就近舍入到偶数
+class bf16 {
+public:
+  XPU_CALLABLE_INLINE bf16 () { }
+  XPU_CALLABLE_INLINE bf16 (const float f)
+  { union { float f; uint32_t u; } v;  v.f = f;
+    if ((v.u & 0x7fffffff) > 0x7f800000)
+      x = (v.u >> 16) | 0x40;  // NaN保持为quiet NaN
+    else
+      x = (v.u + 0x7fff + ((v.u >> 16) & 1)) >> 16;
+  }
+  XPU_CALLABLE_INLINE operator float () const
+  { union { float f; uint32_t u; } v;  v.u = (uint32_t)x << 16;
+    return v.f;
+  }
+  uint16_t x;
+};
+
+// 表达式里的计算类型，16位存储按float计算
+template <typename DT> struct acc_type { typedef DT type;  };
+template <> struct acc_type<bf16> { typedef float type;  };
+
+
+
 template <typename DT>
 struct opplus {
   XPU_CALLABLE_INLINE DT operator() (const DT a, const DT b) const { return a + b; }
@@ -71,7 +97,7 @@ struct opabs {
 
 template <typename DT>
 struct opexp {
-  XPU_CALLABLE_INLINE DT operator() (const DT a) const { return expf(a); }
+  XPU_CALLABLE_INLINE DT operator() (const DT a) const { return exp(a); }
 };
 
 template <typename DT>
@@ -108,4 +134,127 @@ struct divto {
   XPU_CALLABLE_INLINE static void save (DT& a, DT b) { a /= b;  }
 };
 
+
+
+// 惰性表达式，w = w + m * momentum - g * lr 在赋值时展开成一个kernel_for
+template <typename DT>
+struct ExpTensor {
+  XPU_CALLABLE_INLINE typename acc_type<DT>::type eval (const int64_t i) const { return dptr[i];  }
+  void check (const int64_t n) const { CHECK_EQ (size, n) << "\texpression size mismatch";  }
+  const DT *dptr;
+  int64_t size;
+};
+
+template <typename DT>
+struct ExpScalar {
+  XPU_CALLABLE_INLINE DT eval (const int64_t i) const { return val;  }
+  void check (const int64_t n) const { }
+  DT val;
+};
+
+template <class Oper, typename TA, typename TB>
+struct ExpBinary {
+  XPU_CALLABLE_INLINE auto eval (const int64_t i) const -> decltype (Oper() (TA().eval(i), TB().eval(i)))
+  { return Oper() (a.eval(i), b.eval(i));  }
+  void check (const int64_t n) const { a.check (n);  b.check (n);  }
+  TA a;
+  TB b;
+};
+
+template <class Oper, typename TA>
+struct ExpUnary {
+  XPU_CALLABLE_INLINE auto eval (const int64_t i) const -> decltype (Oper() (TA().eval(i)))
+  { return Oper() (a.eval(i));  }
+  void check (const int64_t n) const { a.check (n);  }
+  TA a;
+};
+
+// exp_traits<T>::exp_t 是T落到表达式后的类型，Tensor的特化在tensor.h
+template <typename T>
+struct exp_traits {
+  static const bool is_exp = false;
+};
+template <typename DT>
+struct exp_traits<ExpTensor<DT>> {
+  static const bool is_exp = true;
+  typedef typename acc_type<DT>::type type;
+  typedef ExpTensor<DT> exp_t;
+  static exp_t make (const exp_t &e) { return e;  }
+};
+template <typename DT>
+struct exp_traits<ExpScalar<DT>> {
+  static const bool is_exp = true;
+  typedef DT type;
+  typedef ExpScalar<DT> exp_t;
+  static exp_t make (const exp_t &e) { return e;  }
+};
+template <class Oper, typename TA, typename TB>
+struct exp_traits<ExpBinary<Oper, TA, TB>> {
+  static const bool is_exp = true;
+  typedef typename exp_traits<TA>::type type;
+  typedef ExpBinary<Oper, TA, TB> exp_t;
+  static exp_t make (const exp_t &e) { return e;  }
+};
+template <class Oper, typename TA>
+struct exp_traits<ExpUnary<Oper, TA>> {
+  static const bool is_exp = true;
+  typedef typename exp_traits<TA>::type type;
+  typedef ExpUnary<Oper, TA> exp_t;
+  static exp_t make (const exp_t &e) { return e;  }
+};
+
+// 标量按另一侧的数据类型落成ExpScalar
+template <typename T, typename DT, bool is_exp = exp_traits<T>::is_exp>
+struct exp_lower {
+  typedef typename exp_traits<T>::exp_t type;
+  static type make (const T &t) { return exp_traits<T>::make (t);  }
+};
+template <typename T, typename DT>
+struct exp_lower<T, DT, false> {
+  typedef ExpScalar<DT> type;
+  static type make (const T &t) { type e;  e.val = (DT)t;  return e;  }
+};
+
+template <template <typename> class Oper, typename A, typename B,
+  bool valid = exp_traits<A>::is_exp || exp_traits<B>::is_exp>
+struct exp_binary { };
+template <template <typename> class Oper, typename A, typename B>
+struct exp_binary<Oper, A, B, true> {
+  typedef typename exp_traits<typename std::conditional<exp_traits<A>::is_exp, A, B>::type>::type DT;
+  typedef ExpBinary<Oper<DT>, typename exp_lower<A, DT>::type, typename exp_lower<B, DT>::type> type;
+  static type make (const A &a, const B &b)
+  { type e;  e.a = exp_lower<A, DT>::make (a);  e.b = exp_lower<B, DT>::make (b);  return e;  }
+};
+
+template <template <typename> class Oper, typename A, bool valid = exp_traits<A>::is_exp>
+struct exp_unary { };
+template <template <typename> class Oper, typename A>
+struct exp_unary<Oper, A, true> {
+  typedef typename exp_traits<A>::type DT;
+  typedef ExpUnary<Oper<DT>, typename exp_traits<A>::exp_t> type;
+  static type make (const A &a) { type e;  e.a = exp_traits<A>::make (a);  return e;  }
+};
+
+#define EXP_BINARY(name, oper) \
+template <typename A, typename B> \
+inline typename exp_binary<oper, A, B>::type name (const A &a, const B &b) \
+{ return exp_binary<oper, A, B>::make (a, b);  }
+
+#define EXP_UNARY(name, oper) \
+template <typename A> \
+inline typename exp_unary<oper, A>::type name (const A &a) \
+{ return exp_unary<oper, A>::make (a);  }
+
+EXP_BINARY (operator+, opplus)
+EXP_BINARY (operator-, opsub)
+EXP_BINARY (operator*, opmul)
+EXP_BINARY (operator/, opdiv)
+EXP_BINARY (vmax, opmaximum)
+EXP_BINARY (vmin, opminimum)
+EXP_UNARY  (vabs,  opabs)
+EXP_UNARY  (vexp,  opexp)
+EXP_UNARY  (vinv,  opinv)
+EXP_UNARY  (vsqr,  opsquare)
+EXP_UNARY  (vsqrt, opsqrt)
+
 #endif
@@ -6,6 +6,15 @@
 #include "../include/image.h"
 #include "../include/tensor.h"
 
+// 交织存储的Mat看作 rows x cols x channels 的张量
+TensorViewCPUf mat_view (Mat &src)
+{ TensorViewCPUf t (src.ptr<float>(), Shape (src.rows, src.cols, src.channels(), 1));
+  t.strd.strd[0] = src.step1 ();
+  t.strd.strd[1] = src.channels ();
+  t.strd.strd[2] = 1;
+  return t;
+}
+
 template <>
 void TensorCPUf::show_image (int numc)
 { shape.print ();
@@ -22,8 +31,7 @@ void TensorCPUf::show_image (int numc)
       { int x = cols() * (i%numx*numc+j);
         int y = rows() * (i/numx);
         Mat roi (dst, cv::Rect (x, y, cols(), rows()));
-        for (int k = 0; k < rows(); ++k)
-          (*this)[i][j][k].memcpy_to_cpu (roi.ptr<float>(k));
+        mat_view (roi).copy (view().slice (4, i, i+1).slice (3, j, j+1));
       }
   }
   else
@@ -36,9 +44,7 @@ void TensorCPUf::show_image (int numc)
     { int x = cols() * (i%numx);
       int y = rows() * (i/numx);
       Mat roi (dst, cv::Rect (x, y, cols(), rows()));
-      for (int j = 0; j < chls(); ++j)
-        for (int k = 0; k < rows(); ++k)
-          (*this)[i][j][k].blas_copy_to (roi.ptr<float>(k)+j, chls(), 1);
+      mat_view (roi).copy (view().slice (4, i, i+1));
     }
   }
   if (dst.cols > 1600)
@@ -64,14 +70,20 @@ void bgr_normalize (Mat &src)
   merge (chlVtr, src);
 }
 
+// nhwc与Mat的交织存放一致，直接把转换结果写进dst
 void mat_2tensor (Mat &src, TensorCPUf &dst)
-{ src.convertTo (src, CV_32FC3, 1.f/255);
-  for (int i = 0; i < 3; ++i)
-    cblas_scopy (src.rows*src.cols, src.ptr<float>()+i, 3, dst[i].dptr, 1);
+{ if (dst.shape.layout == kNHWC)
+  { Mat hwc (dst.rows(), dst.cols(), CV_32FC(dst.chls()), dst.dptr);
+    src.convertTo (hwc, CV_32F, 1.f/255);
+    CHECK (hwc.data == (uchar*)dst.dptr);
+    return;
+  }
+  src.convertTo (src, CV_32FC3, 1.f/255);
+  dst.copy (mat_view (src));
 }
 
 template <>
-void TensorCPUf::read_image_data (const TensorFormat &tf, const string &file, const int idx, const TensorCPUf &mean)
+void TensorCPUf::read_image_data (const TensorFormat &tf, const string &file, const int idx, const TensorCPUf &mean, Philox &rng)
 { Mat src = cv::imread (file, 1);
   if (src.data == NULL)
   { LOG (WARNING) << "\timage is invalid\t" << file;
@@ -86,7 +98,7 @@ void TensorCPUf::read_image_data (const TensorFormat &tf, const string &file, co
     return;
   }
 
-  float crop_ratio = 1.f;  // (rand() % 21 + 80) / 100.f;
+  float crop_ratio = 1.f;  // (rng.next (21) + 80) / 100.f;
   int interpolation = crop_ratio < 1 ? CV_INTER_CUBIC : CV_INTER_AREA;
   int crop_rows = tf.isTrain ? rows() * crop_ratio : rows();
   int crop_cols = tf.isTrain ? cols() * crop_ratio : cols();
@@ -95,15 +107,15 @@ void TensorCPUf::read_image_data (const TensorFormat &tf, const string &file, co
   int y0 = gap_rows / 2;
   int x0 = gap_cols / 2;
   if (tf.isTrain)
-  { y0 = gap_rows == 0 ? 0 : rand() % gap_rows;
-    x0 = gap_cols == 0 ? 0 : rand() % gap_cols;
+  { y0 = gap_rows == 0 ? 0 : rng.next (gap_rows);
+    x0 = gap_cols == 0 ? 0 : rng.next (gap_cols);
   }
 
   cv::Rect roi (x0, y0, crop_cols, crop_rows);
   Mat crop = src (roi);
   if (tf.isTrain && crop_ratio != 1)
     cv::resize (crop, crop, cv::Size(cols(), rows()), 0, 0, interpolation);
-  if (tf.isTrain && rand() % 2)
+  if (tf.isTrain && rng.next (2))
     cv::flip   (crop, crop, 1);
 
   TensorCPUf dst = (*this)[idx];
@@ -153,9 +165,10 @@ void image_resize (const ParaImage &para, const string &srcRoot, const string &d
 
     LOG (INFO) << "\t" << srcList[i] << "\t" << dstList[i];
     vector<string> fileList;  get_file_list (srcList[i], suffix, fileList);
-#pragma omp parallel for
-    for (size_t j = 0; j < fileList.size(); j++)
-      image_resize (para, srcList[i] + fileList[j], dstList[i] + fileList[j]);
+    ThreadPool::get().parallel_for (0, fileList.size(), 1, [&] (const int begin, const int end)
+    { for (int j = begin; j < end; j++)
+        image_resize (para, srcList[i] + fileList[j], dstList[i] + fileList[j]);
+    });
   }
 }
 
@@ -19,9 +19,23 @@ enum layer_t
   kSoftmax	= 9
 };
 
+enum plan_t
+{ kPlanNone	= 0,  // 节点各自分配
+  kPlanTrain	= 1,  // 前向+反传
+  kPlanEval	= 2,  // 只前向，DataBatch读写的data、pred、label整轮都在
+  kPlanInfer	= 3,  // 只前向，只留pred给fprop之后读
+  kPlanRecomp	= 4   // 训练，只留检查点，反传时从检查点分段重算
+};
+
+enum neuron_t
+{ RELU		= 1,
+  SIGMOID	= 2,
+  TANH		= 3
+};
+
 class ParaLayer {
 public:
-  explicit ParaLayer () : isLoad(false), isFixed(false), sigma(0.01), norm(2.f), dropout(0.f) { };
+  explicit ParaLayer () : isLoad(false), isFixed(false), isHalf(false), isRegen(false), isFused(false), isRecomp(false), seed(1), sigma(0.01), norm(2.f), dropout(0.f) { };
   string get_layer_type ();
   void setPoolingDesc (cudnnPoolingDescriptor_t &desc);
   void set_para (const int epoch, const int max_round);
@@ -32,7 +46,11 @@ public:
   int neuron;
   int pool;
   int loss;
-  bool isLoad, isFixed;
+  bool isLoad, isFixed, isHalf;
+  bool isRegen;  // dropout反传时重新生成mask，不存位图
+  bool isFused;  // 本层的neuron和dropout并进输出，不另建层
+  bool isRecomp;  // 重算模式下输出不留，反传前从检查点重跑本层，由plan_nodes设
+  int seed;  // 本层rand_的种子，由model.seed和层号合成，各设备相同
   float sigma, norm;
   float dbase, dropout;
 };
@@ -53,6 +71,11 @@ public:
   virtual void save_model (const string file) { }
   virtual void load_model (const string file) { }
   virtual void get_model_info ();
+  virtual void calib_layer () { }  // int8推断前统计输入
+  virtual void quant_layer () { }
+  virtual void fprop_int8 () { fprop (false);  }
+  virtual void refprop () { fprop (true);  }  // 重算模式反传前再跑一遍前向，带随机的层要复现上次的结果
+  virtual bool is_inplace () const { return false;  }  // fprop可以让dst_与src_共用内存
   virtual void set_optimization (ParaOptim &paraWmat, ParaOptim &paraBias, vector<OptimBase<XPU, float>*> &optims) { }
   virtual cudaStream_t  get_calc_stream () const { return dnnctx[did_]->stream_;  }
   virtual cudnnHandle_t get_cunn_handle () const { return dnnctx[did_]->cudnn_;   }
@@ -63,7 +86,7 @@ public:
 #define LAYER_CONSTRUCTOR(layername) \
   explicit layername (ParaLayer &pl, const int did, Tensor<XPU, float> &src, Tensor<XPU, float> &dst) \
   : LayerBase<XPU> (pl, did), pl_(pl), did_(did), src_(src), dst_(dst), rand_(did), alpha(1.), beta(0.) \
-  { init_layer ();  }
+  { rand_.set_seed (pl.seed);  init_layer ();  }
 
 #define LAYER_FORWARD(layername) \
   template <typename XPU> void layername<XPU>::fprop (const bool is_train)
@@ -80,11 +103,57 @@ public:
   void init_layer ()
 
 #define MODEL_FUNC() \
+  void calib_layer (); \
+  void quant_layer (); \
+  void fprop_int8 (); \
   void init_model (); \
   void save_model (const string file); \
   void load_model (const string file); \
   void set_optimization (ParaOptim &paraWmat, ParaOptim &paraBias, vector<OptimBase<XPU, float>*> &optims)
 
+// dropout的mask按位存，一个字管32个元素，用8组Philox生成
+// ctr = (offset + word*8 + g, subseq)，subseq取层号和设备号，不同层互不相关
+XPU_CALLABLE_INLINE uint32_t dropout_word (const uint64_t seed, const uint64_t offset, const int64_t w,
+  const uint32_t subseq, const uint32_t thresh)
+{ const uint32_t key[2] = { (uint32_t)seed, (uint32_t)(seed >> 32) };
+  uint32_t ctr[4], out[4], word = 0;
+  ctr[2] = subseq;  ctr[3] = 0;
+  for (int g = 0; g < 8; ++g)
+  { const uint64_t c = offset + (uint64_t)w * 8 + g;
+    ctr[0] = (uint32_t)c;  ctr[1] = (uint32_t)(c >> 32);
+    Philox::block (key, ctr, out);
+    for (int j = 0; j < 4; ++j)
+      word |= (uint32_t)(out[j] >= thresh) << (g * 4 + j);
+  }
+  return word;
+}
+
+inline uint32_t dropout_thresh (const float p)
+{ const double t = (double)p * 4294967296.;  // 保留x >= p * 2^32
+  return t >= 4294967295. ? UINT32_MAX : (uint32_t)t;
+}
+
+// isFused时层输出上的relu和dropout，一遍读写，省掉neuron、dropout两层和neuron的dst_
+// 反传时输出已被下一层的梯度覆盖，训练前向按位记下正负和mask
+template <typename XPU>
+class FuseAct {
+public:
+  explicit FuseAct () : pl_(NULL), act_(false), drop_(false), slope_(1.f) { }
+  void init (ParaLayer &pl, const int did, const int64_t N);
+  float get_slope () const { return act_ ? slope_ : 1.f;  }  // gemm的epilogue能顺带做的负半轴斜率
+  void fprop (const bool is_train, const bool act_done, Tensor<XPU, float> &data, const Random<XPU> &rand);
+  void bprop (Tensor<XPU, float> &diff, const Random<XPU> &rand);
+  void rewind () { offset_ = fpoff_;  }  // 下一次前向沿用上次的mask
+private:
+  bool use_drop () const { return drop_ && pl_->dropout > 0.01;  }
+  ParaLayer *pl_;
+  int did_;
+  bool act_, drop_;
+  float slope_;
+  Tensor<XPU, uint32_t> sign_, mask_;  // 训练时才用，isRegen时不存mask_
+  uint64_t offset_, fpoff_;
+};
+
 #define CUDNN_HANDLE  LayerBase<XPU>::get_cunn_handle()
 #define CUDNN_STREAM  LayerBase<XPU>::get_calc_stream()
 
@@ -101,21 +170,47 @@ public:
   Tensor<XPU, float>mwmat_, nwmat_; \
   Tensor<XPU, float> wmat_, gwmat_; \
   Tensor<XPU, float> bias_, gbias_; \
+  QTensor qwmat_; \
   int chls_, flts_, secc_; \
   int dims_, nums_
 
+enum conv_algo_t
+{ kConvGemm	= 0,  // im2col + gemm
+  kConvWino2	= 1,  // winograd F(2x2, 3x3)
+  kConvWino4	= 2,  // winograd F(4x4, 3x3)
+  kConvDirect	= 3,  // NCHW16c直接卷积
+  kConvFFT	= 4   // 分块重叠相加的FFT卷积
+};
+
 template <typename XPU>
 class LayerConvolution : public LayerBase<XPU> {
 public:
   LAYER_CONSTRUCTOR (LayerConvolution);
   LAYER_FUNC ();
   MODEL_FUNC ();
+  void refprop () { fuse_.rewind ();  fprop (true);  }
 public:
   Patch patch_;
   LAYER_MEMBER;
   MODEL_MEMBER;
 private:
-  Tensor<XPU, float> tcol_;
+  void fprop_cpu ();
+  void bprop_cpu (const bool is_prop_grad);
+  void fprop_wino ();
+  void bprop_wino ();
+  void fprop_direct ();
+  void bprop_direct (const bool is_prop_grad);
+  void fprop_fft ();
+  void bprop_fft ();
+  int get_col_size () const;  // CPU每个线程的列缓冲宽度
+  int64_t get_workspace (const int algo, const int tile) const;  // CPU各算法额外占用的字节数
+  int64_t get_direct_space () const;  // 直接卷积在设备共用缓冲里要的元素数
+  void tune_algo ();  // 实测选CPU算法，结果存盘
+  int algo_;   // CPU卷积算法，conv_algo_t
+  int wstat_;  // winograd域滤波器是否有效，1前向2反传，bprop之后权重要更新，清零
+  int ftile_;  // FFT卷积的tile边长
+  FuseAct<XPU> fuse_;
+  Tensor<XPU, float> wfwd_, wbwd_;
   cudnnTensorDescriptor_t srcDesc_, dstDesc_;
   cudnnTensorDescriptor_t biasDesc_;
   cudnnFilterDescriptor_t wmatDesc_;
@@ -143,6 +238,7 @@ class LayerNeuron : public LayerBase<XPU> {
 public:
   LAYER_CONSTRUCTOR (LayerNeuron);
   LAYER_FUNC ();
+  bool is_inplace () const { return true;  }
   cudnnActivationMode_t get_activation_type ();
 private:
   LAYER_MEMBER;
@@ -154,6 +250,7 @@ class LayerPooling : public LayerBase<XPU> {
 public:
   LAYER_CONSTRUCTOR (LayerPooling);
   LAYER_FUNC ();
+  void refprop ();
 public:
   Pool  pool_;
   LAYER_MEMBER;
@@ -161,6 +258,8 @@ private:
   cudnnTensorDescriptor_t srcDesc_, ssrcDesc_;
   cudnnTensorDescriptor_t dstDesc_, sdstDesc_;
   cudnnPoolingDescriptor_t poolDesc_;
+  Tensor<XPU, bf16> hdst_;  // isHalf时训练保存的输出按bf16存
+  void save_dst ();
   int secs_, secn_;
 };
 
@@ -169,10 +268,14 @@ class LayerDropout : public LayerBase<XPU> {
 public:
   LAYER_CONSTRUCTOR (LayerDropout);
   LAYER_FUNC ();
+  bool is_inplace () const { return true;  }  // init里已让dst_ = src_
+  void refprop () { offset_ = fpoff_;  fprop (true);  }
 public:
   LAYER_MEMBER;
 private:
-  Tensor<XPU, float> mask;
+  Tensor<XPU, uint32_t> mask_;  // 每个元素1位，isRegen时不分配
+  uint64_t offset_;  // Philox计数器，每次训练fprop往后挪
+  uint64_t fpoff_;   // 本次fprop用的起点，bprop据此重算
   float scal_;
 };
 
@@ -198,22 +301,28 @@ public:
   LAYER_FUNC ();
 public:
   LAYER_MEMBER;
+  float loss_;  // 最近一次fprop的平均交叉熵，仅ENTROPY
 private:
+  void fprop_entropy ();  // softmax和交叉熵一起算
+  void bprop_delta ();
   cudnnTensorDescriptor_t srcDesc_, dstDesc_;
   int nums_, dims_;
-  float loss_;
 };
 
 
 
 template<typename XPU>
 LayerBase<XPU>* create_layer (ParaLayer &pl, const int did, Tensor<XPU, float> &src, Tensor<XPU, float> &dst);
+template<typename XPU>
+int get_src_layout (const ParaLayer &pl, const int layout);  // 层在输入为layout时实际接受的布局
 
 class ParaNNet {
 public:
   explicit ParaNNet () { };
   void config (const libconfig::Config &cfg);
+  void fuse_layers ();
   int get_layer_type (const char *type);
+  int get_plan_type (const char *type);
 public:
   vector<ParaLayer> paraLayer_;
   vector<ParaOptim> paraWmat_;
@@ -226,6 +335,10 @@ public:
   string dataType;
   int num_nnets;
   int num_nodes;
+  int plan;  // nodes_的内存规划，plan_t
+  int seed;  // 权重初始化、dropout和数据管线的随机种子
+  int recomp_mb;  // 重算模式的节点内存预算，0为取最省的分段
+  int int8_batches;  // int8推断的校准batch数，0为fp32
   int num_evals;
   int min_device;
   int max_device;
@@ -248,14 +361,18 @@ public:
   void init_data  ();
   void train ();
   void trval ();
+  void infer ();
   void save_model (const int did);
   void load_model (const int did);
   void show_layer (const int did);
+  void quantize (const int did, const int num_batches);
 private:
+  void plan_nodes (const int did);
   void train_epoch (DataBuffer<float> &buffer, DataBatch<XPU, float> &batch, const int did);
   void  eval_epoch (DataBuffer<float> &buffer, DataBatch<XPU, float> &batch, const int did);
   void fprop (const int did, const bool is_train);
   void bprop (const int did);
+  void relay (const int did, const int i, const bool is_fprop);
   void reduce_gmat (const int did);
   void update_wmat (const int did);
 public:
@@ -265,11 +382,15 @@ public:
   vector<vector<LayerBase<XPU>*>>        layers_;
   vector<vector<OptimBase<XPU, float>*>> optims_;
   vector<vector<Tensor<XPU, float>>> nodes_;
+  vector<vector<Tensor<XPU, float>>> relay_;  // 层不接输入节点的布局时，按层的布局重排一份作为它的src_
+  vector<Tensor<XPU, float>> arena_;  // plan_nodes之后nodes_都指到这里
+  vector<bool> keep_;  // 前向之后仍保留的节点，重算模式下其余的在反传时重算
   vector<DataBatch<XPU, float>>      batch_;
   vector<DataBuffer<float>> train_;
   vector<DataBuffer<float>> predt_;
   vector<float> trainErr_;
   vector<float> predtErr_;
+  bool int8_;  // quantize之后推断走int8
 };
 
 #endif
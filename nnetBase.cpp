@@ -7,7 +7,7 @@
 string ParaLayer::get_layer_type ()
 { std::stringstream sstr;
   switch (type)
-  { case kConvolution	: sstr << secc;   return "Convolution\t" + sstr.str();
+  { case kConvolution	: sstr << secc << (isFused ? "\tfused" : "");  return "Convolution\t" + sstr.str();
     case kDropout	: sstr << dbase;  return "Dropout\t\t" + sstr.str();
     case kFullConn	: return "FullConn";
     case kLoss		: return "Loss";
@@ -23,6 +23,24 @@ void ParaLayer::set_para (const int epoch, const int max_round)
   dropout = dbase;
 }
 
+// conv后面config插入的neuron、dropout并进conv的输出，见FuseAct；层和节点按新顺序重新编号
+// relu以外的激活GPU上走cudnn，不融合
+void ParaNNet::fuse_layers ()
+{ vector<ParaLayer> fused;
+  for (size_t i = 0; i < paraLayer_.size(); ++i)
+  { ParaLayer pl = paraLayer_[i];
+    if (pl.type == kConvolution && (pl.neuron == 0 || pl.neuron == RELU) && (pl.neuron > 0 || pl.dbase > 0.))
+    { pl.isFused = true;
+      i += (pl.neuron > 0) + (pl.dbase > 0.);
+    }
+    pl.idxs = fused.size();
+    pl.idxd = pl.idxs + 1;
+    fused.push_back (pl);
+  }
+  LOG (INFO) << "\tlayers fused\t" << paraLayer_.size() << " -> " << fused.size();
+  paraLayer_.swap (fused);
+}
+
 int ParaNNet::get_layer_type (const char *t)
 { if (!strcmp (t, "conv"	)) return kConvolution;
   if (!strcmp (t, "dropout"	)) return kDropout;
@@ -35,6 +53,16 @@ int ParaNNet::get_layer_type (const char *t)
   return 0;
 }
 
+int ParaNNet::get_plan_type (const char *t)
+{ if (!strcmp (t, "none"	)) return kPlanNone;
+  if (!strcmp (t, "train"	)) return kPlanTrain;
+  if (!strcmp (t, "eval"	)) return kPlanEval;
+  if (!strcmp (t, "infer"	)) return kPlanInfer;
+  if (!strcmp (t, "recomp"	)) return kPlanRecomp;
+  LOG (FATAL) << "unknown plan type";
+  return 0;
+}
+
 void ParaNNet::config (const libconfig::Config &cfg)
 { min_device = cfg.lookup ("model.min_device");
   max_device = cfg.lookup ("model.max_device");
@@ -42,6 +70,18 @@ void ParaNNet::config (const libconfig::Config &cfg)
   num_nnets  = max_device + 1;
   num_evals  = cfg.lookup ("model.num_evals");
   num_evals /= num_device;
+  seed = 1;
+  if (cfg.exists ("model.seed"))  // 可选，同一种子的训练逐位可复现
+    seed = cfg.lookup ("model.seed");
+  plan = kPlanNone;
+  recomp_mb = 0;
+  if (cfg.exists ("model.plan"))  // 可选，按train/eval/infer/recomp的活跃区间共用节点内存
+    plan = get_plan_type (cfg.lookup ("model.plan"));
+  if (cfg.exists ("model.recomp_mb"))
+    recomp_mb = cfg.lookup ("model.recomp_mb");
+  int8_batches = 0;
+  if (cfg.exists ("model.int8"))  // 可选，给出校准batch数时量化成int8只做推断
+    int8_batches = cfg.lookup ("model.int8");
   stt_round  = cfg.lookup ("model.stt_round");
   end_round  = cfg.lookup ("model.end_round");
   max_round  = cfg.lookup ("model.max_round");
@@ -83,6 +123,7 @@ void ParaNNet::config (const libconfig::Config &cfg)
     pl.type	= get_layer_type (layer_type[i]);
     pl.idxs	= idxn;
     pl.idxd	= idxn+1;
+    pl.seed	= (int)((unsigned)seed << 8 | i);  // 层号与dropout的subseq一样不超过256
     pl.ksize	= ksize[i];
     pl.pad	= pad[i];
     pl.stride	= stride[i];
@@ -93,6 +134,10 @@ void ParaNNet::config (const libconfig::Config &cfg)
     pl.pool	= pool[i];
     pl.dbase	= dropout[i];
     pl.loss	= loss[i];
+    if (cfg.exists ("layer.half"))  // 可选，逐层选择16位存储
+      pl.isHalf	= (int)cfg.lookup ("layer.half")[i];
+    if (cfg.exists ("layer.regen"))  // 可选，dropout反传时重算mask
+      pl.isRegen	= (int)cfg.lookup ("layer.regen")[i];
 
     if (pl.type == kConvolution || pl.type == kFullConn)
     { pl.isLoad	= isLoad[j];
@@ -124,6 +169,8 @@ void ParaNNet::config (const libconfig::Config &cfg)
   }
   for (int i = 0; i < max_fixed_layer; i++)
     paraLayer_[i].isFixed = true;
+  if (cfg.exists ("model.fuse") && (bool)cfg.lookup ("model.fuse"))  // 可选，存下的模型按层号命名，融合后层号会变
+    fuse_layers ();
 
   paraWmat_.clear();
   paraBias_.clear();
@@ -147,6 +194,8 @@ void ParaNNet::config (const libconfig::Config &cfg)
   model_.set_para (cfg);
 
   shape_src = Shape (tFormat_.rows, tFormat_.cols, tFormat_.chls, tFormat_.nums);
+  shape_src.set_layout (tFormat_.layout);
+  CHECK (tFormat_.layout == kNCHW || dataType == "image") << "\ttformat.layout only applies to image data";
   shape_dst = Shape (tFormat_.numClass, 1, 1, tFormat_.nums);
 
   num_layers = paraLayer_.size();
@@ -190,6 +239,14 @@ LayerBase<XPU>* create_layer (ParaLayer &pl, const int did, Tensor<XPU, float> &
 template LayerBase<GPU>* create_layer (ParaLayer &pl, const int did, TensorGPUf &src, TensorGPUf &dst);
 template LayerBase<CPU>* create_layer (ParaLayer &pl, const int did, TensorCPUf &src, TensorCPUf &dst);
 
+// 只有CPU卷积的直接卷积能接NCHW16c，其余层都按NCHW算
+template <>
+int get_src_layout<GPU> (const ParaLayer &pl, const int layout) { return kNCHW;  }
+template <>
+int get_src_layout<CPU> (const ParaLayer &pl, const int layout)
+{ return layout == kNCHW16c && pl.type == kConvolution && pl.secc == 1 ? kNCHW16c : kNCHW;
+}
+
 template <typename XPU>
 void LayerBase<XPU>::get_model_info ()
 { char pszstr[16];  sprintf (pszstr, "\t%.2f", pl_.sigma);
@@ -0,0 +1,1284 @@
+#ifndef NNET_CONVOLUTION_
+#define NNET_CONVOLUTION_
+
+#include <chrono>
+#include "../include/nnet.h"
+#include "../include/simd.h"
+
+#define CONV_COL_BYTES	(1 << 20)  // CPU每个线程的列缓冲，K x pc留在L2
+#define CONV_COL_MIN	256        // pc不小于gemm的一个列块
+#define CONV_DIRECT_AREA	(28 * 28)  // 输入平面不小于此时直接卷积，im2col的带宽开销最大
+
+#ifdef __CUDACC__
+template LayerConvolution<GPU>::LayerConvolution (ParaLayer &pl, const int did, TensorGPUf &src, TensorGPUf &dst);
+#else
+template LayerConvolution<CPU>::LayerConvolution (ParaLayer &pl, const int did, TensorCPUf &src, TensorCPUf &dst);
+#endif
+
+#ifndef __CUDACC__
+// 不复制数据，把一段连续内存看成rows x cols的矩阵给blas_gemm用
+static TensorCPUf mat_ref (float *dptr, const int rows, const int cols)
+{ TensorCPUf t;
+  t.shape = Shape (rows, cols, 1, 1);
+  t.dptr  = dptr;
+  return t;
+}
+
+// 滤波器变换的缓存，换了算法或tile尺寸会变
+static void fit_cache (TensorCPUf &t, const Shape &s, const int did)
+{ if (t.dptr == NULL || t.size() != s.size)
+    t.create (s, did);
+}
+
+// nums为1时src_[i]按dims切的是行，这里总按图像取
+static TensorCPUf img_ref (const TensorCPUf &t, const int i)
+{ TensorCPUf r;
+  r.shape = Shape (t.rows(), t.cols(), t.chls(), 1);
+  r.dptr  = t.dptr + (int64_t)i * r.size();
+  return r;
+}
+
+// 一张图的输出有P = h_col * w_col列，按pc列一段做im2col + gemm，K x pc的列缓冲不随图像变大
+template <>
+int LayerConvolution<CPU>::get_col_size () const
+{ const int P = patch_.h_col * patch_.w_col;
+  const int K = chls_ * pl_.ksize * pl_.ksize;
+  const int pc = std::max (CONV_COL_MIN, CONV_COL_BYTES / (K * (int)sizeof(float))) / 16 * 16;
+  return std::min (P, pc);
+}
+
+// 按图像并行，每个任务自带列缓冲；分组时wmat、列、输出都是secc份连续的矩阵，一次strided gemm
+template <>
+void LayerConvolution<CPU>::fprop_cpu ()
+{ const int P  = patch_.h_col * patch_.w_col;
+  const int K  = chls_ * pl_.ksize * pl_.ksize;
+  const int pc = get_col_size ();
+  const TensorCPUf wmat = mat_ref (wmat_.dptr, flts_, dims_);
+  const Epilogue<float> ep (bias_.dptr, true, fuse_.get_slope ());  // isFused时relu也在这里做
+  ThreadPool::get().parallel_for (0, nums_, 1, [&] (const int begin, const int end)
+  { TensorCPUf tcol;  tcol.create (Shape (K, pc, 1, 1), did_);
+    TensorCPUf tout;  if (pc < P)  tout.create (Shape (flts_, pc, 1, 1), did_);
+    for (int i = begin; i < end; ++i)
+    { TensorCPUf img = img_ref (src_, i);
+      float *y = dst_.dptr + (int64_t)i * flts_ * P;
+      for (int p0 = 0; p0 < P; p0 += pc)
+      { const int pw = std::min (pc, P - p0);
+        TensorCPUf col = mat_ref (tcol.dptr, K, pw);
+        img.im2col_fprop (patch_, col, p0);
+        TensorCPUf out = mat_ref (pw == P ? y : tout.dptr, flts_, pw);
+        out.blas_gemm_strided (false, false, secc_, wmat, col, 1.f, 0.f, ep);
+        if (pw < P)
+          for (int f = 0; f < flts_; ++f)
+            memcpy (y + (int64_t)f * P + p0, tout.dptr + f * pw, pw * sizeof(float));
+      }
+    }
+  });
+}
+
+// 每个任务负责一段图像，滤波器和bias的梯度先各自累加，最后归并；src_先用来展开列，再写回输入梯度
+template <>
+void LayerConvolution<CPU>::bprop_cpu (const bool is_prop_grad)
+{ const int P  = patch_.h_col * patch_.w_col;
+  const int K  = chls_ * pl_.ksize * pl_.ksize;
+  const int pc = get_col_size ();
+  const int64_t wsize = wmat_.size();
+  const int T = std::min (ThreadPool::get().size(), nums_);
+  const TensorCPUf wmat = mat_ref (wmat_.dptr, flts_, dims_);
+  TensorCPUf gpart;  if (T > 1)  gpart.create (Shape (1, 1, 1, 1, (T-1) * (wsize + flts_)), did_);
+
+  ThreadPool::get().parallel_for (0, T, 1, [&] (const int begin, const int end)
+  { TensorCPUf tcol;  tcol.create (Shape (K, pc, 1, 1), did_);
+    TensorCPUf tdif;  if (pc < P)  tdif.create (Shape (flts_, pc, 1, 1), did_);
+    TensorCPUf timg;  if (pc < P && is_prop_grad)  timg.create (img_ref (src_, 0).shape, did_);
+    for (int t = begin; t < end; ++t)
+    { float *gw = t == 0 ? gwmat_.dptr : gpart.dptr + (int64_t)(t-1) * (wsize + flts_);
+      float *gb = t == 0 ? gbias_.dptr : gw + wsize;
+      TensorCPUf gwmat = mat_ref (gw, flts_, dims_);
+      memset (gw, 0, wsize  * sizeof(float));
+      memset (gb, 0, flts_ * sizeof(float));
+      for (int i = t * nums_ / T; i < (t+1) * nums_ / T; ++i)
+      { TensorCPUf img = img_ref (src_, i);
+        const float *y = dst_.dptr + (int64_t)i * flts_ * P;
+        if (timg.dptr)
+          timg.mem_set (0);
+        for (int p0 = 0; p0 < P; p0 += pc)
+        { const int pw = std::min (pc, P - p0);
+          TensorCPUf col = mat_ref (tcol.dptr, K, pw);
+          TensorCPUf dif = mat_ref (pw == P ? (float*)y : tdif.dptr, flts_, pw);
+          if (pw < P)
+            for (int f = 0; f < flts_; ++f)
+              memcpy (tdif.dptr + f * pw, y + (int64_t)f * P + p0, pw * sizeof(float));
+          img.im2col_fprop (patch_, col, p0);
+          gwmat.blas_gemm_strided (false, true, secc_, dif, col, 1.f, 1.f);
+          for (int f = 0; f < flts_; ++f)
+          { const float *d = dif.dptr + f * pw;
+            float s = 0.f;
+            for (int q = 0; q < pw; ++q)
+              s += d[q];
+            gb[f] += s;
+          }
+          if (!is_prop_grad)
+            continue;
+          col.blas_gemm_strided (true, false, secc_, wmat, dif, 1.f, 0.f);  // 列缓冲用完，放输入梯度的列
+          if (pw == P)
+          { img.mem_set (0);
+            img.col2im_bprop (patch_, col, p0);
+          } else
+            timg.col2im_bprop (patch_, col, p0);
+        }
+        if (timg.dptr)
+          img.copy (timg);
+      }
+    }
+  });
+
+  for (int t = 1; t < T; ++t)
+  { TensorCPUf gw;  gw = gwmat_;  gw.dptr = gpart.dptr + (int64_t)(t-1) * (wsize + flts_);
+    TensorCPUf gb;  gb = gbias_;  gb.dptr = gw.dptr + wsize;
+    gwmat_ += gw;
+    gbias_ += gb;
+  }
+}
+
+
+
+// winograd F(m x m, 3 x 3)，Y = A^T [(G g G^T) .* (B^T d B)] A，tile边长a = m+2，系数取Lavin & Gray
+template <int M> struct Wino;
+template <> struct Wino<2>
+{ static const int A = 4;
+  static const float BT[4][4], G[4][3], AT[2][4];
+};
+template <> struct Wino<4>
+{ static const int A = 6;
+  static const float BT[6][6], G[6][3], AT[4][6];
+};
+const float Wino<2>::BT[4][4] =
+{ { 1,  0, -1,  0 },
+  { 0,  1,  1,  0 },
+  { 0, -1,  1,  0 },
+  { 0,  1,  0, -1 } };
+const float Wino<2>::G[4][3] =
+{ { 1.f,  0.f,  0.f },
+  { .5f,  .5f,  .5f },
+  { .5f, -.5f,  .5f },
+  { 0.f,  0.f,  1.f } };
+const float Wino<2>::AT[2][4] =
+{ { 1,  1,  1,  0 },
+  { 0,  1, -1, -1 } };
+const float Wino<4>::BT[6][6] =
+{ { 4,  0, -5,  0,  1,  0 },
+  { 0, -4, -4,  1,  1,  0 },
+  { 0,  4, -4, -1,  1,  0 },
+  { 0, -2, -1,  2,  1,  0 },
+  { 0,  2, -1, -2,  1,  0 },
+  { 0,  4,  0, -5,  0,  1 } };
+const float Wino<4>::G[6][3] =
+{ {  1/4.f,      0.f,     0.f },
+  { -1/6.f,  -1/6.f,  -1/6.f },
+  { -1/6.f,   1/6.f,  -1/6.f },
+  { 1/24.f,  1/12.f,   1/6.f },
+  { 1/24.f, -1/12.f,   1/6.f },
+  {    0.f,     0.f,     1.f } };
+const float Wino<4>::AT[4][6] =
+{ { 1,  1,  1,  1,  1,  0 },
+  { 0,  1, -1,  2, -2,  0 },
+  { 0,  1,  1,  4,  4,  0 },
+  { 0,  1, -1,  8, -8,  1 } };
+
+#define WINO_TILE_BYTES	(1 << 21)  // 每个任务的V、M缓冲
+#define WINO_TILE_MIN	64         // 一段至少这么多tile，gemm的列数不至于太小
+
+// 滤波器变到winograd域，U[t]是secc份rows x cols的矩阵：前向[f][c]，反传[c][f]且核旋转180度
+template <int M>
+static void wino_filter (const float *w, const int secc, const int flts, const int chls, const bool bwd, float *U)
+{ const int A = Wino<M>::A;
+  const int fg = flts / secc, cg = chls / secc;
+  const int rows = bwd ? cg : fg, cols = bwd ? fg : cg;
+  const int64_t tsize = (int64_t)secc * rows * cols;
+  ThreadPool::get().parallel_for (0, flts, 1, [&] (const int begin, const int end)
+  { for (int f = begin; f < end; ++f)
+      for (int c = 0; c < cg; ++c)
+      { const float *k = w + ((int64_t)f * cg + c) * 9;
+        float gg[A][3], u[A][A];
+        for (int i = 0; i < A; ++i)
+          for (int j = 0; j < 3; ++j)
+          { float s = 0.f;
+            for (int r = 0; r < 3; ++r)
+              s += Wino<M>::G[i][r] * (bwd ? k[(2-r)*3 + 2-j] : k[r*3 + j]);
+            gg[i][j] = s;
+          }
+        for (int i = 0; i < A; ++i)
+          for (int j = 0; j < A; ++j)
+            u[i][j] = gg[i][0] * Wino<M>::G[j][0] + gg[i][1] * Wino<M>::G[j][1] + gg[i][2] * Wino<M>::G[j][2];
+        const int64_t off = ((int64_t)(f / fg) * rows + (bwd ? c : f % fg)) * cols + (bwd ? f % fg : c);
+        for (int t = 0; t < A * A; ++t)
+          U[t * tsize + off] = u[t/A][t%A];
+      }
+  });
+}
+
+// 按图像并行，每张图的tile按nt个一段：输入变换到V[t]（C x nt），T*secc个gemm得到M[t]（F x nt），再逆变换写回
+// stride为1，out的尺寸决定tile数，越界的输入按pad补零，越界的输出丢掉
+template <int M>
+static void wino_conv (const float *U, const int secc, const TensorCPUf &in, const int pad, const float *bias, const TensorCPUf &out)
+{ const int A = Wino<M>::A, T = A * A;
+  const int C = in .chls(), H  = in .rows(), W  = in .cols();
+  const int F = out.chls(), Ho = out.rows(), Wo = out.cols();
+  const int tw = (Wo + M - 1) / M, ntiles = (Ho + M - 1) / M * tw;
+  const int nt = std::min (ntiles, std::max (WINO_TILE_MIN, WINO_TILE_BYTES / (T * (C + F) * (int)sizeof(float))));
+  const TensorCPUf umat = mat_ref ((float*)U, T * F, C / secc);
+  ThreadPool::get().parallel_for (0, in.nums(), 1, [&] (const int begin, const int end)
+  { TensorCPUf tv;  tv.create (Shape (T * C, nt, 1, 1), in.did_);
+    TensorCPUf tm;  tm.create (Shape (T * F, nt, 1, 1), in.did_);
+    for (int i = begin; i < end; ++i)
+    { const float *x = in .dptr + (int64_t)i * C * H  * W;
+      float       *y = out.dptr + (int64_t)i * F * Ho * Wo;
+      for (int j0 = 0; j0 < ntiles; j0 += nt)
+      { const int jn = std::min (nt, ntiles - j0);
+        for (int c = 0; c < C; ++c)
+          for (int j = 0; j < jn; ++j)
+          { const int ih0 = (j0 + j) / tw * M - pad, iw0 = (j0 + j) % tw * M - pad;
+            const float *xc = x + (int64_t)c * H * W;
+            float d[A][A], bd[A][A];
+            for (int r = 0; r < A; ++r)
+              for (int q = 0; q < A; ++q)
+              { const int ih = ih0 + r, iw = iw0 + q;
+                d[r][q] = ih >= 0 && ih < H && iw >= 0 && iw < W ? xc[ih * W + iw] : 0.f;
+              }
+            for (int r = 0; r < A; ++r)
+              for (int q = 0; q < A; ++q)
+              { float s = 0.f;
+                for (int k = 0; k < A; ++k)
+                  s += Wino<M>::BT[r][k] * d[k][q];
+                bd[r][q] = s;
+              }
+            for (int r = 0; r < A; ++r)
+              for (int q = 0; q < A; ++q)
+              { float s = 0.f;
+                for (int k = 0; k < A; ++k)
+                  s += bd[r][k] * Wino<M>::BT[q][k];
+                tv.dptr[((int64_t)(r * A + q) * C + c) * jn + j] = s;
+              }
+          }
+        TensorCPUf vmat = mat_ref (tv.dptr, T * C, jn);
+        TensorCPUf mmat = mat_ref (tm.dptr, T * F, jn);
+        mmat.blas_gemm_strided (false, false, T * secc, umat, vmat, 1.f, 0.f);
+        for (int f = 0; f < F; ++f)
+          for (int j = 0; j < jn; ++j)
+          { const int oh0 = (j0 + j) / tw * M, ow0 = (j0 + j) % tw * M;
+            float am[M][A];
+            for (int r = 0; r < M; ++r)
+              for (int q = 0; q < A; ++q)
+              { float s = 0.f;
+                for (int k = 0; k < A; ++k)
+                  s += Wino<M>::AT[r][k] * tm.dptr[((int64_t)(k * A + q) * F + f) * jn + j];
+                am[r][q] = s;
+              }
+            const float b = bias ? bias[f] : 0.f;
+            for (int r = 0; r < M && oh0 + r < Ho; ++r)
+              for (int q = 0; q < M && ow0 + q < Wo; ++q)
+              { float s = b;
+                for (int k = 0; k < A; ++k)
+                  s += am[r][k] * Wino<M>::AT[q][k];
+                y[((int64_t)f * Ho + oh0 + r) * Wo + ow0 + q] = s;
+              }
+          }
+      }
+    }
+  });
+}
+
+template <>
+void LayerConvolution<CPU>::fprop_wino ()
+{ const int T = algo_ == kConvWino4 ? 36 : 16;
+  if (!(wstat_ & 1))
+  { fit_cache (wfwd_, Shape (T * flts_, chls_ / secc_, 1, 1), did_);
+    if (algo_ == kConvWino4)  wino_filter<4> (wmat_.dptr, secc_, flts_, chls_, false, wfwd_.dptr);
+    else                      wino_filter<2> (wmat_.dptr, secc_, flts_, chls_, false, wfwd_.dptr);
+    wstat_ |= 1;
+  }
+  if (algo_ == kConvWino4)  wino_conv<4> (wfwd_.dptr, secc_, src_, pl_.pad, bias_.dptr, dst_);
+  else                      wino_conv<2> (wfwd_.dptr, secc_, src_, pl_.pad, bias_.dptr, dst_);
+}
+
+// 输入梯度是dst_与旋转180度、输入输出互换的核做pad为2-pad的卷积，尺寸正好回到src_
+template <>
+void LayerConvolution<CPU>::bprop_wino ()
+{ const int T = algo_ == kConvWino4 ? 36 : 16;
+  if (!(wstat_ & 2))
+  { fit_cache (wbwd_, Shape (T * chls_, flts_ / secc_, 1, 1), did_);
+    if (algo_ == kConvWino4)  wino_filter<4> (wmat_.dptr, secc_, flts_, chls_, true, wbwd_.dptr);
+    else                      wino_filter<2> (wmat_.dptr, secc_, flts_, chls_, true, wbwd_.dptr);
+    wstat_ |= 2;
+  }
+  if (algo_ == kConvWino4)  wino_conv<4> (wbwd_.dptr, secc_, dst_, 2 - pl_.pad, NULL, src_);
+  else                      wino_conv<2> (wbwd_.dptr, secc_, dst_, 2 - pl_.pad, NULL, src_);
+}
+
+
+// 直接卷积，输入输出都按NCHW16c，16个通道正好一个avx512向量；寄存器块为RW个位置 x 16通道，不展开im2col
+// 权重按16x16块重排：前向[fb][cb][kh][kw][ci][fo]，反传[fb][cb][kh][kw][fo][ci]，补齐的通道为0
+static void direct_pack (const float *w, const int flts, const int chls, const int ksize, const bool bwd, float *wb)
+{ const int Cb = (chls + 15) / 16, kk = ksize * ksize;
+  ThreadPool::get().parallel_for (0, (flts + 15) / 16 * Cb, 1, [&] (const int begin, const int end)
+  { for (int b = begin; b < end; ++b)
+    { const int fb = b / Cb, cb = b % Cb;
+      float *wp = wb + (int64_t)b * kk * 256;
+      for (int k = 0; k < kk; ++k)
+        for (int i = 0; i < 16; ++i)
+          for (int o = 0; o < 16; ++o)
+          { const int f = fb * 16 + (bwd ? i : o), c = cb * 16 + (bwd ? o : i);
+            wp[k*256 + i*16 + o] = f < flts && c < chls ? w[((int64_t)f * chls + c) * kk + k] : 0.f;
+          }
+    }
+  });
+}
+
+static const float direct_zero[16] = { 0.f };  // 越界的位置指到这里，内层循环不用判断
+
+// 输出一行(n, fb, oh)：y[ow][fo] = bias + sum x[cb][ih][iw][ci] * w[cb][kh][kw][ci][fo]
+template <int W>
+SIMD_INLINE void direct_fwd_row (const float *x, const float *w, const float *bias, float *y,
+  const int Cb, const int H, const int Wi, const int Wo, const int ksize, const int stride, const int pad, const int oh)
+{ typedef Packet<float, W> P;
+  const int L = P::lanes, NV = 16 / L, RW = 12 / NV;
+  for (int ow0 = 0; ow0 < Wo; ow0 += RW)
+  { const int rn = std::min (RW, Wo - ow0);
+    P acc[RW][NV];
+    for (int r = 0; r < RW; ++r)
+      for (int v = 0; v < NV; ++v)
+        acc[r][v] = P::load (bias + v*L);
+    for (int cb = 0; cb < Cb; ++cb)
+      for (int kh = 0; kh < ksize; ++kh)
+      { const int ih = oh * stride - pad + kh;
+        if (ih < 0 || ih >= H)
+          continue;
+        const float *xrow = x + ((int64_t)cb * H + ih) * Wi * 16;
+        for (int kw = 0; kw < ksize; ++kw)
+        { const float *xp[RW];
+          for (int r = 0; r < RW; ++r)
+          { const int iw = (ow0 + r) * stride - pad + kw;
+            xp[r] = r < rn && iw >= 0 && iw < Wi ? xrow + iw * 16 : direct_zero;
+          }
+          const float *wp = w + ((int64_t)(cb * ksize + kh) * ksize + kw) * 256;
+          for (int ci = 0; ci < 16; ++ci)
+          { P wv[NV];
+            for (int v = 0; v < NV; ++v)
+              wv[v] = P::load (wp + ci*16 + v*L);
+            for (int r = 0; r < RW; ++r)
+            { const P xv (xp[r][ci]);
+              for (int v = 0; v < NV; ++v)
+                acc[r][v] = fmadd (xv, wv[v], acc[r][v]);
+            }
+          }
+        }
+      }
+    for (int r = 0; r < rn; ++r)
+      for (int v = 0; v < NV; ++v)
+        acc[r][v].store (y + (ow0 + r) * 16 + v*L);
+  }
+}
+
+// 输入梯度一行(n, cb, ih)：dx[iw][ci] = sum dy[fb][oh][ow][fo] * w[fb][cb][kh][kw][fo][ci]，ih = oh*stride - pad + kh
+template <int W>
+SIMD_INLINE void direct_bwd_row (const float *dy, const float *w, float *dx, const int Fb, const int Cb, const int cb,
+  const int Ho, const int Wo, const int Wi, const int ksize, const int stride, const int pad, const int ih)
+{ typedef Packet<float, W> P;
+  const int L = P::lanes, NV = 16 / L, RW = 12 / NV;
+  for (int iw0 = 0; iw0 < Wi; iw0 += RW)
+  { const int rn = std::min (RW, Wi - iw0);
+    P acc[RW][NV];
+    for (int r = 0; r < RW; ++r)
+      for (int v = 0; v < NV; ++v)
+        acc[r][v] = P (0.f);
+    for (int fb = 0; fb < Fb; ++fb)
+      for (int kh = 0; kh < ksize; ++kh)
+      { const int t = ih + pad - kh;
+        if (t < 0 || t % stride != 0 || t / stride >= Ho)
+          continue;
+        const float *dyrow = dy + ((int64_t)fb * Ho + t / stride) * Wo * 16;
+        for (int kw = 0; kw < ksize; ++kw)
+        { const float *dp[RW];
+          for (int r = 0; r < RW; ++r)
+          { const int u = iw0 + r + pad - kw;
+            dp[r] = r < rn && u >= 0 && u % stride == 0 && u / stride < Wo ? dyrow + u / stride * 16 : direct_zero;
+          }
+          const float *wp = w + (((int64_t)fb * Cb + cb) * ksize * ksize + kh * ksize + kw) * 256;
+          for (int fo = 0; fo < 16; ++fo)
+          { P wv[NV];
+            for (int v = 0; v < NV; ++v)
+              wv[v] = P::load (wp + fo*16 + v*L);
+            for (int r = 0; r < RW; ++r)
+            { const P dv (dp[r][fo]);
+              for (int v = 0; v < NV; ++v)
+                acc[r][v] = fmadd (dv, wv[v], acc[r][v]);
+            }
+          }
+        }
+      }
+    for (int r = 0; r < rn; ++r)
+      for (int v = 0; v < NV; ++v)
+        acc[r][v].store (dx + (iw0 + r) * 16 + v*L);
+  }
+}
+
+// 滤波器梯度的一块(fb, cb, kh)：gw[kw][ci][fo] = sum_n,oh,ow x[ci] * dy[fo]，ci按CB个一组留在寄存器里
+template <int W>
+SIMD_INLINE void direct_wgt_blk (const float *x, const float *dy, float *gw, const int N, const int Fb, const int Cb,
+  const int fb, const int cb, const int kh, const int H, const int Wi, const int Ho, const int Wo,
+  const int ksize, const int stride, const int pad)
+{ typedef Packet<float, W> P;
+  const int L = P::lanes, NV = 16 / L, CB = NV == 1 ? 16 : 8 / NV;
+  for (int kw = 0; kw < ksize; ++kw)
+  { const int lo = pad > kw ? (pad - kw + stride - 1) / stride : 0;
+    const int hi = Wi - 1 + pad - kw < 0 ? 0 : std::min (Wo, (Wi - 1 + pad - kw) / stride + 1);
+    float *g = gw + (int64_t)kw * 256;
+    for (int ci0 = 0; ci0 < 16; ci0 += CB)
+    { P acc[CB][NV];
+      for (int c = 0; c < CB; ++c)
+        for (int v = 0; v < NV; ++v)
+          acc[c][v] = P (0.f);
+      for (int n = 0; n < N; ++n)
+        for (int oh = 0; oh < Ho; ++oh)
+        { const int ih = oh * stride - pad + kh;
+          if (ih < 0 || ih >= H)
+            continue;
+          const float *xrow  = x  + (((int64_t)n * Cb + cb) * H  + ih) * Wi * 16 + ci0;
+          const float *dyrow = dy + (((int64_t)n * Fb + fb) * Ho + oh) * Wo * 16;
+          for (int ow = lo; ow < hi; ++ow)
+          { const float *xp = xrow + (ow * stride - pad + kw) * 16;
+            P dv[NV];
+            for (int v = 0; v < NV; ++v)
+              dv[v] = P::load (dyrow + ow * 16 + v*L);
+            for (int c = 0; c < CB; ++c)
+            { const P xv (xp[c]);
+              for (int v = 0; v < NV; ++v)
+                acc[c][v] = fmadd (xv, dv[v], acc[c][v]);
+            }
+          }
+        }
+      for (int c = 0; c < CB; ++c)
+        for (int v = 0; v < NV; ++v)
+          acc[c][v].store (g + (ci0 + c) * 16 + v*L);
+    }
+  }
+}
+
+#define DIRECT_TARGET(level, attr, W) \
+static attr void direct_fwd_row_ ## level (const float *x, const float *w, const float *bias, float *y, \
+  const int Cb, const int H, const int Wi, const int Wo, const int ksize, const int stride, const int pad, const int oh) \
+{ direct_fwd_row<W> (x, w, bias, y, Cb, H, Wi, Wo, ksize, stride, pad, oh);  } \
+static attr void direct_bwd_row_ ## level (const float *dy, const float *w, float *dx, const int Fb, const int Cb, const int cb, \
+  const int Ho, const int Wo, const int Wi, const int ksize, const int stride, const int pad, const int ih) \
+{ direct_bwd_row<W> (dy, w, dx, Fb, Cb, cb, Ho, Wo, Wi, ksize, stride, pad, ih);  } \
+static attr void direct_wgt_blk_ ## level (const float *x, const float *dy, float *gw, const int N, const int Fb, const int Cb, \
+  const int fb, const int cb, const int kh, const int H, const int Wi, const int Ho, const int Wo, \
+  const int ksize, const int stride, const int pad) \
+{ direct_wgt_blk<W> (x, dy, gw, N, Fb, Cb, fb, cb, kh, H, Wi, Ho, Wo, ksize, stride, pad);  }
+
+#ifdef SIMD_X86
+DIRECT_TARGET (sse,    __attribute__((target("sse2"))),     16)
+DIRECT_TARGET (avx2,   __attribute__((target("avx2,fma"))), 32)
+DIRECT_TARGET (avx512, __attribute__((target("avx512f"))),  64)
+#define CONV_DISPATCH(name, ...) \
+  do { const int level = simd_level (); \
+    if      (level >= kSimdAVX512)  name ## _avx512 (__VA_ARGS__); \
+    else if (level >= kSimdAVX2)    name ## _avx2   (__VA_ARGS__); \
+    else                            name ## _sse    (__VA_ARGS__); \
+  } while (0)
+#else
+DIRECT_TARGET (sse,    , 16)
+#define CONV_DISPATCH(name, ...)  name ## _sse (__VA_ARGS__)
+#endif
+
+// 各设备的直接卷积共用内存池的一块，层是串行的；只增不减，init后就是最大那层的大小
+// 只存裸指针，没有析构：静态Tensor退出时晚于MemPool析构，free会落在已析构的池上
+static float  *direct_ws[CUDA_NUM_DEVICES];
+static int64_t direct_wn[CUDA_NUM_DEVICES];
+static int64_t direct_need[CUDA_NUM_DEVICES];  // 选定直接卷积的层里最大的需求
+
+static float *direct_space (const int did, const int64_t size)
+{ if (direct_wn[did] < size)
+  { MemPool<CPU> &pool = MemPool<CPU>::get (did);
+    if (direct_ws[did])
+      pool.free (direct_ws[did]);
+    direct_ws[did] = (float*)pool.alloc (size * sizeof(float));
+    direct_wn[did] = size;
+  }
+  return direct_ws[did];
+}
+
+// 试跑直接卷积撑大的部分还回去，只留选定直接卷积的层要的大小
+static void direct_trim (const int did)
+{ if (direct_wn[did] <= direct_need[did])
+    return;
+  MemPool<CPU>::get (did).free (direct_ws[did]);
+  direct_ws[did] = NULL;
+  direct_wn[did] = 0;
+  if (direct_need[did] > 0)
+    direct_space (did, direct_need[did]);
+}
+
+// t在共用缓冲里的分块副本要的元素数，t已是NCHW16c时不用
+static int64_t direct_blocked_size (const TensorCPUf &t)
+{ if (t.shape.layout == kNCHW16c)
+    return 0;
+  Shape s = t.shape;  s.set_layout (kNCHW16c);
+  return s.size;
+}
+
+// src_不是NCHW16c时整批转一次，放在共用缓冲的space处，额外内存只有一份激活，不是im2col的ksize^2倍
+static float *direct_blocked (const TensorCPUf &t, TensorCPUf &b, const bool load, float *space)
+{ if (t.shape.layout == kNCHW16c)
+  { b = t;
+    return space;
+  }
+  b.shape = t.shape;  b.shape.set_layout (kNCHW16c);
+  b.dptr  = space;
+  if (load)
+    b.relayout (t);
+  return space + b.size();
+}
+
+// 前向放xb、yb，反传再加滤波器梯度的分块
+template <>
+int64_t LayerConvolution<CPU>::get_direct_space () const
+{ const int64_t Fb = (flts_ + 15) / 16, Cb = (chls_ + 15) / 16, kk = pl_.ksize * pl_.ksize;
+  return direct_blocked_size (src_) + direct_blocked_size (dst_) + Fb * Cb * kk * 256;
+}
+
+template <>
+void LayerConvolution<CPU>::fprop_direct ()
+{ const int Fb = (flts_ + 15) / 16, Cb = (chls_ + 15) / 16, kk = pl_.ksize * pl_.ksize;
+  if (!(wstat_ & 1))
+  { fit_cache (wfwd_, Shape (Fb * Cb * kk, 256, 1, 1), did_);
+    direct_pack (wmat_.dptr, flts_, chls_, pl_.ksize, false, wfwd_.dptr);
+    wstat_ |= 1;
+  }
+  vector<float> bias (Fb * 16, 0.f);
+  memcpy (bias.data(), bias_.dptr, flts_ * sizeof(float));
+  TensorCPUf xb, yb;
+  float *space = direct_space (did_, get_direct_space ());
+  space = direct_blocked (src_, xb, true,  space);
+  direct_blocked (dst_, yb, false, space);
+  const int H = src_.rows(), Wi = src_.cols(), Ho = dst_.rows(), Wo = dst_.cols();
+  ThreadPool::get().parallel_for (0, nums_ * Fb * Ho, 1, [&] (const int begin, const int end)
+  { for (int r = begin; r < end; ++r)
+    { const int n = r / (Fb * Ho), fb = r / Ho % Fb, oh = r % Ho;
+      CONV_DISPATCH (direct_fwd_row, xb.dptr + (int64_t)n * Cb * H * Wi * 16, wfwd_.dptr + (int64_t)fb * Cb * kk * 256,
+        bias.data() + fb * 16, yb.dptr + (((int64_t)n * Fb + fb) * Ho + oh) * Wo * 16,
+        Cb, H, Wi, Wo, pl_.ksize, pl_.stride, pl_.pad, oh);
+    }
+  });
+  if (yb.dptr != dst_.dptr)
+    dst_.relayout (yb);
+}
+
+template <>
+void LayerConvolution<CPU>::bprop_direct (const bool is_prop_grad)
+{ const int Fb = (flts_ + 15) / 16, Cb = (chls_ + 15) / 16, kk = pl_.ksize * pl_.ksize;
+  const int H = src_.rows(), Wi = src_.cols(), Ho = dst_.rows(), Wo = dst_.cols();
+  TensorCPUf xb, yb;
+  float *space = direct_space (did_, get_direct_space ());
+  space = direct_blocked (src_, xb, true, space);
+  space = direct_blocked (dst_, yb, true, space);
+
+  const TensorCPUf gwb = mat_ref (space, Fb * Cb * kk, 256);
+  ThreadPool::get().parallel_for (0, Fb * Cb * pl_.ksize, 1, [&] (const int begin, const int end)
+  { for (int b = begin; b < end; ++b)
+    { const int fb = b / (Cb * pl_.ksize), cb = b / pl_.ksize % Cb, kh = b % pl_.ksize;
+      CONV_DISPATCH (direct_wgt_blk, xb.dptr, yb.dptr, gwb.dptr + (((int64_t)fb * Cb + cb) * kk + kh * pl_.ksize) * 256,
+        nums_, Fb, Cb, fb, cb, kh, H, Wi, Ho, Wo, pl_.ksize, pl_.stride, pl_.pad);
+    }
+  });
+  ThreadPool::get().parallel_for (0, flts_, 1, [&] (const int begin, const int end)
+  { for (int f = begin; f < end; ++f)
+    { for (int c = 0; c < chls_; ++c)
+        for (int k = 0; k < kk; ++k)
+          gwmat_.dptr[((int64_t)f * chls_ + c) * kk + k] =
+            gwb.dptr[(((int64_t)f / 16 * Cb + c / 16) * kk + k) * 256 + c % 16 * 16 + f % 16];
+      const float *d = yb.dptr + (int64_t)f / 16 * Ho * Wo * 16 + f % 16;
+      float s = 0.f;
+      for (int n = 0; n < nums_; ++n)
+        for (int p = 0; p < Ho * Wo; ++p)
+          s += d[((int64_t)n * Fb * Ho * Wo + p) * 16];
+      gbias_.dptr[f] = s;
+    }
+  });
+  if (!is_prop_grad)
+    return;
+
+  if (!(wstat_ & 2))
+  { fit_cache (wbwd_, Shape (Fb * Cb * kk, 256, 1, 1), did_);
+    direct_pack (wmat_.dptr, flts_, chls_, pl_.ksize, true, wbwd_.dptr);
+    wstat_ |= 2;
+  }
+  // 滤波器梯度算完，xb用来放输入梯度
+  ThreadPool::get().parallel_for (0, nums_ * Cb * H, 1, [&] (const int begin, const int end)
+  { for (int r = begin; r < end; ++r)
+    { const int n = r / (Cb * H), cb = r / H % Cb, ih = r % H;
+      CONV_DISPATCH (direct_bwd_row, yb.dptr + (int64_t)n * Fb * Ho * Wo * 16, wbwd_.dptr,
+        xb.dptr + (((int64_t)n * Cb + cb) * H + ih) * Wi * 16,
+        Fb, Cb, cb, Ho, Wo, Wi, pl_.ksize, pl_.stride, pl_.pad, ih);
+    }
+  });
+  if (xb.dptr != src_.dptr)
+    src_.relayout (xb);
+}
+
+
+// FFT卷积，tile边长T取2的幂，重叠相加：输入按B = T-k+1切块，块与核的相关长B+k-1不超过T，循环卷积不会绕回
+// 先沿行方向变换全部列，实输入只留前H = T/2+1行，转置后再沿另一维变换，谱按[k2][k1]存T x H个
+// 两步都是一层蝶形对整行向量化；谱的实部虚部分开存，乘加循环按向量走
+#define FFT_SPEC_BYTES	(64 << 20)  // 滤波器谱的缓存上限，超了不选FFT
+#define FFT_COST_RATIO	2          // FFT每个flop比gemm慢的倍数，选算法时用
+#define FFT_TILE_BYTES	(1 << 21)  // 每个任务一批tile的谱缓冲
+
+struct FFTPlan
+{ int n;
+  vector<int> rev;
+  vector<float> wr, wi;
+  explicit FFTPlan (const int n) : n(n), rev(n), wr(n/2), wi(n/2)
+  { int logn = 0;
+    while ((1 << logn) < n)
+      ++logn;
+    for (int i = 0; i < n; ++i)
+    { rev[i] = 0;
+      for (int b = 0; b < logn; ++b)
+        rev[i] |= (i >> b & 1) << (logn - 1 - b);
+    }
+    for (int i = 0; i < n/2; ++i)
+    { wr[i] = (float)cos (2 * M_PI * i / n);
+      wi[i] = (float)-sin (2 * M_PI * i / n);
+    }
+  }
+};
+
+// 每个任务的变换缓冲，大小只和T有关
+struct FFTBuffer
+{ vector<float> tile, ar, ai, sr, si;
+  explicit FFTBuffer (const int T) : tile(T*T), ar(T*T), ai(T*T), sr(T*(T/2+1)), si(T*(T/2+1)) { }
+};
+
+// n行m列，每一列沿行方向原地做长n的基2变换，逆变换不除n
+template <int W>
+SIMD_INLINE void fft_rows (const FFTPlan &p, float *re, float *im, const int m, const bool inv)
+{ typedef Packet<float, W> P;
+  const int n = p.n, L = P::lanes;
+  for (int i = 0; i < n; ++i)
+    if (i < p.rev[i])
+    { std::swap_ranges (re + i * m, re + (i+1) * m, re + p.rev[i] * m);
+      std::swap_ranges (im + i * m, im + (i+1) * m, im + p.rev[i] * m);
+    }
+  for (int len = 2; len <= n; len <<= 1)
+  { const int half = len >> 1, step = n / len;
+    for (int i = 0; i < n; i += len)
+      for (int j = 0; j < half; ++j)
+      { const float cr = p.wr[j*step], ci = inv ? -p.wi[j*step] : p.wi[j*step];
+        float *ar = re + (i + j) * m, *ai = im + (i + j) * m;
+        float *br = ar + half * m,    *bi = ai + half * m;
+        const P vcr (cr), vci (ci);
+        int x = 0;
+        for (; x + L <= m; x += L)
+        { const P xr = P::load (br+x), xi = P::load (bi+x), yr = P::load (ar+x), yi = P::load (ai+x);
+          const P vr = xr * vcr - xi * vci, vi = xr * vci + xi * vcr;
+          (yr - vr).store (br+x);  (yi - vi).store (bi+x);
+          (yr + vr).store (ar+x);  (yi + vi).store (ai+x);
+        }
+        for (; x < m; ++x)
+        { const float vr = br[x] * cr - bi[x] * ci, vi = br[x] * ci + bi[x] * cr;
+          br[x] = ar[x] - vr;  bi[x] = ai[x] - vi;
+          ar[x] += vr;         ai[x] += vi;
+        }
+      }
+  }
+}
+
+// b.tile前rn行之外为零，谱写到re, im
+template <int W>
+SIMD_INLINE void fft2_fwd (const FFTPlan &p, FFTBuffer &b, const int rn, float *re, float *im)
+{ const int T = p.n, H = T/2 + 1;
+  std::copy (b.tile.begin(), b.tile.begin() + rn * T, b.ar.begin());
+  std::fill (b.ar.begin() + rn * T, b.ar.end(), 0.f);
+  std::fill (b.ai.begin(), b.ai.end(), 0.f);
+  fft_rows<W> (p, b.ar.data(), b.ai.data(), T, false);
+  for (int j = 0; j < T; ++j)
+    for (int k = 0; k < H; ++k)
+    { re[j*H + k] = b.ar[k*T + j];
+      im[j*H + k] = b.ai[k*T + j];
+    }
+  fft_rows<W> (p, re, im, H, false);
+}
+
+// 逆变换回b.tile，已除以T*T；k1 > T/2的一半按实信号的共轭对称补回
+template <int W>
+SIMD_INLINE void fft2_inv (const FFTPlan &p, FFTBuffer &b, const float *re, const float *im)
+{ const int T = p.n, H = T/2 + 1;
+  std::copy (re, re + T * H, b.sr.begin());
+  std::copy (im, im + T * H, b.si.begin());
+  fft_rows<W> (p, b.sr.data(), b.si.data(), H, true);
+  for (int k = 0; k < H; ++k)
+    for (int j = 0; j < T; ++j)
+    { b.ar[k*T + j] = b.sr[j*H + k];
+      b.ai[k*T + j] = b.si[j*H + k];
+    }
+  for (int k = H; k < T; ++k)
+    for (int j = 0; j < T; ++j)
+    { b.ar[k*T + j] =  b.ar[(T-k)*T + j];
+      b.ai[k*T + j] = -b.ai[(T-k)*T + j];
+    }
+  fft_rows<W> (p, b.ar.data(), b.ai.data(), T, true);
+  const float scale = 1.f / (T * T);
+  for (int i = 0; i < T * T; ++i)
+    b.tile[i] = b.ar[i] * scale;
+}
+
+// 每个频点是一个复数gemm：acc[t][q] = sum_i x[t][i] .* w_q,i，bwd为false时乘w的共轭
+// 4个输出 x TB个tile的累加器留在寄存器里，同一段频点的w对一批tile复用；x_t,i = x + t*xst + i*2S，w_q,i = w[q] + i*wst
+// S = T*(T/2+1)总是16的倍数
+template <int W>
+SIMD_INLINE void fft_mac (const int S, const int nin, const int nt, const float *x, const int64_t xst,
+  const float *const *w, const int64_t wst, const bool bwd, float *acc)
+{ typedef Packet<float, W> P;
+  const int L = P::lanes, TB = W == 64 ? 2 : 1;
+  for (int k = 0; k < S; k += L)
+    for (int t0 = 0; t0 < nt; t0 += TB)
+    { const int tn = std::min (TB, nt - t0);
+      P sr[TB][4], si[TB][4];
+      for (int t = 0; t < TB; ++t)
+        for (int q = 0; q < 4; ++q)
+          sr[t][q] = si[t][q] = P (0.f);
+      for (int i = 0; i < nin; ++i)
+      { P xr[TB], xi[TB];
+        for (int t = 0; t < TB; ++t)
+        { const float *xp = x + (t0 + std::min (t, tn - 1)) * xst + (int64_t)i * 2 * S + k;
+          xr[t] = P::load (xp);
+          xi[t] = P::load (xp + S);
+        }
+        for (int q = 0; q < 4; ++q)
+        { const float *wp = w[q] + i * wst + k;
+          const P wr = P::load (wp), wi = P::load (wp + S);
+          for (int t = 0; t < TB; ++t)
+            if (bwd)
+            { sr[t][q] = fmadd (xr[t], wr, sr[t][q]) - xi[t] * wi;
+              si[t][q] = fmadd (xi[t], wr, fmadd (xr[t], wi, si[t][q]));
+            } else
+            { sr[t][q] = fmadd (xr[t], wr, fmadd (xi[t], wi, sr[t][q]));
+              si[t][q] = fmadd (xi[t], wr, si[t][q]) - xr[t] * wi;
+            }
+        }
+      }
+      for (int t = 0; t < tn; ++t)
+        for (int q = 0; q < 4; ++q)
+        { float *ap = acc + ((int64_t)(t0 + t) * 4 + q) * 2 * S + k;
+          sr[t][q].store (ap);
+          si[t][q].store (ap + S);
+        }
+    }
+}
+
+#define FFT_TARGET(level, attr, W) \
+static attr void fft2_fwd_ ## level (const FFTPlan &p, FFTBuffer &b, const int rn, float *re, float *im) \
+{ fft2_fwd<W> (p, b, rn, re, im);  } \
+static attr void fft2_inv_ ## level (const FFTPlan &p, FFTBuffer &b, const float *re, const float *im) \
+{ fft2_inv<W> (p, b, re, im);  } \
+static attr void fft_mac_ ## level (const int S, const int nin, const int nt, const float *x, const int64_t xst, \
+  const float *const *w, const int64_t wst, const bool bwd, float *acc) \
+{ fft_mac<W> (S, nin, nt, x, xst, w, wst, bwd, acc);  }
+
+#ifdef SIMD_X86
+FFT_TARGET (sse,    __attribute__((target("sse2"))),     16)
+FFT_TARGET (avx2,   __attribute__((target("avx2,fma"))), 32)
+FFT_TARGET (avx512, __attribute__((target("avx512f"))),  64)
+#else
+FFT_TARGET (sse,    , 16)
+#endif
+
+// 滤波器谱按[f][c][re|im][S]排，前向乘共轭得到相关，反传直接乘得到卷积，两个方向共用
+static void fft_filter (const float *w, const int flts, const int cg, const int ksize, const int T, float *spec)
+{ const FFTPlan p (T);
+  const int S = T * (T/2 + 1);
+  ThreadPool::get().parallel_for (0, flts, 1, [&] (const int begin, const int end)
+  { FFTBuffer b (T);
+    for (int f = begin; f < end; ++f)
+      for (int c = 0; c < cg; ++c)
+      { const float *k = w + ((int64_t)f * cg + c) * ksize * ksize;
+        std::fill (b.tile.begin(), b.tile.end(), 0.f);
+        for (int r = 0; r < ksize; ++r)
+          for (int q = 0; q < ksize; ++q)
+            b.tile[r*T + q] = k[r*ksize + q];
+        float *s = spec + ((int64_t)f * cg + c) * 2 * S;
+        CONV_DISPATCH (fft2_fwd, p, b, ksize, s, s + S);
+      }
+  });
+}
+
+// 前向：in = src_，out = dst_，Y_f = sum_c X_c .* conj W_fc，输入在补pad后的坐标里按B切块，输出只取步长的倍数
+// 反传：in = dst_，out = src_，DX_c = sum_f DY_f .* W_fc，dy按步长摊开到stride-1的坐标里切块，输出去掉pad
+// 按(图像, 输出通道段)并行，每段只变换自己组里的输入通道；tile按nt个一批，谱缓冲不随图像变大
+// 输出先置bias或零再重叠相加
+static void fft_conv (const float *spec, const int T, const int secc, const int ksize, const int stride, const int pad,
+  const bool bwd, const TensorCPUf &in, const float *bias, const TensorCPUf &out)
+{ const FFTPlan p (T);
+  const int H = T/2 + 1, S = T * H, B = T - ksize + 1;
+  const int Ci = in .chls(), Hi = in .rows(), Wi = in .cols(), gi = Ci / secc;
+  const int Co = out.chls(), Ho = out.rows(), Wo = out.cols(), go = Co / secc;
+  const int Fo = bwd ? Hi : Ho, Fw = bwd ? Wi : Wo;  // stride-1坐标里要覆盖的范围由dst_决定
+  const int nbh = ((Fo - 1) * stride + (bwd ? 1 : ksize) + B - 1) / B;
+  const int nbw = ((Fw - 1) * stride + (bwd ? 1 : ksize) + B - 1) / B;
+  const int nq = std::min (Co, (ThreadPool::get().size() + in.nums() - 1) / in.nums());
+  ThreadPool::get().parallel_for (0, in.nums() * nq, 1, [&] (const int begin, const int end)
+  { FFTBuffer b (T);
+    vector<float> xs, acc;
+    for (int t = begin; t < end; ++t)
+    { const int n = t / nq, o0 = t % nq * Co / nq, o1 = (t % nq + 1) * Co / nq;
+      const int i0 = o0 / go * gi, i1 = ((o1 - 1) / go + 1) * gi, ni = i1 - i0;
+      const int nt = std::max (1, std::min (nbh * nbw, FFT_TILE_BYTES / ((ni + 4) * 2 * S * (int)sizeof(float))));
+      const float *x = in .dptr + (int64_t)n * Ci * Hi * Wi;
+      float       *y = out.dptr + (int64_t)n * Co * Ho * Wo;
+      xs .resize ((int64_t)nt * ni * 2 * S);
+      acc.resize ((int64_t)nt * 4  * 2 * S);
+      for (int o = o0; o < o1; ++o)
+        std::fill (y + (int64_t)o * Ho * Wo, y + (int64_t)(o+1) * Ho * Wo, bias ? bias[o] : 0.f);
+      for (int j0 = 0; j0 < nbh * nbw; j0 += nt)
+      { const int jn = std::min (nt, nbh * nbw - j0);
+        for (int j = 0; j < jn; ++j)
+        { const int sh = (j0 + j) / nbw * B, sw = (j0 + j) % nbw * B;
+          for (int i = i0; i < i1; ++i)
+          { const float *xc = x + (int64_t)i * Hi * Wi;
+            std::fill (b.tile.begin(), b.tile.end(), 0.f);
+            for (int r = 0; r < B; ++r)
+              for (int q = 0; q < B; ++q)
+                if (!bwd)
+                { const int ih = sh + r - pad, iw = sw + q - pad;
+                  if (ih >= 0 && ih < Hi && iw >= 0 && iw < Wi)
+                    b.tile[r*T + q] = xc[ih * Wi + iw];
+                } else
+                { const int ph = sh + r, pw = sw + q;
+                  if (ph % stride == 0 && pw % stride == 0 && ph / stride < Hi && pw / stride < Wi)
+                    b.tile[r*T + q] = xc[ph / stride * Wi + pw / stride];
+                }
+            float *s = xs.data() + ((int64_t)j * ni + i - i0) * 2 * S;
+            CONV_DISPATCH (fft2_fwd, p, b, B, s, s + S);
+          }
+        }
+        // 同组的输出4个一组，不足4个的用最后一个补，结果不用
+        for (int o = o0; o < o1; )
+        { const int g = o / go, on = std::min (4, std::min (o1, (g + 1) * go) - o);
+          const float *w[4];
+          for (int q = 0; q < 4; ++q)
+          { const int oq = o + std::min (q, on - 1);
+            w[q] = spec + (bwd ? (int64_t)g * gi * go + oq % go : (int64_t)oq * gi) * 2 * S;
+          }
+          CONV_DISPATCH (fft_mac, S, gi, jn, xs.data() + (int64_t)(g * gi - i0) * 2 * S, (int64_t)ni * 2 * S,
+            w, (int64_t)(bwd ? go : 1) * 2 * S, bwd, acc.data());
+          for (int q = 0; q < on; ++q)
+          { float *yo = y + (int64_t)(o + q) * Ho * Wo;
+            for (int j = 0; j < jn; ++j)
+            { const int sh = (j0 + j) / nbw * B, sw = (j0 + j) % nbw * B;
+              const float *a = acc.data() + ((int64_t)j * 4 + q) * 2 * S;
+              CONV_DISPATCH (fft2_inv, p, b, a, a + S);
+              if (!bwd)  // 块内相关的偏移u在[1-k, B-1]，负的绕到T+u
+              { for (int oh = std::max (0, (sh - ksize + 1 + stride - 1) / stride); oh < Ho && oh * stride < sh + B; ++oh)
+                  for (int ow = std::max (0, (sw - ksize + 1 + stride - 1) / stride); ow < Wo && ow * stride < sw + B; ++ow)
+                  { const int u = oh * stride - sh, v = ow * stride - sw;
+                    yo[oh * Wo + ow] += b.tile[((u + T) & (T - 1)) * T + ((v + T) & (T - 1))];
+                  }
+              } else
+              { for (int r = std::max (0, pad - sh); r < B + ksize - 1 && sh + r - pad < Ho; ++r)
+                  for (int c = std::max (0, pad - sw); c < B + ksize - 1 && sw + c - pad < Wo; ++c)
+                    yo[(sh + r - pad) * Wo + sw + c - pad] += b.tile[r*T + c];
+              }
+            }
+          }
+          o += on;
+        }
+      }
+    }
+  });
+}
+
+// 估算FFT与im2col+gemm的代价，返回最省的tile边长，不如gemm时返回0
+// 变换按5 T^2 log2 T计，乘加每个复数8个flop；T = 64时一组输出的谱出了L2，乘加按两倍算
+static int fft_tile (const int C, const int F, const int secc, const int ksize, const int stride, const int Ho, const int Wo)
+{ const double gemm = 2. * F * (C / secc) * ksize * ksize * Ho * Wo;
+  double best = gemm;
+  int tile = 0;
+  for (int T = 16; T <= 64; T *= 2)
+  { const int B = T - ksize + 1, S = T * (T/2 + 1);
+    if (B < ksize || (double)F * (C / secc) * 2 * S * sizeof(float) > FFT_SPEC_BYTES)
+      continue;
+    const double nb = (double)(((Ho - 1) * stride + ksize + B - 1) / B) * (((Wo - 1) * stride + ksize + B - 1) / B);
+    const double cost = nb * ((C + F) * 5. * T * T * log2 (T) + 8. * F * (C / secc) * S * std::max (1, T / 32)) * FFT_COST_RATIO;
+    if (cost < best)
+    { best = cost;
+      tile = T;
+    }
+  }
+  return tile;
+}
+
+template <>
+void LayerConvolution<CPU>::fprop_fft ()
+{ if (!(wstat_ & 1))
+  { fit_cache (wfwd_, Shape (flts_ * (chls_ / secc_), 2 * ftile_ * (ftile_/2 + 1), 1, 1), did_);
+    fft_filter (wmat_.dptr, flts_, chls_ / secc_, pl_.ksize, ftile_, wfwd_.dptr);
+    wstat_ |= 1;
+  }
+  fft_conv (wfwd_.dptr, ftile_, secc_, pl_.ksize, pl_.stride, pl_.pad, false, src_, bias_.dptr, dst_);
+}
+
+// 反传用同一份谱，不乘共轭即是卷积
+template <>
+void LayerConvolution<CPU>::bprop_fft ()
+{ if (!(wstat_ & 1))
+  { fit_cache (wfwd_, Shape (flts_ * (chls_ / secc_), 2 * ftile_ * (ftile_/2 + 1), 1, 1), did_);
+    fft_filter (wmat_.dptr, flts_, chls_ / secc_, pl_.ksize, ftile_, wfwd_.dptr);
+    wstat_ |= 1;
+  }
+  fft_conv (wfwd_.dptr, ftile_, secc_, pl_.ksize, pl_.stride, pl_.pad, true, dst_, NULL, src_);
+}
+
+
+// 自动选算法：LAYER_INIT里把工作区放得进预算的候选各跑前向+反传，取最快的
+// 结果按(形状, 线程数, 指令集, 预算)记下，同一进程里相同的层不再测
+// 给了CONV_TUNE_CACHE才读写该文件，重启后直接读；不设不落盘，设为空串时只用估算
+// CONV_WORKSPACE_MB为额外内存的预算，im2col + gemm总是候选
+#define CONV_TUNE_MB	256
+
+class ConvTuneCache {
+public:
+  static ConvTuneCache& get ()
+  { static ConvTuneCache cache;
+    return cache;
+  }
+  bool enabled () const { return tune_;  }
+  bool find (const string &key, int &algo, int &tile)
+  { std::lock_guard<std::mutex> lock (mtx_);
+    auto it = map_.find (key);
+    if (it == map_.end ())
+      return false;
+    algo = it->second.first;
+    tile = it->second.second;
+    return true;
+  }
+  void insert (const string &key, const int algo, const int tile)
+  { std::lock_guard<std::mutex> lock (mtx_);
+    map_[key] = std::make_pair (algo, tile);
+    if (path_.empty ())
+      return;
+    FILE *fp = fopen (path_.c_str(), "a");
+    if (fp == NULL)
+    { LOG (WARNING) << "\tconv tune cache not writable\t" << path_;
+      return;
+    }
+    fprintf (fp, "%s\t%d %d\n", key.c_str(), algo, tile);
+    fclose (fp);
+  }
+private:
+  ConvTuneCache ()
+  { const char *env = getenv ("CONV_TUNE_CACHE");
+    tune_ = env == NULL || *env != '\0';
+    path_ = env ? env : "";
+    if (path_.empty ())
+      return;
+    std::ifstream in (path_.c_str());
+    string line;
+    while (std::getline (in, line))  // 同一个key后写的为准
+    { const size_t tab = line.find ('\t');
+      int algo, tile;
+      if (tab != string::npos && sscanf (line.c_str() + tab + 1, "%d %d", &algo, &tile) == 2)
+        map_[line.substr (0, tab)] = std::make_pair (algo, tile);
+    }
+  }
+  bool tune_;
+  string path_;
+  std::map<string, std::pair<int, int>> map_;
+  std::mutex mtx_;
+};
+
+// 各算法在dst_、src_之外要的字节数，按最多并行的任务估
+template <>
+int64_t LayerConvolution<CPU>::get_workspace (const int algo, const int tile) const
+{ const int64_t P = patch_.h_col * patch_.w_col, K = chls_ * pl_.ksize * pl_.ksize, pc = get_col_size ();
+  const int64_t tn = std::min (ThreadPool::get().size(), nums_);
+  const int64_t cg = chls_ / secc_, kk = pl_.ksize * pl_.ksize;
+  const int64_t img = (int64_t)chls_ * src_.rows() * src_.cols();
+  const int64_t gemm_fwd = tn * (K * pc + (pc < P ? flts_ * pc : 0));
+  const int64_t gemm_bwd = tn * (K * pc + flts_ * pc + img) + (tn - 1) * (wmat_.size() + flts_);
+  int64_t ws = 0;
+  switch (algo)
+  { case kConvGemm	: ws = std::max (gemm_fwd, gemm_bwd);  break;
+    case kConvWino2	: ws = 2 * 16 * flts_ * cg + tn * WINO_TILE_BYTES / sizeof(float) + gemm_bwd;  break;
+    case kConvWino4	: ws = 2 * 36 * flts_ * cg + tn * WINO_TILE_BYTES / sizeof(float) + gemm_bwd;  break;
+    case kConvDirect	:
+    { const int64_t Cb = (chls_ + 15) / 16, Fb = (flts_ + 15) / 16;
+      ws = (int64_t)nums_ * (Cb * src_.rows() * src_.cols() + Fb * P) * 16 + 3 * Fb * Cb * kk * 256;
+      break;
+    }
+    case kConvFFT	: ws = (int64_t)flts_ * cg * tile * (tile + 2)
+      + ThreadPool::get().size() * (FFT_TILE_BYTES / sizeof(float) + 5 * tile * tile) + gemm_bwd;  break;
+    default		: LOG (FATAL) << "\tunknown convolution algorithm";
+  }
+  return ws * sizeof(float);
+}
+
+template <>
+void LayerConvolution<CPU>::tune_algo ()
+{ ConvTuneCache &cache = ConvTuneCache::get ();
+  if (!cache.enabled ())
+    return;
+  const char *env = getenv ("CONV_WORKSPACE_MB");
+  const int budget_mb = env ? atoi (env) : CONV_TUNE_MB;
+  const int64_t budget = (int64_t)budget_mb << 20;
+  char key[256];  // 预算不同候选不同，也进key
+  snprintf (key, sizeof(key), "%d %d %d %d %d %d %d %d %d\t%d %d %d", src_.rows(), src_.cols(), chls_, nums_, flts_, secc_,
+    pl_.ksize, pl_.pad, pl_.stride, ThreadPool::get().size(), simd_level(), budget_mb);
+  for (char *c = key; *c; ++c)  // key里不留tab，文件里tab只分隔key和结果
+    if (*c == '\t')  *c = ' ';
+  if (cache.find (key, algo_, ftile_))
+  { LOG (INFO) << "\tconv algo cached\t" << key << "\talgo = " << algo_ << "\ttile = " << ftile_;
+    return;
+  }
+
+  vector<std::pair<int, int>> cand;
+  cand.push_back (std::make_pair (kConvGemm, 0));
+  if (pl_.ksize == 3 && pl_.stride == 1 && pl_.pad <= 2)
+  { cand.push_back (std::make_pair (kConvWino2, 0));
+    cand.push_back (std::make_pair (kConvWino4, 0));
+  }
+  if (secc_ == 1)  // 直接卷积没有分组，secc>1的层不测，退回gemm等其余算法
+    cand.push_back (std::make_pair (kConvDirect, 0));
+  for (int T = 16; T <= 64 && pl_.ksize >= 3; T *= 2)
+    if (T - pl_.ksize + 1 >= pl_.ksize && (int64_t)flts_ * (chls_ / secc_) * T * (T + 2) * sizeof(float) <= FFT_SPEC_BYTES)
+      cand.push_back (std::make_pair (kConvFFT, T));
+
+  // 还没有模型，临时建一份常数权重来测，init_model会重建
+  wmat_ .create (Shape (pl_.ksize, pl_.ksize, chls_ / secc_, flts_), did_);
+  gwmat_.create (wmat_.shape, did_);
+  bias_ .create (Shape (1, 1, flts_, 1), did_);
+  gbias_.create (bias_.shape, did_);
+  wmat_.init (0.01f);
+  bias_.init (0.f);
+  TensorCPUf save;  save.create (src_.shape, did_);  // 反传会写src_，测完还原
+  save.copy (src_);
+  src_ .init (0.1f);
+  const int heur = algo_, heur_tile = ftile_;
+  double best = DBL_MAX;
+  int best_algo = kConvGemm, best_tile = 0;
+  for (size_t i = 0; i < cand.size(); ++i)
+  { algo_  = cand[i].first;
+    ftile_ = cand[i].second;
+    if (algo_ != kConvGemm && get_workspace (algo_, ftile_) > budget)
+      continue;
+    wstat_ = 0;
+    fprop (true);  // 第一遍分配缓冲，不计时
+    bprop (true);
+    double t = DBL_MAX;
+    for (int r = 0; r < 2; ++r)
+    { const auto t0 = std::chrono::steady_clock::now ();
+      fprop (true);
+      bprop (true);
+      t = std::min (t, std::chrono::duration<double, std::milli> (std::chrono::steady_clock::now () - t0).count ());
+    }
+    if (t < best)
+    { best = t;
+      best_algo = algo_;
+      best_tile = ftile_;
+    }
+  }
+  src_.copy (save);
+  wfwd_.release ();  // 滤波器变换的缓存归还内存池
+  wbwd_.release ();
+  direct_trim (did_);
+  wstat_ = 0;
+  algo_  = best_algo;
+  ftile_ = best_tile;
+  cache.insert (key, algo_, ftile_);
+  char pszstr[64];  sprintf (pszstr, "\t%.2f ms", best);
+  LOG (INFO) << "\tconv algo tuned\t" << key << "\talgo = " << algo_ << "\ttile = " << ftile_ << pszstr
+    << (algo_ != heur || ftile_ != heur_tile ? "\toverrides estimate" : "");
+}
+#endif
+
+
+
+LAYER_FORWARD (LayerConvolution)
+{
+#ifdef __CUDACC__
+  const int sdim = src_.size() / src_.nums() / secc_;
+  const int ddim = dst_.size() / dst_.nums() / secc_;
+  const int wdim = wmat_.size() / secc_;
+  for (int g = 0; g < secc_; ++g)
+  { cuda_check (cudnnConvolutionForward (CUDNN_HANDLE,
+      &alpha, srcDesc_, src_.dptr + g * sdim, wmatDesc_, wmat_.dptr + g * wdim, convDesc_,
+      fwdDataAlgo, fwdDataAddr, fwdDataSize,
+      &beta,  dstDesc_, dst_.dptr + g * ddim));
+    cuda_check (cudnnAddTensor (CUDNN_HANDLE,
+      &alpha, biasDesc_, bias_.dptr + g * flts_ / secc_,
+      &alpha, dstDesc_,  dst_.dptr  + g * ddim));
+  }
+  fuse_.fprop (is_train, false, dst_, rand_);
+#else
+  if      (algo_ == kConvGemm)    fprop_cpu ();
+  else if (algo_ == kConvDirect)  fprop_direct ();
+  else if (algo_ == kConvFFT)     fprop_fft ();
+  else                            fprop_wino ();
+  fuse_.fprop (is_train, algo_ == kConvGemm, dst_, rand_);
+#endif
+}
+
+LAYER_BACKPROP (LayerConvolution)
+{ fuse_.bprop (dst_, rand_);  // 先把dst_里的梯度退回到激活之前
+#ifdef __CUDACC__
+  const int sdim = src_.size() / src_.nums() / secc_;
+  const int ddim = dst_.size() / dst_.nums() / secc_;
+  const int wdim = wmat_.size() / secc_;
+  for (int g = 0; g < secc_; ++g)
+  { cuda_check (cudnnConvolutionBackwardBias (CUDNN_HANDLE,
+      &alpha, dstDesc_,  dst_.dptr + g * ddim,
+      &beta,  biasDesc_, gbias_.dptr + g * flts_ / secc_));
+    cuda_check (cudnnConvolutionBackwardFilter (CUDNN_HANDLE,
+      &alpha, srcDesc_, src_.dptr + g * sdim, dstDesc_, dst_.dptr + g * ddim, convDesc_,
+      bwdFltrAlgo, bwdFltrAddr, bwdFltrSize,
+      &beta,  wmatDesc_, gwmat_.dptr + g * wdim));
+    if (is_prop_grad)  // 同一组的输入只在本组里用过，滤波器梯度算完即可覆盖
+    cuda_check (cudnnConvolutionBackwardData (CUDNN_HANDLE,
+      &alpha, wmatDesc_, wmat_.dptr + g * wdim, dstDesc_, dst_.dptr + g * ddim, convDesc_,
+      bwdDataAlgo, bwdDataAddr, bwdDataSize,
+      &beta,  srcDesc_, src_.dptr + g * sdim));
+  }
+#else
+  if (algo_ == kConvGemm)
+    bprop_cpu (is_prop_grad);
+  else if (algo_ == kConvDirect)
+    bprop_direct (is_prop_grad);
+  else
+  { bprop_cpu (false);  // 滤波器梯度仍走im2col
+    if (is_prop_grad && algo_ == kConvFFT)
+      bprop_fft ();
+    else if (is_prop_grad)
+      bprop_wino ();
+  }
+  wstat_ = 0;
+#endif
+}
+
+LAYER_INIT (LayerConvolution)
+{ chls_ = src_.chls();
+  flts_ = pl_.flts;
+  secc_ = pl_.secc;
+  nums_ = src_.nums();
+  dims_ = chls_ / secc_ * pl_.ksize * pl_.ksize;
+  CHECK (chls_ % secc_ == 0 && flts_ % secc_ == 0) << "\tchannels not divisible by groups";
+  patch_ = Patch (pl_.ksize, pl_.pad, pl_.stride);
+  patch_.get_pack_size (src_.shape);
+  // 3x3步长1的层走winograd，输出够大时用F(4x4, 3x3)，乘法少4倍；大核按代价估算选FFT；其余大图、通道够16的层直接卷积
+  // src_已是NCHW16c时只能直接卷积，dst_也按NCHW16c给下一层
+  algo_ = kConvGemm;
+  wstat_ = 0;
+  ftile_ = 0;
+#ifdef __CUDACC__
+  CHECK_EQ (src_.shape.layout, kNCHW) << "	cudnn convolution expects nchw";
+#else
+  if (src_.shape.layout != kNCHW)
+  { CHECK (src_.shape.layout == kNCHW16c && secc_ == 1) << "	only ungrouped nchw16c input is supported";
+    algo_ = kConvDirect;
+  } else if (pl_.ksize == 3 && pl_.stride == 1 && pl_.pad <= 2)
+    algo_ = std::min (patch_.h_col, patch_.w_col) >= 8 ? kConvWino4 : kConvWino2;
+  else if (pl_.ksize >= 5 && (ftile_ = fft_tile (chls_, flts_, secc_, pl_.ksize, pl_.stride, patch_.h_col, patch_.w_col)) > 0)
+    algo_ = kConvFFT;
+  else if (pl_.ksize > 1 && secc_ == 1 && chls_ >= 16 && src_.rows() * src_.cols() >= CONV_DIRECT_AREA)
+    algo_ = kConvDirect;
+#endif
+  Shape dst_shape (patch_.h_col, patch_.w_col, flts_, nums_);
+  dst_shape.set_layout (src_.shape.layout);
+  dst_.create (dst_shape, did_);
+#ifndef __CUDACC__
+  if (src_.shape.layout == kNCHW)
+    tune_algo ();
+  if (algo_ == kConvDirect)  // 建层时就把共用缓冲长到位，训练中不再重分配
+  { direct_need[did_] = std::max (direct_need[did_], get_direct_space ());
+    direct_space (did_, direct_need[did_]);
+  }
+#endif
+  fuse_.init (pl_, did_, dst_.size());
+#ifdef __CUDACC__
+  cuda_check (cudnnCreateTensorDescriptor (&srcDesc_));
+  cuda_check (cudnnCreateTensorDescriptor (&dstDesc_));
+  cuda_check (cudnnCreateTensorDescriptor (&biasDesc_));
+  src_.setTensor4dDesc (srcDesc_, secc_);
+  dst_.setTensor4dDesc (dstDesc_, secc_);
+#endif
+}
+
+
+
+template <typename XPU>
+void LayerConvolution<XPU>::init_model ()
+{ wmat_.create (Shape (pl_.ksize, pl_.ksize, chls_ / secc_, flts_), did_);
+  gwmat_.create (wmat_.shape, did_);
+  bias_.create (Shape (1, 1, flts_, 1), did_);
+  gbias_.create (bias_.shape, did_);
+  wmat_.init (rand_, GAUSSIAN, 0.f, pl_.sigma);
+  bias_.init (0.f);
+  gwmat_.init (0.f);
+  gbias_.init (0.f);
+  wstat_ = 0;
+#ifdef __CUDACC__
+  cuda_check (cudnnCreateFilterDescriptor (&wmatDesc_));
+  cuda_check (cudnnCreateConvolutionDescriptor (&convDesc_));
+  wmat_.setFilter4dDesc (wmatDesc_, secc_);
+  bias_.setTensor4dDesc (biasDesc_, secc_);
+  cuda_check (cudnnSetConvolution2dDescriptor (convDesc_, pl_.pad, pl_.pad, pl_.stride, pl_.stride, 1, 1,
+    CUDNN_CROSS_CORRELATION));
+
+  cuda_check (cudnnGetConvolutionForwardAlgorithm        (CUDNN_HANDLE, srcDesc_, wmatDesc_, convDesc_, dstDesc_,
+    CUDNN_CONVOLUTION_FWD_PREFER_FASTEST, 0, &fwdDataAlgo));
+  cuda_check (cudnnGetConvolutionBackwardDataAlgorithm   (CUDNN_HANDLE, wmatDesc_, dstDesc_, convDesc_, srcDesc_,
+    CUDNN_CONVOLUTION_BWD_DATA_PREFER_FASTEST, 0, &bwdDataAlgo));
+  cuda_check (cudnnGetConvolutionBackwardFilterAlgorithm (CUDNN_HANDLE, srcDesc_, dstDesc_, convDesc_, wmatDesc_,
+    CUDNN_CONVOLUTION_BWD_FILTER_PREFER_FASTEST, 0, &bwdFltrAlgo));
+  cuda_check (cudnnGetConvolutionForwardWorkspaceSize        (CUDNN_HANDLE, srcDesc_, wmatDesc_, convDesc_, dstDesc_,
+    fwdDataAlgo, &fwdDataSize));
+  cuda_check (cudnnGetConvolutionBackwardDataWorkspaceSize   (CUDNN_HANDLE, wmatDesc_, dstDesc_, convDesc_, srcDesc_,
+    bwdDataAlgo, &bwdDataSize));
+  cuda_check (cudnnGetConvolutionBackwardFilterWorkspaceSize (CUDNN_HANDLE, srcDesc_, dstDesc_, convDesc_, wmatDesc_,
+    bwdFltrAlgo, &bwdFltrSize));
+  // 三个阶段不重叠，共用一块工作区
+  const size_t wsize = std::max (fwdDataSize, std::max (bwdDataSize, bwdFltrSize));
+  fwdDataAddr = bwdDataAddr = bwdFltrAddr = wsize ? MemPool<GPU>::get (did_).alloc (wsize) : NULL;
+#endif
+}
+template void LayerConvolution<GPU>::init_model ();
+template void LayerConvolution<CPU>::init_model ();
+
+template <typename XPU>
+void LayerConvolution<XPU>::save_model (const string file)
+{ wmat_.save (file+"_wmat");
+  bias_.save (file+"_bias");
+}
+template void LayerConvolution<GPU>::save_model (const string file);
+template void LayerConvolution<CPU>::save_model (const string file);
+
+template <typename XPU>
+void LayerConvolution<XPU>::load_model (const string file)
+{ Tensor<XPU, float> wmat;  wmat.load (file+"_wmat", did_);  // CPU上是只读映射，优化器要改，拷进原来的权重
+  Tensor<XPU, float> bias;  bias.load (file+"_bias", did_);
+  CHECK (wmat.shape == wmat_.shape && bias.shape == bias_.shape) << "\tmodel shape mismatch\t" << file;
+  wmat_.copy (wmat);
+  bias_.copy (bias);
+  wstat_ = 0;
+}
+template void LayerConvolution<GPU>::load_model (const string file);
+template void LayerConvolution<CPU>::load_model (const string file);
+
+template <typename XPU>
+void LayerConvolution<XPU>::set_optimization (ParaOptim &paraWmat, ParaOptim &paraBias, vector<OptimBase<XPU, float>*> &optims)
+{ optims.push_back (create_optim (paraWmat, did_, wmat_, gwmat_));
+  optims.push_back (create_optim (paraBias, did_, bias_, gbias_));
+}
+template void LayerConvolution<GPU>::set_optimization (ParaOptim &paraWmat, ParaOptim &paraBias, vector<OptimBase<GPU, float>*> &optims);
+template void LayerConvolution<CPU>::set_optimization (ParaOptim &paraWmat, ParaOptim &paraBias, vector<OptimBase<CPU, float>*> &optims);
+
+#endif
@@ -9,36 +9,54 @@ template LayerDropout<GPU>::LayerDropout (ParaLayer &pl, const int did, TensorGP
 template LayerDropout<CPU>::LayerDropout (ParaLayer &pl, const int did, TensorCPUf &src, TensorCPUf &dst);
 #endif
 
-template <typename DT>
-XPU_KERNEL(kernel_dropout) (const int num_kernels, const DT *mask, DT threshold, const DT scale, DT *data)
-{ kernel_for (i, num_kernels)
-    data[i] *= (mask[i] > threshold) * scale;
+// 每个kernel管32个元素，mask字见dropout_word
+// 给了rmask就直接读位图，否则按同样的计数器重新生成
+template <typename DT, typename IT>
+XPU_KERNEL(kernel_dropout) (const IT num_kernels, const int64_t N, const uint64_t seed, const uint64_t offset,
+  const uint32_t subseq, const uint32_t thresh, const uint32_t *rmask, uint32_t *wmask, const DT scale, DT *data)
+{ kernel_for (w, num_kernels)
+  { const uint32_t word = rmask != NULL ? rmask[w] : dropout_word (seed, offset, w, subseq, thresh);
+    const int64_t i0 = (int64_t)w * 32;
+    const int n = N - i0 < 32 ? (int)(N - i0) : 32;
+    for (int j = 0; j < n; ++j)
+      data[i0+j] = (word >> j & 1) ? data[i0+j] * scale : DT(0);
+    if (wmask != NULL)
+      wmask[w] = word;
+  }
 }
 
 LAYER_FORWARD (LayerDropout)
 { scal_ = 1 / (1 - pl_.dropout);
-  const int N = dst_.size();
+  const int64_t N = dst_.size();
+  const int64_t W = (N + 31) / 32;
   if (is_train && pl_.dropout > 0.01)
-  { mask.init (rand_, UNIFORM, 0.f, 1.f);
-    XPU_KERNEL_LAUNCH (kernel_dropout, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, CUDNN_STREAM,
-      N, mask.dptr, pl_.dropout, scal_, dst_.dptr);
+  { fpoff_ = offset_;
+    offset_ += (uint64_t)W * 8;
+    XPU_KERNEL_LAUNCH_GRAIN (kernel_dropout, 256, cuda_get_blocks(W), CUDA_NUM_THREADS, 0, CUDNN_STREAM,
+      W, N, rand_.get_seed(), fpoff_, (uint32_t)(pl_.idxs << 8 | did_), dropout_thresh(pl_.dropout),
+      (const uint32_t*)NULL, pl_.isRegen ? (uint32_t*)NULL : mask_.dptr, scal_, dst_.dptr);
     cuda_sync_check ("DropoutForward");
   }
 }
 
 LAYER_BACKPROP (LayerDropout)
 { scal_ = 1 / (1 - pl_.dropout);
-  const int N = src_.size();
+  const int64_t N = src_.size();
+  const int64_t W = (N + 31) / 32;
   if (is_prop_grad && pl_.dropout > 0.01)
-  { XPU_KERNEL_LAUNCH (kernel_dropout, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, CUDNN_STREAM,
-      N, mask.dptr, pl_.dropout, scal_, src_.dptr);
+  { XPU_KERNEL_LAUNCH_GRAIN (kernel_dropout, 256, cuda_get_blocks(W), CUDA_NUM_THREADS, 0, CUDNN_STREAM,
+      W, N, rand_.get_seed(), fpoff_, (uint32_t)(pl_.idxs << 8 | did_), dropout_thresh(pl_.dropout),
+      pl_.isRegen ? (const uint32_t*)NULL : mask_.dptr, (uint32_t*)NULL, scal_, src_.dptr);
     cuda_sync_check ("DropoutBackward");
   }
 }
 
 LAYER_INIT (LayerDropout)
 { dst_ = src_;
-  mask.create (src_.shape, did_);
+  offset_ = 0;
+  fpoff_  = 0;
+  if (!pl_.isRegen)
+    mask_.create (Shape ((src_.size() + 31) / 32, 1, 1, 1), did_);
 }
 
 #endif
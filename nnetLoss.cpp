@@ -2,6 +2,7 @@
 #define NNET_LOSS_
 
 #include "../include/nnet.h"
+#include "../include/simd.h"
 using std::max;
 using std::min;
 
@@ -17,70 +18,153 @@ template LayerLoss<GPU>::LayerLoss (ParaLayer &pl, const int did, TensorGPUf &sr
 template LayerLoss<CPU>::LayerLoss (ParaLayer &pl, const int did, TensorCPUf &src, TensorCPUf &dst);
 #endif
 
-template <typename DT>
+template <typename DT, typename IT>
 XPU_KERNEL(SigmoidForward) (
-  const int num_kernels, const DT* src_data, DT* dst_data)
+  const IT num_kernels, const DT* src_data, DT* dst_data)
 { kernel_for (i, num_kernels)
     dst_data[i] = (DT)1. / ((DT)1. + exp(min(-src_data[i], (DT)32.)));
 };
 
-LAYER_FORWARD (LayerLoss)
-{ const int N = dst_.size();
-  float  sasum = 0;
+static void check_asum (const int did, const char *name, const double asum)
+{ if (asum >= 1e10 || isnan (asum))
+    LOG (FATAL) << "\tXPU  " << did << "\t" << name << " is too large";
+  if (asum <= 1e-7)
+    LOG (FATAL) << "\tXPU  " << did << "\t" << name << " is too small";
+}
+
+#ifndef __CUDACC__
+// 一行dims个logits原地换成softmax概率，返回该行的交叉熵，asum累计输入的绝对值和
+// 减去行最大值后求指数，logsumexp不会上溢
+static float softmax_entropy_row (const int dims, float *x, const float *y, double &asum)
+{ float xmax = x[0], xsum = 0.f;
+  for (int j = 0; j < dims; ++j)
+  { xmax  = max (xmax, x[j]);
+    xsum += fabsf (x[j]);
+  }
+  asum += xsum;
+  float ydot = 0.f, ysum = 0.f;
+  for (int j = 0; j < dims; ++j)
+  { x[j] -= xmax;
+    ydot += y[j] * x[j];
+    ysum += y[j];
+  }
+  simd_unary_serial<opexp> (dims, x, x);
+  float esum = 0.f;
+  for (int j = 0; j < dims; ++j)
+    esum += x[j];
+  const float einv = 1.f / esum;
+  for (int j = 0; j < dims; ++j)
+    x[j] *= einv;
+  return ysum * logf (esum) - ydot;
+}
+
+// 按样本并行，每个样本的logits只在L1里扫几遍，loss和溢出检查顺带算出
+template <>
+void LayerLoss<CPU>::fprop_entropy ()
+{ vector<double> rowl (nums_), rowa (nums_);
+  ThreadPool::get().parallel_for (0, nums_, max (1, XPU_GRAIN / dims_), [&] (const int begin, const int end)
+  { for (int i = begin; i < end; ++i)
+    { double asum = 0.;
+      rowl[i] = softmax_entropy_row (dims_, src_.dptr + i * dims_, dst_.dptr + i * dims_, asum);
+      rowa[i] = asum;
+    }
+  });
+  double loss = 0., sasum = 0.;
+  for (int i = 0; i < nums_; ++i)
+  { loss  += rowl[i];
+    sasum += rowa[i];
+  }
+  check_asum (did_, "sasum", sasum);
+  loss_ = loss / nums_;
+}
+
+// (p - y) / N一遍写回，同时累计梯度的绝对值和
+template <>
+void LayerLoss<CPU>::bprop_delta ()
+{ const float scal = 1.f / nums_;
+  vector<double> rowa (nums_);
+  ThreadPool::get().parallel_for (0, nums_, max (1, XPU_GRAIN / dims_), [&] (const int begin, const int end)
+  { for (int i = begin; i < end; ++i)
+    { float *x = src_.dptr + i * dims_;
+      const float *y = dst_.dptr + i * dims_;
+      float asum = 0.f;
+      for (int j = 0; j < dims_; ++j)
+      { x[j] = (x[j] - y[j]) * scal;
+        asum += fabsf (x[j]);
+      }
+      rowa[i] = asum;
+    }
+  });
+  double gasum = 0.;
+  for (int i = 0; i < nums_; ++i)
+    gasum += rowa[i];
+  check_asum (did_, "gasum", gasum);
+}
+#else
+template <>
+void LayerLoss<GPU>::fprop_entropy ()
+{ float  sasum = 0;
   src_.blas_asum (sasum);
-  if (sasum >= 1e10 || isnan (sasum))
-    LOG (FATAL) << "\tXPU  " << did_ << "\tsasum is too large";
-  if (sasum <= 1e-7)
-    LOG (FATAL) << "\tXPU  " << did_ << "\tsasum is too small";
+  check_asum (did_, "sasum", sasum);
+  cuda_check (cudnnSoftmaxForward (CUDNN_HANDLE, CUDNN_SOFTMAX_LOG, CUDNN_SOFTMAX_MODE_INSTANCE,
+    &alpha, srcDesc_, src_.dptr,
+    &beta,  dstDesc_, src_.dptr));
+  src_.blas_vexp (src_);
+}
+
+template <>
+void LayerLoss<GPU>::bprop_delta ()
+{ float  gasum = 0;
+  src_.blas_axpy (dst_, -1);
+  src_.blas_scal (1.f/nums_);
+  src_.blas_asum (gasum);
+  check_asum (did_, "gasum", gasum);
+}
+#endif
+
+LAYER_FORWARD (LayerLoss)
+{ const int64_t N = dst_.size();
   switch (pl_.loss)
   { case ENTROPY:  // p(c|x)
-#ifdef __CUDACC__
-      cuda_check (cudnnSoftmaxForward (CUDNN_HANDLE, CUDNN_SOFTMAX_LOG, CUDNN_SOFTMAX_MODE_INSTANCE,
-        &alpha, srcDesc_, src_.dptr,
-       	&beta,  dstDesc_, src_.dptr));
-      src_.blas_vexp (src_);
-#else
-      for (int i = 0; i < src_.nums(); ++i)
-        src_[i].softmax ();
-#endif
+      fprop_entropy ();
       break;
     case EUCLIDEAN:
-      break;
-    case LOGISTIC:  // p(c|x)
-      XPU_KERNEL_LAUNCH (SigmoidForward,  cuda_get_blocks(N), CUDA_NUM_THREADS, 0, CUDNN_STREAM,
-      N, src_.dptr, src_.dptr);
+    case LOGISTIC:
+    { float  sasum = 0;
+      src_.blas_asum (sasum);
+      check_asum (did_, "sasum", sasum);
+      if (pl_.loss == EUCLIDEAN)
+        break;
+      // p(c|x)
+      if (dst_.is_index32 ())
+        XPU_KERNEL_LAUNCH (SigmoidForward,  cuda_get_blocks(N), CUDA_NUM_THREADS, 0, CUDNN_STREAM,
+        (int)N, src_.dptr, src_.dptr);
+      else
+        XPU_KERNEL_LAUNCH (SigmoidForward,  cuda_get_blocks(N), CUDA_NUM_THREADS, 0, CUDNN_STREAM,
+        N, src_.dptr, src_.dptr);
       cuda_sync_check ("SigmoidForward");
       break;
+    }
     default:
       LOG (FATAL) << "not implemented loss method";
   }
 }
 
 LAYER_BACKPROP (LayerLoss)
-{ float  gasum = 0;
-  switch (pl_.loss)
-  { case ENTROPY:  // p(c|x) - 1(y == c)
-      src_.blas_axpy (dst_, -1);
-      break;
+{ switch (pl_.loss)
+  { case ENTROPY:    // p(c|x) - 1(y == c)
     case EUCLIDEAN:
-      src_.blas_axpy (dst_, -1);
-      break;
-    case LOGISTIC:  // dp/dx = p*(1-p)
-      src_.blas_axpy (dst_, -1);
+    case LOGISTIC:   // dp/dx = p*(1-p)
+      bprop_delta ();
       break;
     default:
       LOG (FATAL) << "not implemented loss method";
   }
-  src_.blas_scal (1.f/nums_);
-  src_.blas_asum (gasum);
-  if (gasum >= 1e10 || isnan (gasum))
-    LOG (FATAL) << "\tXPU  " << did_ << "\tgasum is too large";
-  if (gasum <= 1e-7)
-    LOG (FATAL) << "\tXPU  " << did_ << "\tgasum is too small";
 }
 
 LAYER_INIT (LayerLoss)
 { nums_ = src_.nums();
+  loss_ = 0.f;
   dims_ = src_.size() / nums_;
 #ifdef __CUDACC__
   cuda_check (cudnnCreateTensorDescriptor (&srcDesc_));
@@ -28,7 +28,10 @@ int main (int argc, char** argv)
 
   model.init_model ();
   model.init_data  ();
-  model.train ();
+  if (model.para_.plan == kPlanEval || model.para_.plan == kPlanInfer || model.para_.int8_batches > 0)
+    model.infer ();
+  else
+    model.train ();
 
 //cuda_del_p2p (model.para_.num_device);
 //for (int i = model.para_.min_device; i <= model.para_.max_device; ++i)
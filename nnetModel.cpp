@@ -6,10 +6,13 @@
 
 template <typename XPU>
 void NNetModel<XPU>::init_model ()
-{ train_. resize (para_.num_nnets);
+{ int8_ = false;
+  train_. resize (para_.num_nnets);
   predt_. resize (para_.num_nnets);
   batch_. resize (para_.num_nnets);
   nodes_. resize (para_.num_nnets);
+  relay_. resize (para_.num_nnets);
+  arena_. resize (para_.num_nnets);
   layers_.resize (para_.num_nnets);
   optims_.resize (para_.num_nnets);
   trainErr_.resize (para_.num_nnets);
@@ -23,10 +26,19 @@ void NNetModel<XPU>::init_model ()
     nodes_[did][para_.num_nodes-1].create (para_.shape_dst, did);  // TODO
   
     layers_[did].resize (para_.num_layers);
+    relay_ [did].resize (para_.num_layers);
     for (int i = 0; i < para_.num_layers; ++i)
     { ParaLayer &pl = para_.paraLayer_[i];
       LOG (INFO) << "\tLayer initializing\t" << para_.paraLayer_[i].get_layer_type();
-      layers_[did][i] = create_layer (pl, did, nodes_[did][pl.idxs], nodes_[did][pl.idxd]);
+      Tensor<XPU, float> *src = &nodes_[did][pl.idxs];
+      const int layout = get_src_layout<XPU> (pl, src->shape.layout);
+      if (layout != src->shape.layout)  // 插入重排，前向前按层的布局拷一份，反传后把梯度搬回节点
+      { Shape rshape = src->shape;  rshape.set_layout (layout);
+        relay_[did][i].create (rshape, did);
+        src = &relay_[did][i];
+        LOG (INFO) << "\tlayer " << i << " input relayout inserted";
+      }
+      layers_[did][i] = create_layer (pl, did, *src, nodes_[did][pl.idxd]);
     }
 
     for (int i = 0; i < para_.num_nodes; ++i)
@@ -43,6 +55,11 @@ void NNetModel<XPU>::init_model ()
 
     para_.paraWmat_[0].get_optim_info ();
     para_.paraBias_[0].get_optim_info ();
+    if (para_.plan != kPlanNone)
+      plan_nodes (did);
+    if (para_.plan == kPlanRecomp)  // 输出不留的层在反传前重跑，见bprop
+      for (int i = 0; i < para_.num_layers; ++i)
+        para_.paraLayer_[i].isRecomp = !keep_[para_.paraLayer_[i].idxd];
 
     batch_[did].data_  = nodes_[did][0];
     batch_[did].pred_  = nodes_[did][para_.num_nodes - 2];
@@ -51,11 +68,160 @@ void NNetModel<XPU>::init_model ()
   
     if (para_.model_.if_update)
       load_model (did);
+    MemPool<XPU>::get (did).print (did);
   }
 }
 template void NNetModel<GPU>::init_model ();
 template void NNetModel<CPU>::init_model ();
 
+// 时间步：第i层的fprop为i，batch在fprop之前写入记为-1，fprop之后读出记为L；训练时反传从L+1起按bprop的实际顺序排，重算的前向也占步
+// 指针相同的节点（dropout的dst_ = src_）和前向原地做的层（非训练时src_之后没人读）并成一组，大小取最大
+// 保留的组从第一次用到最后一次用都占着；重算模式下丢掉的组前向、反传各活一段，中间的内存给别的组用
+// 组从大到小放进arena，偏移取与时间上相交的已放组都不重叠的最低处
+template <typename XPU>
+void NNetModel<XPU>::plan_nodes (const int did)
+{ const char *name[] = { "none", "train", "eval", "infer", "recomp" };
+  const int L = para_.num_layers, M = para_.num_nodes;
+  const bool train = para_.plan == kPlanTrain || para_.plan == kPlanRecomp;
+  const vector<ParaLayer> &pls = para_.paraLayer_;
+  vector<Tensor<XPU, float>> &nodes = nodes_[did];
+  vector<int> head (M), fb (M, INT_MAX), fl (M, INT_MIN);
+  vector<size_t> gsize (M, 0), goff (M, 0);
+  auto touch = [&] (vector<int> &b, vector<int> &l, const int n, const int t)
+  { b[head[n]] = std::min (b[head[n]], t);
+    l[head[n]] = std::max (l[head[n]], t);
+  };
+
+  size_t before = 0;
+  for (int n = 0; n < M; ++n)
+  { CHECK (nodes[n].dptr != NULL) << "\tnode " << n << " not allocated";
+    head[n] = n;
+    for (int m = 0; m < n; ++m)
+      if (nodes[m].dptr == nodes[n].dptr)
+      { head[n] = head[m];
+        break;
+      }
+    if (head[n] == n)
+      before += nodes[n].size_d();
+  }
+  for (int i = 0; i < L; ++i)
+  { touch (fb, fl, pls[i].idxs, i);
+    touch (fb, fl, pls[i].idxd, i);
+  }
+  touch (fb, fl, 0,   -1);  // data、label由batch在fprop之前写入
+  touch (fb, fl, M-1, -1);
+  touch (fb, fl, M-2,  L);
+  if (para_.plan != kPlanInfer)
+    touch (fb, fl, M-1, L);
+  if (para_.plan == kPlanEval)
+    touch (fb, fl, 0, L);
+  for (int i = 0; i < L && !train; ++i)
+  { const int hs = head[pls[i].idxs], hd = head[pls[i].idxd];
+    if (layers_[did][i]->is_inplace () && hs != hd && fl[hs] == i)
+    { for (int n = 0; n < M; ++n)
+        if (head[n] == hd)
+          head[n] = hs;
+      touch (fb, fl, hs, fb[hd]);
+      touch (fb, fl, hs, fl[hd]);
+    }
+  }
+  vector<int> order;
+  for (int n = 0; n < M; ++n)
+  { const size_t bytes = (nodes[n].size_d() + MEM_ALIGN - 1) / MEM_ALIGN * MEM_ALIGN;
+    gsize[head[n]] = std::max (gsize[head[n]], bytes);
+    if (head[n] == n)
+      order.push_back (n);
+  }
+  std::stable_sort (order.begin(), order.end(), [&] (const int a, const int b) { return gsize[a] > gsize[b];  });
+
+  // 按keep排出反传的时间步并装箱，返回arena字节数
+  auto pack = [&] (const vector<bool> &keep) -> size_t
+  { vector<int> bb (M, INT_MAX), bl (M, INT_MIN);
+    for (int i = L-1, t = L+1; i >= 0 && train; --i)
+    { if (pls[i].isFixed)
+        continue;
+      if (keep[head[pls[i].idxd]] && !keep[head[pls[i].idxs]])
+      { int a = i;
+        while (!keep[head[pls[a].idxs]])  --a;
+        for (; a < i; ++a, ++t)
+        { touch (bb, bl, pls[a].idxs, t);
+          touch (bb, bl, pls[a].idxd, t);
+        }
+      }
+      touch (bb, bl, pls[i].idxs, t);
+      touch (bb, bl, pls[i].idxd, t++);
+    }
+    auto clash = [&] (const int p, const int h)
+    { const int pr[4] = { keep[p] ? std::min (fb[p], bb[p]) : fb[p], keep[p] ? std::max (fl[p], bl[p]) : fl[p], bb[p], bl[p] };
+      const int hr[4] = { keep[h] ? std::min (fb[h], bb[h]) : fb[h], keep[h] ? std::max (fl[h], bl[h]) : fl[h], bb[h], bl[h] };
+      for (int x = 0; x < (keep[p] ? 2 : 4); x += 2)
+        for (int y = 0; y < (keep[h] ? 2 : 4); y += 2)
+          if (pr[x] <= hr[y+1] && hr[y] <= pr[x+1])
+            return true;
+      return false;
+    };
+    size_t total = 0;
+    for (size_t k = 0; k < order.size(); ++k)
+    { const int h = order[k];
+      vector<std::pair<size_t, size_t>> busy;
+      for (size_t j = 0; j < k; ++j)
+        if (clash (order[j], h))
+          busy.push_back (std::make_pair (goff[order[j]], goff[order[j]] + gsize[order[j]]));
+      std::sort (busy.begin(), busy.end());
+      size_t off = 0;
+      for (size_t j = 0; j < busy.size() && off + gsize[h] > busy[j].first; ++j)
+        off = std::max (off, busy[j].second);
+      goff[h] = off;
+      total = std::max (total, off + gsize[h]);
+    }
+    return total;
+  };
+
+  // 重算模式：一段里丢掉的节点累计超过cap就留下当前节点作为检查点，cap从0（全留）往上翻倍
+  // 取装得进recomp_mb的第一个，检查点最多、重算最少；放不下或没给预算时取arena最小的
+  keep_.assign (M, true);
+  size_t total = pack (keep_);
+  if (para_.plan == kPlanRecomp)
+  { const size_t budget = (size_t)para_.recomp_mb << 20;
+    vector<bool> best = keep_;
+    for (size_t cap = gsize[order.back()]; cap < before * 2 && (budget == 0 || total > budget); cap *= 2)
+    { vector<bool> keep (M, false);
+      keep[head[0]] = keep[head[M-2]] = keep[head[M-1]] = true;
+      size_t acc = 0;
+      for (int i = 0; i < L; ++i)
+      { const int h = head[pls[i].idxd];
+        if (keep[h] || h == head[pls[i].idxs])  // 原地层的输出跟着输入
+          continue;
+        acc += gsize[h];
+        if (acc > cap)
+        { keep[h] = true;
+          acc = 0;
+        }
+      }
+      const size_t bytes = pack (keep);
+      if (bytes < total)
+      { total = bytes;
+        best = keep;
+      }
+    }
+    if (budget > 0 && total > budget)
+      LOG (WARNING) << "\tnode memory over recomp_mb\t" << total / 1e6 << " MB";
+    for (int n = 0; n < M; ++n)
+      keep_[n] = best[head[n]];
+    total = pack (best);  // goff按选中的重排
+  }
+
+  for (int n = 0; n < M; ++n)  // 先还给内存池，arena可以接着用这些块
+    nodes[n].release ();
+  arena_[did].create (Shape (1, 1, 1, 1, total / sizeof(float)), did);
+  for (int n = 0; n < M; ++n)
+    nodes[n].dptr = arena_[did].dptr + goff[head[n]] / sizeof(float);
+  const int kept = std::count (keep_.begin(), keep_.end(), true);
+  char pszstr[64];  sprintf (pszstr, "\tbefore %.2f MB\tafter %.2f MB", before / 1e6, total / 1e6);
+  LOG (INFO) << "\tnodes planned\t" << name[para_.plan] << pszstr << "\tgroups " << order.size() << " / " << M
+    << "\tkept " << kept << " / " << M;
+}
+
 template <typename XPU>
 void NNetModel<XPU>::init_data ()
 { for (int did = para_.min_device; did <= para_.max_device; ++did)
@@ -63,12 +229,13 @@ void NNetModel<XPU>::init_data ()
 
     train_[did].create (para_.tFormat_, did);
     predt_[did].create (para_.tFormat_, did);
+    train_[did].seed_ = predt_[did].seed_ = (uint64_t)(unsigned)para_.seed << 32 | did;  // 各设备的数据流互不相同
     train_[did].read (para_.dataTrain_);
     predt_[did].read (para_.dataPredt_);
     train_[did].read_stats (para_.dataTrain_);
     predt_[did].read_stats (para_.dataPredt_);
-    train_[did].data_.sub_mean (train_[did].mean_);
-    predt_[did].data_.sub_mean (predt_[did].mean_);
+    if (para_.dataType != "image")
+      batch_[did].set_mean (train_[did].mean_, did);
 #ifdef __CUDACC__
     train_[did].page_lock ();
     predt_[did].page_lock ();
@@ -96,6 +263,7 @@ void NNetModel<XPU>::mem_free (const int did)
   for (size_t i = 0; i < optims_[did].size(); ++i)
     delete optims_[did][i];
    nodes_[did].clear();
+   relay_[did].clear();
   layers_[did].clear();
   optims_[did].clear();
 }
@@ -135,21 +303,79 @@ void NNetModel<XPU>::show_layer (const int did)
 }
 template void NNetModel<GPU>::show_layer (const int did);
 
+// 用测试集的前几个batch校准，每层先看输入再前向，最后打包int8权重
+template <typename XPU>
+void NNetModel<XPU>::quantize (const int did, const int num_batches)
+{ cuda_set_device (did);
+  DataBuffer<float> &buffer = predt_[did];
+  DataBatch<XPU, float> &batch = batch_[did];
+  para_.tFormat_.isTrain = false;
+  buffer.reset_image_buf ();
+  buffer.read_image_thread (para_.tFormat_);
+
+  batch.reset ();
+  const int numBatches = std::min (num_batches, buffer.dnums_ / batch.dnums_);
+  for (int j = 0; j < numBatches; ++j)
+  { batch.copy (buffer);
+    for (size_t i = 0; i < layers_[did].size(); ++i)
+    { relay (did, i, true);
+      layers_[did][i]->calib_layer ();
+      layers_[did][i]->fprop (false);
+    }
+    batch.next (buffer);
+  }
+  for (size_t i = 0; i < layers_[did].size(); ++i)
+    layers_[did][i]->quant_layer ();
+  int8_ = true;
+  LOG (INFO) << "\tint8 inference enabled\tcalibration batches = " << numBatches;
+}
+template void NNetModel<GPU>::quantize (const int did, const int num_batches);
+template void NNetModel<CPU>::quantize (const int did, const int num_batches);
+
 
 
 template <typename XPU>
 void NNetModel<XPU>::fprop (const int did, const bool is_train)
 { cuda_set_device (did);
   for (size_t i = 0; i < layers_[did].size(); ++i)
-    layers_[did][i]->fprop (is_train);
+  { relay (did, i, true);
+    if (int8_ && !is_train)
+      layers_[did][i]->fprop_int8 ();
+    else
+      layers_[did][i]->fprop (is_train);
+  }
 }
 
 template <typename XPU>
 void NNetModel<XPU>::bprop (const int did)
 { cuda_set_device (did);
+  const vector<ParaLayer> &pls = para_.paraLayer_;
   for (int i = layers_[did].size()-1; i >= 0; --i)
     if (!layers_[did][i]->pl_.isFixed)
+    { if (para_.plan == kPlanRecomp && keep_[pls[i].idxd] && !keep_[pls[i].idxs])  // 段内节点的内存已给别人用过，从检查点重算
+      { int a = i;
+        while (!keep_[pls[a].idxs])  --a;
+        for (; a < i; ++a)
+        { relay (did, a, true);
+          layers_[did][a]->refprop ();
+        }
+      }
       layers_[did][i]->bprop (i != 0);
+      if (i != 0)
+        relay (did, i, false);
+    }
+}
+
+// 有重排的层：前向前把输入节点拷成层的布局，反传后把src_里的梯度搬回节点
+template <typename XPU>
+void NNetModel<XPU>::relay (const int did, const int i, const bool is_fprop)
+{ Tensor<XPU, float> &node = nodes_[did][para_.paraLayer_[i].idxs];
+  if (!relay_[did][i].dptr)
+    return;
+  if (is_fprop)
+    relay_[did][i].relayout (node);
+  else
+    node.relayout (relay_[did][i]);
 }
 
 template <typename XPU>
@@ -197,7 +423,8 @@ void NNetModel<XPU>::reduce_gmat (const int did)
 
 template <typename XPU>
 void NNetModel<XPU>::train ()
-{ for (para_.now_round = para_.stt_round; para_.now_round < para_.end_round; para_.now_round++)
+{ CHECK (para_.plan == kPlanNone || para_.plan == kPlanTrain || para_.plan == kPlanRecomp) << "\tnodes planned for forward only, cannot train";
+  for (para_.now_round = para_.stt_round; para_.now_round < para_.end_round; para_.now_round++)
 #pragma omp parallel for
   for (int did = para_.min_device; did <= para_.max_device; ++did)
   { for (size_t i = 0; i < optims_[did].size(); ++i)
@@ -213,6 +440,20 @@ void NNetModel<XPU>::train ()
 template void NNetModel<GPU>::train ();
 template void NNetModel<CPU>::train ();
 
+// 只前向的节点规划或model.int8时不训练，int8先在测试集上校准量化，再评估
+template <typename XPU>
+void NNetModel<XPU>::infer ()
+{
+#pragma omp parallel for
+  for (int did = para_.min_device; did <= para_.max_device; ++did)
+  { if (para_.int8_batches > 0)
+      quantize (did, para_.int8_batches);
+    eval_epoch (predt_[did], batch_[did], did);
+  }
+}
+template void NNetModel<GPU>::infer ();
+template void NNetModel<CPU>::infer ();
+
 template <typename XPU>
 void NNetModel<XPU>::train_epoch (DataBuffer<float> &buffer, DataBatch<XPU, float> &batch, const int did)
 { const int numEvals   = para_.num_evals;
@@ -220,7 +461,8 @@ void NNetModel<XPU>::train_epoch (DataBuffer<float> &buffer, DataBatch<XPU, floa
   const int numBatches = buffer.dnums_ / batch .dnums_;
   const int numBuffers = buffer.lnums_ / buffer.dnums_;
   std::thread reader;
-  std::random_shuffle (buffer.image_.imgList.begin(), buffer.image_.imgList.end());
+  Philox rng (buffer.seed_, (uint64_t)1 << 63 | para_.now_round);  // 每轮的打乱顺序可复现
+  std::shuffle (buffer.image_.imgList.begin(), buffer.image_.imgList.end(), rng);
 
   trainErr_[did] = 0.f;
   for (int i = 0; i < numBuffers; ++i)
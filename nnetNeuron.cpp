@@ -5,22 +5,16 @@
 
 #define LEAKY 0.1
 
-enum neuron_t
-{ RELU		= 1,
-  SIGMOID	= 2,
-  TANH		= 3
-};
-
-template <typename DT>
+template <typename DT, typename IT>
 XPU_KERNEL(NeuronForward) (
-  const int num_kernels, const DT* src_data, DT* dst_data)
+  const IT num_kernels, const DT* src_data, DT* dst_data)
 { kernel_for (i, num_kernels)
     dst_data[i] = src_data[i] * (src_data[i] >= (DT)0. ? (DT)1. : (DT)LEAKY);
 };
 
-template <typename DT>
+template <typename DT, typename IT>
 XPU_KERNEL(NeuronBackward) (
-  const int num_kernels, DT* src_diff, const DT* dst_diff)
+  const IT num_kernels, DT* src_diff, const DT* dst_diff)
 { kernel_for (i, num_kernels)
     src_diff[i] = dst_diff[i] * (src_diff[i] >= (DT)0. ? (DT)1. : (DT)LEAKY);
 };
@@ -33,17 +27,126 @@ template LayerNeuron<GPU>::LayerNeuron (ParaLayer &pl, const int did, TensorGPUf
 template LayerNeuron<CPU>::LayerNeuron (ParaLayer &pl, const int did, TensorCPUf &src, TensorCPUf &dst);
 #endif
 
+// FuseAct：每个kernel管32个元素，先记正负再做relu和dropout；act_done时relu已在gemm里做过，正负不变
+template <typename DT, typename IT>
+XPU_KERNEL(kernel_fuse_fprop) (const IT num_kernels, const int64_t N, const bool act, const DT slope,
+  const uint64_t seed, const uint64_t offset, const uint32_t subseq, const uint32_t thresh, const bool drop, const DT scale,
+  uint32_t *sign, uint32_t *mask, DT *data)
+{ kernel_for (w, num_kernels)
+  { const uint32_t keep = drop ? dropout_word (seed, offset, w, subseq, thresh) : UINT32_MAX;
+    const int64_t i0 = (int64_t)w * 32;
+    const int n = N - i0 < 32 ? (int)(N - i0) : 32;
+    uint32_t pos = 0;
+    for (int j = 0; j < n; ++j)
+    { DT v = data[i0+j];
+      pos |= (uint32_t)(v >= (DT)0) << j;
+      if (act && v < (DT)0)
+        v *= slope;
+      data[i0+j] = (keep >> j & 1) ? v * scale : DT(0);
+    }
+    if (sign != NULL)
+      sign[w] = pos;
+    if (mask != NULL)
+      mask[w] = keep;
+  }
+}
+
+// sign为NULL时没有激活；drop时有rmask读位图，否则按前向的计数器重新生成
+template <typename DT, typename IT>
+XPU_KERNEL(kernel_fuse_bprop) (const IT num_kernels, const int64_t N, const DT slope, const uint32_t *sign,
+  const uint64_t seed, const uint64_t offset, const uint32_t subseq, const uint32_t thresh, const bool drop, const DT scale,
+  const uint32_t *rmask, DT *diff)
+{ kernel_for (w, num_kernels)
+  { const uint32_t keep = !drop ? UINT32_MAX : rmask != NULL ? rmask[w] : dropout_word (seed, offset, w, subseq, thresh);
+    const uint32_t pos  = sign != NULL ? sign[w] : UINT32_MAX;
+    const int64_t i0 = (int64_t)w * 32;
+    const int n = N - i0 < 32 ? (int)(N - i0) : 32;
+    for (int j = 0; j < n; ++j)
+      diff[i0+j] = (keep >> j & 1) ? diff[i0+j] * ((pos >> j & 1) ? scale : scale * slope) : DT(0);
+  }
+}
+
+// GPU的relu与cudnn一致，斜率为0；CPU与NeuronForward一致，为LEAKY
+template <typename XPU>
+void FuseAct<XPU>::init (ParaLayer &pl, const int did, const int64_t N)
+{ pl_   = &pl;
+  did_  = did;
+  act_  = pl.isFused && pl.neuron > 0;
+  drop_ = pl.isFused && pl.dbase > 0.;
+#ifdef __CUDACC__
+  slope_ = 0.f;
+#else
+  slope_ = LEAKY;
+#endif
+  offset_ = 0;
+  fpoff_  = 0;
+  const int64_t W = (N + 31) / 32;
+  if (act_)
+    sign_.create (Shape (W, 1, 1, 1), did_);
+  if (drop_ && !pl.isRegen)
+    mask_.create (Shape (W, 1, 1, 1), did_);
+}
+
+template <typename XPU>
+void FuseAct<XPU>::fprop (const bool is_train, const bool act_done, Tensor<XPU, float> &data, const Random<XPU> &rand)
+{ const bool drop = is_train && use_drop ();
+  if (!drop && (!act_ || (act_done && !is_train)))
+    return;
+  const int64_t N = data.size();
+  const int64_t W = (N + 31) / 32;
+  if (drop)
+  { fpoff_ = offset_;
+    offset_ += (uint64_t)W * 8;
+  }
+  XPU_KERNEL_LAUNCH_GRAIN (kernel_fuse_fprop, 256, cuda_get_blocks(W), CUDA_NUM_THREADS, 0, dnnctx[did_]->stream_,
+    W, N, act_ && !act_done, slope_, rand.get_seed(), fpoff_, (uint32_t)(pl_->idxs << 8 | did_),
+    dropout_thresh (pl_->dropout), drop, drop ? 1 / (1 - pl_->dropout) : 1.f,
+    is_train && act_ ? sign_.dptr : (uint32_t*)NULL, drop && !pl_->isRegen ? mask_.dptr : (uint32_t*)NULL, data.dptr);
+  cuda_sync_check ("FuseActForward");
+}
+
+template <typename XPU>
+void FuseAct<XPU>::bprop (Tensor<XPU, float> &diff, const Random<XPU> &rand)
+{ const bool drop = use_drop ();
+  if (!drop && !act_)
+    return;
+  const int64_t N = diff.size();
+  const int64_t W = (N + 31) / 32;
+  XPU_KERNEL_LAUNCH_GRAIN (kernel_fuse_bprop, 256, cuda_get_blocks(W), CUDA_NUM_THREADS, 0, dnnctx[did_]->stream_,
+    W, N, slope_, act_ ? sign_.dptr : (const uint32_t*)NULL, rand.get_seed(), fpoff_, (uint32_t)(pl_->idxs << 8 | did_),
+    dropout_thresh (pl_->dropout), drop, drop ? 1 / (1 - pl_->dropout) : 1.f,
+    drop && !pl_->isRegen ? mask_.dptr : (const uint32_t*)NULL, diff.dptr);
+  cuda_sync_check ("FuseActBackward");
+}
+
+#ifdef __CUDACC__
+template void FuseAct<GPU>::init  (ParaLayer &pl, const int did, const int64_t N);
+template void FuseAct<GPU>::fprop (const bool is_train, const bool act_done, TensorGPUf &data, const Random<GPU> &rand);
+template void FuseAct<GPU>::bprop (TensorGPUf &diff, const Random<GPU> &rand);
+#else
+template void FuseAct<CPU>::init  (ParaLayer &pl, const int did, const int64_t N);
+template void FuseAct<CPU>::fprop (const bool is_train, const bool act_done, TensorCPUf &data, const Random<CPU> &rand);
+template void FuseAct<CPU>::bprop (TensorCPUf &diff, const Random<CPU> &rand);
+#endif
+
+
+
 LAYER_FORWARD (LayerNeuron)
 { 
 #ifdef __CUDACC__
-  dst_.mem_set (0);
+  if (dst_.dptr != src_.dptr)
+    dst_.mem_set (0);
   cuda_check (cudnnActivationForward (CUDNN_HANDLE, get_activation_type(),
     &alpha, srcDesc_, src_.dptr,
     &beta,  dstDesc_, dst_.dptr));
 #else
-  const int N = dst_.size();
-  XPU_KERNEL_LAUNCH (NeuronForward,  cuda_get_blocks(N), CUDA_NUM_THREADS, 0, CUDNN_STREAM,
-    N, src_.dptr, dst_.dptr);
+  const int64_t N = dst_.size();
+  if (dst_.is_index32 ())
+    XPU_KERNEL_LAUNCH (NeuronForward,  cuda_get_blocks(N), CUDA_NUM_THREADS, 0, CUDNN_STREAM,
+      (int)N, src_.dptr, dst_.dptr);
+  else
+    XPU_KERNEL_LAUNCH (NeuronForward,  cuda_get_blocks(N), CUDA_NUM_THREADS, 0, CUDNN_STREAM,
+      N, src_.dptr, dst_.dptr);
   cuda_sync_check ("NeuronForward");
 #endif
 }
@@ -56,10 +159,13 @@ LAYER_BACKPROP (LayerNeuron)
     &beta,  srcDesc_, dst_.dptr));
   src_.copy (dst_);
 #else
-  const int N = dst_.size();
-  if (is_prop_grad)
-  XPU_KERNEL_LAUNCH (NeuronBackward, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, CUDNN_STREAM,
-    N, src_.dptr, dst_.dptr);
+  const int64_t N = dst_.size();
+  if (is_prop_grad && dst_.is_index32 ())
+    XPU_KERNEL_LAUNCH (NeuronBackward, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, CUDNN_STREAM,
+      (int)N, src_.dptr, dst_.dptr);
+  else if (is_prop_grad)
+    XPU_KERNEL_LAUNCH (NeuronBackward, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, CUDNN_STREAM,
+      N, src_.dptr, dst_.dptr);
   cuda_sync_check ("NeuronBackward");
 #endif
 }
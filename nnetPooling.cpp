@@ -30,18 +30,52 @@ LAYER_FORWARD (LayerPooling)
     &alpha, srcDesc_, src_.dptr,
     &beta,  dstDesc_, dst_.dptr));
 #else
-  const int N = dst_.size();
-  XPU_KERNEL_LAUNCH (PoolForward, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, CUDNN_STREAM,
-    N, src_.dptr, dst_.dptr, src_.rows(), src_.cols(), src_.chls(),
-    pool_.h_pool, pool_.w_pool, pl_.ksize, pl_.stride, pl_.pool);
+  const int64_t N = dst_.size();
+  if (dst_.is_index32 ())
+    XPU_KERNEL_LAUNCH_GRAIN (PoolForward, 256, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, CUDNN_STREAM,
+      (int)N, src_.dptr, dst_.dptr, src_.rows(), src_.cols(), src_.chls(),
+      pool_.h_pool, pool_.w_pool, pl_.ksize, pl_.stride, pl_.pool);
+  else
+    XPU_KERNEL_LAUNCH_GRAIN (PoolForward, 256, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, CUDNN_STREAM,
+      N, src_.dptr, dst_.dptr, src_.rows(), src_.cols(), src_.chls(),
+      pool_.h_pool, pool_.w_pool, pl_.ksize, pl_.stride, pl_.pool);
   cuda_sync_check ("PoolForward");
 #endif
-  if (is_train)
+  if (is_train && !pl_.isRecomp)  // 重算的层反传前还会再跑，到时再存
+    save_dst ();
+}
+
+// 反传要的输出副本第一次训练前向时才分配，推断不占
+template <typename XPU>
+void LayerPooling<XPU>::save_dst ()
+{ if (pl_.isHalf)
+  { if (!hdst_.dptr)
+      hdst_.create (dst_.shape, did_);
+    hdst_ = dst_;
+  } else
+  { if (!tdst_.dptr)
+      tdst_.create (dst_.shape, did_);
     tdst_.copy (dst_);
+  }
+}
+
+// 重算段里的副本只从这里活到本层反传结束，中间的内存池块给别的层用
+template <typename XPU>
+void LayerPooling<XPU>::refprop ()
+{ fprop (true);
+  if (pl_.isRecomp)
+    save_dst ();
 }
 
 LAYER_BACKPROP (LayerPooling)
-{ 
+{ Tensor<XPU, float> tdst;  // 半精度时临时展开，内存池回收后给别的层用
+  if (pl_.isHalf)
+  { tdst.create (hdst_.shape, did_);
+    tdst = hdst_;
+  } else
+    tdst = tdst_;
+  if (pl_.pool != MAX)  // 节点内存规划会挪src_，不在init里留指针
+    tsrc_ = src_;
 #ifdef __CUDACC__
   if (is_prop_grad)
   for (int i = 0; i < secs_; ++i)
@@ -49,19 +83,27 @@ LAYER_BACKPROP (LayerPooling)
     if (pl_.pool == MAX)
       tsrc_.copy (src_.section(s1, s2));
     cuda_check (cudnnPoolingBackward (CUDNN_HANDLE, poolDesc_,
-    &alpha, sdstDesc_, tdst_.section(s1, s2).dptr,
+    &alpha, sdstDesc_, tdst .section(s1, s2).dptr,
             sdstDesc_,  dst_.section(s1, s2).dptr,
             ssrcDesc_, tsrc_                .dptr,
     &beta,  ssrcDesc_,  src_.section(s1, s2).dptr));
   }
 #else
-  const int N = src_.size();
-  if (is_prop_grad)
-  XPU_KERNEL_LAUNCH (PoolBackward, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, CUDNN_STREAM,
-    N, tsrc_.dptr, tdst_.dptr, src_.dptr, dst_.dptr, src_.rows(), src_.cols(), src_.chls(),
-    pool_.h_pool, pool_.w_pool, pl_.ksize, pl_.stride, pl_.pool);
+  const int64_t N = src_.size();
+  if (is_prop_grad && src_.is_index32 ())
+    XPU_KERNEL_LAUNCH_GRAIN (PoolBackward, 256, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, CUDNN_STREAM,
+      (int)N, tsrc_.dptr, tdst.dptr, src_.dptr, dst_.dptr, src_.rows(), src_.cols(), src_.chls(),
+      pool_.h_pool, pool_.w_pool, pl_.ksize, pl_.stride, pl_.pool);
+  else if (is_prop_grad)
+    XPU_KERNEL_LAUNCH_GRAIN (PoolBackward, 256, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, CUDNN_STREAM,
+      N, tsrc_.dptr, tdst.dptr, src_.dptr, dst_.dptr, src_.rows(), src_.cols(), src_.chls(),
+      pool_.h_pool, pool_.w_pool, pl_.ksize, pl_.stride, pl_.pool);
   cuda_sync_check ("PoolBackward");
 #endif
+  if (pl_.isRecomp)
+  { tdst_.release ();
+    hdst_.release ();
+  }
 }
 
 LAYER_INIT (LayerPooling)
@@ -73,9 +115,6 @@ LAYER_INIT (LayerPooling)
 
   if (pl_.pool == MAX)
     tsrc_.create (sec_shape, did_);
-  else
-    tsrc_ = src_;
-  tdst_.create (dst_shape, did_);
    dst_.create (dst_shape, did_);
 #ifdef __CUDACC__
   cuda_check (cudnnCreateTensorDescriptor  (& srcDesc_));
@@ -0,0 +1,74 @@
+#ifndef NNET_QUANT_
+#define NNET_QUANT_
+
+#include "../include/nnet.h"
+
+// int8推断只在CPU上做，权重wmat_按flts_ x (chls*ksize*ksize)排列，与im2col的k顺序一致
+#ifdef __CUDACC__
+template <> void LayerConvolution<GPU>::calib_layer () { LOG (FATAL) << "\tint8 inference is CPU only";  }
+template <> void LayerConvolution<GPU>::quant_layer () { LOG (FATAL) << "\tint8 inference is CPU only";  }
+template <> void LayerConvolution<GPU>::fprop_int8  () { fprop (false);  }
+template <> void LayerFullConn<GPU>::calib_layer () { LOG (FATAL) << "\tint8 inference is CPU only";  }
+template <> void LayerFullConn<GPU>::quant_layer () { LOG (FATAL) << "\tint8 inference is CPU only";  }
+template <> void LayerFullConn<GPU>::fprop_int8  () { fprop (false);  }
+#else
+template <>
+void LayerConvolution<CPU>::calib_layer ()
+{ qwmat_.calib (src_, src_.chls(), src_.rows() * src_.cols());
+}
+
+template <>
+void LayerConvolution<CPU>::quant_layer ()
+{ if (secc_ != 1 || src_.shape.layout != kNCHW)
+  { LOG (WARNING) << "\tgrouped or blocked-layout convolution stays in fp32";
+    qwmat_.cmax_.clear ();
+    return;
+  }
+  qwmat_.quantize (wmat_, flts_, pl_.ksize * pl_.ksize);
+}
+
+template <>
+void LayerConvolution<CPU>::fprop_int8 ()
+{ if (!qwmat_.is_packed ())
+  { fprop (false);
+    return;
+  }
+  const int nums = src_.nums();
+  const int area = patch_.h_col * patch_.w_col;
+  const int dstn = dst_.size() / nums;
+  Tensor<CPU, int8_t> qcol;  qcol.create (Shape (area, qwmat_.kpad, 1, 1));
+  Tensor<CPU, float>  tcol;  tcol.create (Shape (chls_ * pl_.ksize * pl_.ksize, area, 1, 1));
+  TensorCPUf img;  img.shape = Shape (src_.rows(), src_.cols(), src_.chls(), 1);  // nums为1时src_[i]会按行切
+  for (int i = 0; i < nums; ++i)
+  { img.dptr = src_.dptr + (int64_t)i * img.size();
+    img.im2col_fprop (patch_, tcol);
+    qwmat_.quantize_act (tcol.dptr, area, 1, area, qcol.dptr);
+    qwmat_.gemm (area, qcol.dptr, bias_.dptr, dst_.dptr + i * dstn, area, 1);
+  }
+  fuse_.fprop (false, false, dst_, rand_);
+}
+
+template <>
+void LayerFullConn<CPU>::calib_layer ()
+{ qwmat_.calib (src_, src_.size() / src_.nums(), 1);
+}
+
+template <>
+void LayerFullConn<CPU>::quant_layer ()
+{ qwmat_.quantize (wmat_, flts_, 1);
+}
+
+template <>
+void LayerFullConn<CPU>::fprop_int8 ()
+{ if (!qwmat_.is_packed ())
+  { fprop (false);
+    return;
+  }
+  const int nums = src_.nums();
+  Tensor<CPU, int8_t> qsrc;  qsrc.create (Shape (nums, qwmat_.kpad, 1, 1));
+  qwmat_.quantize_act (src_.dptr, nums, qwmat_.cols, 1, qsrc.dptr);
+  qwmat_.gemm (nums, qsrc.dptr, bias_.dptr, dst_.dptr, 1, flts_);
+}
+#endif
+
+#endif
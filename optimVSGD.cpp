@@ -28,23 +28,16 @@ void OptimVSGD<XPU, DT>::update ()
 template <typename XPU, typename DT>
 void OptimVSGD<XPU, DT>::update_sgd ()
 { // mmat_ = momentum * mmat_ - lr * (gmat_ + wd * wmat_)
-  gmat_.blas_axpy (wmat_, po_.wd);
-  mmat_.blas_scal (po_.momentum);
-  mmat_.blas_axpy (gmat_, - po_.lrate);
-
-  wmat_.blas_vadd (wmat_, mmat_);
+  mmat_  = mmat_ * po_.momentum - (gmat_ + wmat_ * po_.wd) * po_.lrate;
+  wmat_ += mmat_;
 }
 
 template <typename XPU, typename DT>
 void OptimVSGD<XPU, DT>::update_nag ()
-{ hmat_.copy (mmat_);
-
-  gmat_.blas_axpy (wmat_, po_.wd);
-  mmat_.blas_scal (po_.momentum);
-  mmat_.blas_axpy (gmat_, - po_.lrate);
-
-  wmat_.blas_axpy (hmat_, - po_.momentum);
-  wmat_.blas_axpy (mmat_, 1+po_.momentum);
+{ // hmat_ 存新的动量，wmat_ += (1+momentum) * m_new - momentum * m_old，之后交换
+  hmat_  = mmat_ * po_.momentum - (gmat_ + wmat_ * po_.wd) * po_.lrate;
+  wmat_ += hmat_ * (1+po_.momentum) - mmat_ * po_.momentum;
+  std::swap (mmat_.dptr, hmat_.dptr);
 }
 
 template <typename XPU, typename DT>
@@ -0,0 +1,254 @@
+#ifndef SIMD_H_
+#define SIMD_H_
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <type_traits>
+#include "xpu.h"
+#if defined(__x86_64__) || defined(__i386__)
+  #include <immintrin.h>
+  #define SIMD_X86
+#endif
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+#define SIMD_INLINE	inline __attribute__((always_inline))
+#define SIMD_CHUNK	16384
+
+enum simd_t
+{ kSimdNone	= 0,
+  kSimdSSE	= 1,
+  kSimdAVX2	= 2,
+  kSimdAVX512	= 3,
+  kSimdVNNI	= 4   // avx512 + int8点积
+};
+
+// 运行时检测一次，SIMD_LEVEL环境变量可以往下压
+inline int simd_level ()
+{ static const int level = [] {
+    int l = kSimdNone;
+#ifdef SIMD_X86
+    __builtin_cpu_init ();
+    l = kSimdSSE;
+    if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma"))  l = kSimdAVX2;
+    if (__builtin_cpu_supports ("avx512f"))  l = kSimdAVX512;
+    if (__builtin_cpu_supports ("avx512f") && __builtin_cpu_supports ("avx512bw") && __builtin_cpu_supports ("avx512vnni"))
+      l = kSimdVNNI;
+#endif
+    const char *env = getenv ("SIMD_LEVEL");
+    if (env && atoi (env) < l)  l = atoi (env);
+    return l;
+  } ();
+  return level;
+}
+
+
+
+// vector_size不能依赖模板参数，逐个写出
+template <typename DT, int W> struct simd_vec;
+#define SIMD_VEC(DT, IT, W) \
+template <> struct simd_vec<DT, W> { \
+  typedef DT type  __attribute__((vector_size(W))); \
+  typedef IT itype __attribute__((vector_size(W))); \
+};
+SIMD_VEC (float,  int32_t, 16)
+SIMD_VEC (float,  int32_t, 32)
+SIMD_VEC (float,  int32_t, 64)
+SIMD_VEC (double, int64_t, 16)
+SIMD_VEC (double, int64_t, 32)
+SIMD_VEC (double, int64_t, 64)
+
+template <typename VT>
+SIMD_INLINE VT simd_sqrt (const VT a)
+{ VT r;
+  for (size_t j = 0; j < sizeof(VT) / sizeof(a[0]); ++j)
+    r[j] = sqrt (a[j]);
+  return r;
+}
+
+// a*b+c，x86上显式用fma指令，不依赖-ffp-contract
+template <typename VT>
+SIMD_INLINE VT simd_fmadd (const VT a, const VT b, const VT c)
+{ return a * b + c;
+}
+
+#ifdef SIMD_X86
+typedef simd_vec<float,  16>::type v4sf;
+typedef simd_vec<float,  32>::type v8sf;
+typedef simd_vec<float,  64>::type v16sf;
+typedef simd_vec<double, 16>::type v2df;
+typedef simd_vec<double, 32>::type v4df;
+typedef simd_vec<double, 64>::type v8df;
+SIMD_INLINE v4sf  simd_sqrt (const v4sf  a) { return (v4sf )_mm_sqrt_ps ((__m128 )a);  }
+SIMD_INLINE v2df  simd_sqrt (const v2df  a) { return (v2df )_mm_sqrt_pd ((__m128d)a);  }
+__attribute__((target("avx")))
+inline v8sf  simd_sqrt (const v8sf  a) { return (v8sf )_mm256_sqrt_ps ((__m256 )a);  }
+__attribute__((target("avx")))
+inline v4df  simd_sqrt (const v4df  a) { return (v4df )_mm256_sqrt_pd ((__m256d)a);  }
+__attribute__((target("avx512f")))
+inline v16sf simd_sqrt (const v16sf a) { return (v16sf)_mm512_sqrt_ps ((__m512 )a);  }
+__attribute__((target("avx512f")))
+inline v8df  simd_sqrt (const v8df  a) { return (v8df )_mm512_sqrt_pd ((__m512d)a);  }
+__attribute__((target("avx2,fma")))
+inline v8sf  simd_fmadd (const v8sf  a, const v8sf  b, const v8sf  c) { return (v8sf )_mm256_fmadd_ps ((__m256 )a, (__m256 )b, (__m256 )c);  }
+__attribute__((target("avx2,fma")))
+inline v4df  simd_fmadd (const v4df  a, const v4df  b, const v4df  c) { return (v4df )_mm256_fmadd_pd ((__m256d)a, (__m256d)b, (__m256d)c);  }
+__attribute__((target("avx512f")))
+inline v16sf simd_fmadd (const v16sf a, const v16sf b, const v16sf c) { return (v16sf)_mm512_fmadd_ps ((__m512 )a, (__m512 )b, (__m512 )c);  }
+__attribute__((target("avx512f")))
+inline v8df  simd_fmadd (const v8df  a, const v8df  b, const v8df  c) { return (v8df )_mm512_fmadd_pd ((__m512d)a, (__m512d)b, (__m512d)c);  }
+#endif
+
+// 宽度为W字节的向量，只给expr.h里op*用到的运算，op*<Packet>就是向量版本
+template <typename DT, int W>
+class Packet {
+public:
+  typedef typename simd_vec<DT, W>::type  vec_t;
+  typedef typename simd_vec<DT, W>::itype ivec_t;
+  static const int lanes = W / sizeof(DT);
+
+  SIMD_INLINE Packet () { }
+  SIMD_INLINE Packet (const vec_t a) : v(a) { }
+  SIMD_INLINE Packet (const DT a) { v = vec_t{} + a;  }
+  SIMD_INLINE static Packet load (const DT *p) { Packet r;  memcpy (&r.v, p, W);  return r;  }
+  SIMD_INLINE void store (DT *p) const { memcpy (p, &v, W);  }
+
+  SIMD_INLINE friend Packet operator+ (const Packet a, const Packet b) { return a.v + b.v;  }
+  SIMD_INLINE friend Packet operator- (const Packet a, const Packet b) { return a.v - b.v;  }
+  SIMD_INLINE friend Packet operator* (const Packet a, const Packet b) { return a.v * b.v;  }
+  SIMD_INLINE friend Packet operator/ (const Packet a, const Packet b) { return a.v / b.v;  }
+  SIMD_INLINE friend Packet max  (const Packet a, const Packet b) { return a.v > b.v ? a.v : b.v;  }
+  SIMD_INLINE friend Packet min  (const Packet a, const Packet b) { return a.v < b.v ? a.v : b.v;  }
+  SIMD_INLINE friend Packet fabs (const Packet a) { return a.v < 0 ? -a.v : a.v;  }
+  SIMD_INLINE friend Packet sqrt (const Packet a) { return simd_sqrt (a.v);  }
+  SIMD_INLINE friend Packet exp  (const Packet a) { return a.exp ();  }
+  SIMD_INLINE friend Packet fmadd (const Packet a, const Packet b, const Packet c) { return simd_fmadd (a.v, b.v, c.v);  }
+private:
+  SIMD_INLINE Packet exp () const;
+public:
+  vec_t v;
+};
+
+// exp(x) = 2^n * exp(r), |r| <= ln2/2; float用Cephes的多项式，double展开到r^11
+template <typename DT, int W>
+SIMD_INLINE Packet<DT, W> Packet<DT, W>::exp () const
+{ const bool sp = sizeof(DT) == 4;
+  const DT hi = sp ?  88.3762626647949 :  709.43613930310;
+  const DT lo = sp ? -87.3365447504019 : -708.39641853226;
+  const vec_t vhi = vec_t{} + hi, vlo = vec_t{} + lo;
+  vec_t x = v > vhi ? vhi : v;
+        x = x < vlo ? vlo : x;
+  vec_t fx = x * (DT)1.44269504088896341 + (DT)0.5;
+  ivec_t n = __builtin_convertvector (fx, ivec_t);
+  vec_t  t = __builtin_convertvector (n,  vec_t);
+  n  = t > fx ? n - 1 : n;  // 截断变floor
+  t  = __builtin_convertvector (n,  vec_t);
+  x  = x - t * (DT)0.693145751953125 - t * (DT)1.42860682030941723212e-6;
+
+  vec_t p;
+  if (sp)
+  { p = vec_t{} + (DT)1.9875691500E-4;
+    p = p * x + (DT)1.3981999507E-3;
+    p = p * x + (DT)8.3334519073E-3;
+    p = p * x + (DT)4.1665795894E-2;
+    p = p * x + (DT)1.6666665459E-1;
+    p = p * x + (DT)5.0000001201E-1;
+    p = p * x * x + x + (DT)1;
+  } else
+  { p = vec_t{} + (DT)(1./39916800);
+    const DT c[] = { 1./3628800, 1./362880, 1./40320, 1./5040, 1./720, 1./120, 1./24, 1./6, 1./2, 1., 1. };
+    for (int k = 0; k < 11; ++k)
+      p = p * x + c[k];
+  }
+  const int mbits = sp ? 23 : 52;
+  const int bias  = sp ? 127 : 1023;
+  ivec_t e = (n + bias) << mbits;
+  vec_t  s;  memcpy (&s, &e, W);
+  return p * s;
+}
+
+
+
+template <template <typename> class Oper, typename DT, int W>
+SIMD_INLINE void simd_unary_loop (const int n, const DT *a, DT *y)
+{ typedef Packet<DT, W> P;
+  Oper<P> vop;  Oper<DT> sop;
+  int i = 0;
+  for (; i + P::lanes <= n; i += P::lanes)
+    vop (P::load (a+i)).store (y+i);
+  for (; i < n; ++i)
+    y[i] = sop (a[i]);
+}
+
+template <template <typename> class Oper, typename DT, int W>
+SIMD_INLINE void simd_binary_loop (const int n, const DT *a, const DT *b, DT *y)
+{ typedef Packet<DT, W> P;
+  Oper<P> vop;  Oper<DT> sop;
+  int i = 0;
+  for (; i + P::lanes <= n; i += P::lanes)
+    vop (P::load (a+i), P::load (b+i)).store (y+i);
+  for (; i < n; ++i)
+    y[i] = sop (a[i], b[i]);
+}
+
+#define SIMD_TARGET(level, attr, W) \
+template <template <typename> class Oper, typename DT> attr \
+void simd_unary_  ## level (const int n, const DT *a, DT *y) \
+{ simd_unary_loop <Oper, DT, W> (n, a, y);  } \
+template <template <typename> class Oper, typename DT> attr \
+void simd_binary_ ## level (const int n, const DT *a, const DT *b, DT *y) \
+{ simd_binary_loop<Oper, DT, W> (n, a, b, y);  }
+
+#ifdef SIMD_X86
+SIMD_TARGET (sse,    __attribute__((target("sse2"))),     16)
+SIMD_TARGET (avx2,   __attribute__((target("avx2,fma"))), 32)
+SIMD_TARGET (avx512, __attribute__((target("avx512f"))),  64)
+#else
+SIMD_TARGET (sse,    , 16)
+#endif
+
+// 在调用线程上按CPU支持的最宽向量执行，不再分块
+template <template <typename> class Oper, typename DT>
+void simd_unary_serial (const int n, const DT *a, DT *y)
+{ const int level = simd_level ();
+#ifdef SIMD_X86
+  if      (level >= kSimdAVX512)  simd_unary_avx512<Oper> (n, a, y);
+  else if (level >= kSimdAVX2)    simd_unary_avx2  <Oper> (n, a, y);
+  else
+#endif
+                                  simd_unary_sse   <Oper> (n, a, y);
+}
+
+template <template <typename> class Oper, typename DT>
+void simd_binary_serial (const int n, const DT *a, const DT *b, DT *y)
+{ const int level = simd_level ();
+#ifdef SIMD_X86
+  if      (level >= kSimdAVX512)  simd_binary_avx512<Oper> (n, a, b, y);
+  else if (level >= kSimdAVX2)    simd_binary_avx2  <Oper> (n, a, b, y);
+  else
+#endif
+                                  simd_binary_sse   <Oper> (n, a, b, y);
+}
+
+// 线程池按SIMD_CHUNK分块，块内按CPU支持的最宽向量执行
+template <template <typename> class Oper, typename DT>
+void simd_unary (const int64_t n, const DT *a, DT *y)
+{ ThreadPool::get().parallel_for ((int64_t)0, n, (int64_t)SIMD_CHUNK, [&] (const int64_t i, const int64_t end)
+  { simd_unary_serial<Oper> ((int)(end - i), a+i, y+i);
+  });
+}
+
+template <template <typename> class Oper, typename DT>
+void simd_binary (const int64_t n, const DT *a, const DT *b, DT *y)
+{ ThreadPool::get().parallel_for ((int64_t)0, n, (int64_t)SIMD_CHUNK, [&] (const int64_t i, const int64_t end)
+  { simd_binary_serial<Oper> ((int)(end - i), a+i, b+i, y+i);
+  });
+}
+
+#pragma GCC diagnostic pop
+
+#endif
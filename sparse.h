@@ -53,8 +53,8 @@ public:
   int cols () const { return shape.cols;  };  // 稀疏
   int chls () const { return shape.chls;  };
   int nums () const { return shape.nums;  };
-  int size () const { return shape.size;  };
-  int size_row () const { return (shape.rows+1) * sizeof(int);  };
+  int64_t size () const { return shape.size;  };  // nnz，rowPtr/colIdx仍按cusparse/MKL用int
+  size_t size_row () const { return (shape.rows+1) * sizeof(int);  };
   size_t size_idx () const { return  shape.size * sizeof(int);  };
   size_t size_val () const { return  shape.size * sizeof(DT );  };
   void print (const int cnt) const;
@@ -8,24 +8,38 @@
 #include "expr.h"
 #include "xpu.h"
 
+// 内存布局，维度编号仍按rows, cols, chls, nums解释，只改元素存放的位置
+// 分块布局把chls按8或16补齐，一个块内的通道放在最内层
+enum layout_t
+{ kNCHW		= 0,
+  kNHWC		= 1,
+  kNCHW8c	= 2,
+  kNCHW16c	= 3
+};
+
 class Shape {
 public:
   explicit Shape ();
   explicit Shape (const int a, const int b, const int c, const int d);
-  explicit Shape (const int a, const int b, const int c, const int d, const int e);
+  explicit Shape (const int a, const int b, const int c, const int d, const int64_t e);
   bool operator == (const Shape &s) const;
   bool operator != (const Shape &s) const;
   void set_dims ();
   void set_nums (const int n);
   void set_chls (const int c);
   void set_cols (const int c);
+  void set_layout (const int l);
+  int get_block () const;  // 分块布局的通道块大小，其余为1
+  int get_chlsP () const;  // 补齐后的通道数
   int get_dimsX (const int d) const;
-  int get_sizeX (const int d) const;
-  int get_strdX (const int d) const;
+  int64_t get_sizeX (const int d) const;
+  int64_t get_strdX (const int d) const;
   void re_shape (const int a, const int b, const int c, const int d);
   void print ();
   int rows, cols, chls, nums;
-  int size, dims;
+  int64_t size;  // 各维仍是int，元素总数可以超过2^31
+  int dims;
+  int layout;
 };
 
 class Patch {
@@ -53,17 +67,109 @@ enum rand_t
   UNIFORM	= 2
 };
 
+// Philox4x32-10，计数器型随机数：(seed, subseq, offset)直接算出第offset组的4个32位数
+// 不同线程、不同图片各用各的subseq或offset，结果与线程数无关
+class Philox {
+public:
+  typedef uint32_t result_type;
+  XPU_CALLABLE_INLINE explicit Philox (const uint64_t seed = 0, const uint64_t subseq = 0, const uint64_t offset = 0) : idx_(4)
+  { key_[0] = (uint32_t)seed;    key_[1] = (uint32_t)(seed   >> 32);
+    ctr_[0] = (uint32_t)offset;  ctr_[1] = (uint32_t)(offset >> 32);
+    ctr_[2] = (uint32_t)subseq;  ctr_[3] = (uint32_t)(subseq >> 32);
+  }
+  XPU_CALLABLE_INLINE static void block (const uint32_t key[2], const uint32_t ctr[4], uint32_t out[4])
+  { uint32_t k0 = key[0], k1 = key[1];
+    uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+    for (int r = 0; r < 10; ++r)
+    { const uint64_t p0 = (uint64_t)0xD2511F53 * c0;
+      const uint64_t p1 = (uint64_t)0xCD9E8D57 * c2;
+      c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;  c1 = (uint32_t)p1;
+      c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;  c3 = (uint32_t)p0;
+      k0 += 0x9E3779B9;  k1 += 0xBB67AE85;
+    }
+    out[0] = c0;  out[1] = c1;  out[2] = c2;  out[3] = c3;
+  }
+  XPU_CALLABLE_INLINE uint32_t operator() ()
+  { if (idx_ == 4)
+    { block (key_, ctr_, buf_);
+      if (++ctr_[0] == 0)  ++ctr_[1];
+      idx_ = 0;
+    }
+    return buf_[idx_++];
+  }
+  XPU_CALLABLE_INLINE static float to_uniform (const uint32_t x) { return ((x >> 8) + 0.5f) * (1.f / 16777216.f);  }  // (0, 1)
+  XPU_CALLABLE_INLINE float uniform () { return to_uniform ((*this) ());  }
+  XPU_CALLABLE_INLINE int next (const int n) { return (int)(((uint64_t)(*this) () * n) >> 32);  }  // [0, n)
+  static constexpr uint32_t min () { return 0;  }
+  static constexpr uint32_t max () { return UINT32_MAX;  }
+private:
+  uint32_t key_[2], ctr_[4], buf_[4];
+  int idx_;
+};
+
+// CPU上每次填充从offset_接着取，按4个一组并行填，GPU仍用curand
 template <typename XPU>
 class Random {
 public:
   explicit Random (const int did);
   ~Random();
   void set_seed (int seed);
-  void gaussian (float *data, int size, const float mu, const float sigma) const;
-  void uniform  (float *data, int size, const float  a, const float b)     const;
+  void gaussian (float *data, int64_t size, const float mu, const float sigma) const;
+  void uniform  (float *data, int64_t size, const float  a, const float b)     const;
+  uint64_t get_seed () const { return seed_;  }
 private:
   int did_;
-  VSLStreamStatePtr vStream_;
+  uint64_t seed_;
+  mutable uint64_t offset_;  // 已用掉的组数
+};
+
+
+
+#define MEM_ALIGN	64
+#define MEM_HUGE_PAGE	(2 << 20)
+#define MEM_HUGE_AUTO	(64 << 20)
+
+enum mem_t
+{ kMemAuto	= 0,  // 对齐，MEM_HUGE_AUTO以上用透明大页
+  kMemAlign	= 1,  // 只按MEM_ALIGN对齐
+  kMemHuge	= 2,  // MEM_HUGE_PAGE以上用透明大页
+  kMemHugeTLB	= 3,  // 显式大页，分不到时退回kMemHuge
+  kMemMapped	= 4   // 文件映射，不进缓存
+};
+
+class MemBlock {
+public:
+  size_t len, offset;
+  int pol, kind;
+  bool live;
+};
+
+template <typename XPU>
+class MemPool {
+public:
+  explicit MemPool () : hits(0), misses(0), held(0), used(0), peak(0), mapped(0), caching(true), small_(0), huge_(0) { }
+  static MemPool<XPU>& get (const int did);
+  static size_t get_class (const size_t len);
+  void *alloc (const size_t len, const int pol = kMemAuto);
+  void *map   (const int fd, const size_t len, const size_t offset);
+  void  free  (void *ptr);
+  void  trim  ();
+  void  print (const int did);
+private:
+  void *raw_alloc (const size_t len, const int pol, int &kind);
+  void  raw_free  (void *ptr, const MemBlock &blk);
+  void  raw_trim  ();
+  void  print_tlb ();
+public:
+  size_t hits, misses;
+  size_t held, used, peak;  // 空闲链表里缓存的字节，已分出去的字节，held+used的峰值
+  size_t mapped;
+  bool caching;
+private:
+  size_t small_, huge_;  // 持有的普通页、大页字节数
+  std::mutex mtx_;
+  std::unordered_map<size_t, vector<void*>> free_;  // 档位 | 策略 -> 缓存的块
+  std::unordered_map<void*,  MemBlock>      blks_;  // 内存池持有的全部块
 };
 
 
@@ -71,6 +177,9 @@ private:
 template <typename XPU, typename DT>
 class SparseTensor;
 
+template <typename XPU, typename DT>
+class TensorView;
+
 class TensorFormat {
 public:
   explicit TensorFormat () { };
@@ -78,7 +187,23 @@ public:
 public:
   int rows, cols, chls, nums;
   int numBatch, numField, numClass;
-  bool isTrain;
+  int layout;  // 图像缓冲和输入节点的布局，layout_t
+  bool isTrain, isHalf, isPrefetch;
+};
+
+// gemm写回时顺带做的逐元素操作：加bias（按行或按列），负半轴乘slope，slope为0即relu
+template <typename DT>
+class Epilogue {
+public:
+  explicit Epilogue (const DT *b = NULL, const bool row = true, const DT s = 1) : bias(b), brow(row), slope(s) { }
+  bool is_identity () const { return bias == NULL && slope == (DT)1;  }
+  XPU_CALLABLE_INLINE DT apply (DT v, const int m, const int n) const
+  { if (bias)  v += bias[brow ? m : n];
+    return v >= (DT)0 ? v : v * slope;
+  }
+  const DT *bias;
+  bool brow;
+  DT slope;
 };
 
 template <typename XPU, typename DT>
@@ -87,14 +212,26 @@ public:
   explicit Tensor ();
   ~Tensor ();
 public:
-  void create (const Shape &s, const int did = 0);
+  void create (const Shape &s, const int did = 0, const int pol = kMemAuto);
+  void release ();  // 自己持有时归还内存池，dptr置空，shape不变
   void copy (const Tensor<GPU, DT> &in);
   void copy (const Tensor<CPU, DT> &in);
+  void copy (const TensorView<XPU, DT> &in);
+  void relayout (const Tensor<XPU, DT> &in);  // 逻辑维度相同，按各自的shape.layout搬运
   Tensor<XPU, DT> section (const int begin, const int end) const;
+  TensorView<XPU, DT> view () const;
   Tensor<XPU, DT> operator[] (const int idx) const { return section (idx, idx+1);  }
   Tensor<XPU, DT>& operator= (const Tensor<XPU, DT> &t);
+  template <typename E>  // 赋值Tensor仍是共享指针，赋值表达式才计算
+  typename std::enable_if<exp_traits<E>::is_exp && !std::is_same<E, Tensor<XPU, DT>>::value, Tensor<XPU, DT>&>::type
+  operator= (const E &e)
+  { eval<equalto<DT>> (e);  return *this;  }
+  template <typename E> Tensor<XPU, DT>& operator+= (const E &e) { eval<plusto<DT>> (e);  return *this;  }
+  template <typename E> Tensor<XPU, DT>& operator-= (const E &e) { eval<subto <DT>> (e);  return *this;  }
+  template <typename E> Tensor<XPU, DT>& operator*= (const E &e) { eval<multo <DT>> (e);  return *this;  }
+  template <class Saver, typename E> void eval (const E &e);
 private:
-  void mem_alloc();
+  void mem_alloc(const int pol);
   void mem_free ();
 public:
   void mem_set (const unsigned char a);
@@ -105,21 +242,29 @@ public:
 public:
   void save (const string file);
   void load (const string file, const int did);
+  void prefetch () const;
   void show_image (int numc = 0);
-  void read_image_data (const TensorFormat &tf, const string &file, const int idx, const Tensor<XPU, DT> &mean);
+  void read_image_data (const TensorFormat &tf, const string &file, const int idx, const Tensor<XPU, DT> &mean, Philox &rng);
   void read_image_label (const MetaImage &dimg, const string &file, const int idx);
   void read_image (const TensorFormat &tf, const vector<string> &imgList);
 public:
   void init (const DT a);
   void init (const Random<XPU> &random, const int method, const DT a=0.f,  const DT b=1.f);
-  void im2col_fprop (const Patch &p, Tensor<XPU, DT> &im_col);
-  void col2im_bprop (const Patch &p, Tensor<XPU, DT> &im_col);
+  void im2col_fprop (const Patch &p, Tensor<XPU, DT> &im_col, const int p0 = 0);  // im_col为K x pc，取输出位置[p0, p0+pc)
+  void col2im_bprop (const Patch &p, const Tensor<XPU, DT> &im_col, const int p0 = 0);  // 累加到自身
   void shuffle (const vector<int> &idx);
   void softmax ();
   void add (const DT val);
 public:
+  // 矩阵按cols为列数、其余维度并为行数看待
   void blas_gemm (const bool transA, const bool transB,
     const Tensor<XPU, DT> &A, const Tensor<XPU, DT> &B, DT alpha, DT beta);
+  void blas_gemm (const bool transA, const bool transB,
+    const Tensor<XPU, DT> &A, const Tensor<XPU, DT> &B, DT alpha, DT beta, const Epilogue<DT> &ep);
+  void blas_gemm_strided (const bool transA, const bool transB, const int batch,
+    const Tensor<XPU, DT> &A, const Tensor<XPU, DT> &B, DT alpha, DT beta, const Epilogue<DT> &ep = Epilogue<DT> ());
+  static void blas_gemm_batched (const bool transA, const bool transB,
+    const vector<Tensor<XPU, DT>> &A, const vector<Tensor<XPU, DT>> &B, vector<Tensor<XPU, DT>> &C, DT alpha, DT beta);
   void blas_gemv (const bool transA,
     const Tensor<XPU, DT> &A, const Tensor<XPU, DT> &X, DT alpha, DT beta);
   void sparse_gemv (const bool transA,
@@ -151,7 +296,10 @@ public:
   DT reduce_sum () const;
   DT reduce_max () const;
   void reduce_sum  (const Tensor<XPU, DT> &in, const int keepdim);
+  void reduce_mean (const Tensor<XPU, DT> &in, const int keepdim);
   void reduce_var  (const Tensor<XPU, DT> &in, const int keepdim);
+  void reduce_var  (const Tensor<XPU, DT> &in, const int keepdim, Tensor<XPU, DT> &mean);  // 一遍同时得到均值
+  void bdcast_add (const Tensor<XPU, DT> &bin, const int keepdim);
   void bdcast_sub (const Tensor<XPU, DT> &bin, const int keepdim);
   void bdcast_mul (const Tensor<XPU, DT> &bin, const int keepdim);
   void bdcast_div (const Tensor<XPU, DT> &bin, const int keepdim);
@@ -162,8 +310,10 @@ public:
   int cols () const { return shape.cols;  }
   int chls () const { return shape.chls;  }
   int nums () const { return shape.nums;  }
-  int size () const { return shape.size;  }
+  int64_t size () const { return shape.size;  }
   size_t size_d () const { return shape.size * sizeof(DT);  }
+  bool is_index32 () const { return shape.size <= INT_MAX;  }  // 元素数放得进int，kernel走32位下标
+  int  size32 () const { CHECK (is_index32 ()) << "\ttensor too large for a 32-bit api";  return (int)shape.size;  }
   void print (const int cnt) const;
   cudaStream_t   get_copy_stream () const { return dnnctx[did_]->stream_;  }
   cudaStream_t   get_calc_stream () const { return dnnctx[did_]->stream_;  }
@@ -181,13 +331,124 @@ typedef Tensor<GPU, float>  TensorGPUf;
 typedef Tensor<CPU, float>  TensorCPUf;
 typedef Tensor<GPU, double> TensorGPUd;
 typedef Tensor<CPU, double> TensorCPUd;
+typedef Tensor<GPU, bf16>   TensorGPUh;
+typedef Tensor<CPU, bf16>   TensorCPUh;
+
+template <typename XPU, typename DT>
+struct exp_traits<Tensor<XPU, DT>> {
+  static const bool is_exp = true;
+  typedef typename acc_type<DT>::type type;
+  typedef ExpTensor<DT> exp_t;
+  static exp_t make (const Tensor<XPU, DT> &t) { exp_t e;  e.dptr = t.dptr;  e.size = t.size();  return e;  }
+};
+
+template <class Saver, typename DT, typename E, typename IT>
+XPU_KERNEL(kernel_eval) (const IT num_kernels, DT *y, const E e)
+{ kernel_for (i, num_kernels)
+    Saver::save (y[i], e.eval(i));
+}
+
+// 整个表达式一次遍历，标量右值按DT落成ExpScalar
+template <typename XPU, typename DT> template <class Saver, typename E>
+void Tensor<XPU, DT>::eval (const E &e)
+{ typedef exp_lower<E, DT> lower;
+  const typename lower::type exp = lower::make (e);
+  const int64_t N = size();  exp.check (N);
+#ifdef __CUDACC__
+  if (is_index32 ())
+    kernel_eval_kernel<Saver><<<cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream()>>> ((int)N, dptr, exp);
+  else
+    kernel_eval_kernel<Saver><<<cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream()>>> (N, dptr, exp);
+#else
+  if (is_index32 ())
+    XPU_KERNEL_LAUNCH (kernel_eval<Saver>, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream(), (int)N, dptr, exp);
+  else
+    XPU_KERNEL_LAUNCH (kernel_eval<Saver>, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream(), N, dptr, exp);
+#endif
+  cuda_sync_check ("kernel_eval");
+}
+
+
+
+// 维度编号与Shape::get_dimsX一致，1 rows, 2 cols, 3 chls, 4 nums
+class Stride {
+public:
+  template <typename IT>
+  XPU_CALLABLE_INLINE IT offset (IT i) const
+  { const IT c = i % dims[1];  i /= dims[1];
+    const IT r = i % dims[0];  i /= dims[0];
+    const IT h = i % dims[2];  i /= dims[2];
+    return r * (IT)strd[0] + c * (IT)strd[1] + h * (IT)strd[2] + i * (IT)strd[3];  // IT为int时is_index32已保证放得下
+  }
+  int dims[4];
+  int64_t strd[4];  // 切片、转置后的步长可以超过2^31
+};
+
+template <typename XPU, typename DT>
+class TensorView : public XPU {
+public:
+  explicit TensorView () : dptr(NULL), did_(0) { }
+  explicit TensorView (DT *ptr, const Shape &s, const int did = 0);
+  TensorView<XPU, DT> slice (const int d, const int begin, const int end) const;
+  TensorView<XPU, DT> transpose (const int d1, const int d2) const;
+  bool is_contiguous () const;
+  bool is_index32 () const;
+  void copy (const TensorView<XPU, DT> &in);
+  void copy (const Tensor<XPU, DT> &in) { copy (in.view());  }
+  void blas_vadd (const TensorView<XPU, DT> &A, const TensorView<XPU, DT> &B);
+  void blas_vsub (const TensorView<XPU, DT> &A, const TensorView<XPU, DT> &B);
+  void blas_vmul (const TensorView<XPU, DT> &A, const TensorView<XPU, DT> &B);
+  void blas_vdiv (const TensorView<XPU, DT> &A, const TensorView<XPU, DT> &B);
+  int rows () const { return shape.rows;  }
+  int cols () const { return shape.cols;  }
+  int chls () const { return shape.chls;  }
+  int nums () const { return shape.nums;  }
+  int64_t size () const { return shape.size;  }
+  int64_t get_strd (const int d) const { return strd.strd[d-1];  }
+  cudaStream_t get_calc_stream () const { return dnnctx[did_]->stream_;  }
+private:
+  template <class Oper>
+  void binary (const TensorView<XPU, DT> &A, const TensorView<XPU, DT> &B);
+public:
+  Shape shape;
+  Stride strd;
+  DT *dptr;
+  int did_;
+};
+
+typedef TensorView<GPU, float>  TensorViewGPUf;
+typedef TensorView<CPU, float>  TensorViewCPUf;
+typedef TensorView<GPU, double> TensorViewGPUd;
+typedef TensorView<CPU, double> TensorViewCPUd;
+
+
+
+// int8权重，每个输出通道一个scale；激活按输入通道统计的绝对值上界先做平滑再按层量化，
+// 存成加128的无符号数，行和用来扣掉零点
+class QTensor {
+public:
+  explicit QTensor () : rows(0), cols(0), kpad(0), scale(0.f) { }
+  void calib (const Tensor<CPU, float> &x, const int chls, const int plane);
+  void quantize (const Tensor<CPU, float> &w, const int rows, const int group);
+  void quantize_act (const float *x, const int nums, const int ldn, const int ldk, int8_t *q) const;
+  void gemm (const int nums, const int8_t *q, const float *bias, float *y, const int ldm, const int ldn) const;
+  bool is_packed () const { return kpad > 0;  }
+public:
+  Tensor<CPU, int8_t> wmat_;  // rows x kpad
+  Tensor<CPU, float>  scal_;  // 每行的反量化系数，已乘上激活的scale
+  Tensor<CPU, float>  smth_;  // 每个k上激活的量化系数
+  vector<int>   csum_;
+  vector<float> cmax_;
+  int rows, cols, kpad;
+  float scale;
+};
 
 
 
 template <typename DT>
 class DataBuffer {
 public:
-  explicit DataBuffer () : did_(0), curr_no_(0), dnums_(0), lnums_(0), inums_(0) { }
+  explicit DataBuffer () : did_(0), curr_no_(0), dnums_(0), lnums_(0), inums_(0), mapped_(false), prefetch_(false), seed_(1), reads_(0) { }
   void reset_image_buf ();
   void  wait_image_buf (const int thr) { while (inums_ < thr)  sleep (0.001);  }
   void create (const TensorFormat &tf, const int did);
@@ -197,6 +458,7 @@ public:
   void read_stats  (const ParaFileData &pd);
   void read_image_thread (const TensorFormat &tf);
   void read_image_openmp (const TensorFormat &tf);
+  void read_image_slab (const TensorFormat &tf, const int begin, const int end, const bool is_label);
   void read (const ParaFileData &pd);
   void set_image_lnums () { lnums_ = image_.imgList.size();  }
   void get_mean (const ParaFileData &pd, const TensorFormat &tf);
@@ -205,6 +467,7 @@ public:
 public:
   Tensor<CPU, DT> inst_;
   Tensor<CPU, DT> data_;
+  Tensor<CPU, bf16> hdata_;  // tformat.half时代替data_
   Tensor<CPU, DT> pred_;
   Tensor<CPU, DT> mean_;
   Tensor<CPU, DT> label_;
@@ -212,25 +475,31 @@ public:
   int did_;
   int curr_no_;
   int dnums_, lnums_, inums_;
+  bool mapped_, prefetch_;
+  uint64_t seed_, reads_;  // 第reads_次读缓冲里第i张图用Philox (seed_, reads_<<32 | i)做增广
 };
 
 template <typename XPU, typename DT>
 class DataBatch {
 public:
-  explicit DataBatch () : did_(0), curr_no_(0), dnums_(0) { }
+  explicit DataBatch () : did_(0), curr_no_(0), dnums_(0), draws_(0) { }
   void reset ();
   void copy (const DataBuffer<DT> &in);
   void send (DataBuffer<DT> &in) const;
   void next (const DataBuffer<DT> &in);
   void rand (const DataBuffer<DT> &in);
+  void set_mean (const Tensor<CPU, DT> &mean, const int did);
   void set_dnums () { dnums_ = data_.nums();  }
   Tensor<XPU, DT>  data_;
   Tensor<XPU, DT>  pred_;
   Tensor<XPU, DT> label_;
+  Tensor<XPU, DT>  mean_;
+  Tensor<XPU, bf16> hdata_;
   int did_;
   int curr_no_;
   int next_no_;
   int dnums_;
+  uint64_t draws_;  // rand的第draws_次取位置用Philox (in.seed_, 3<<62 | draws_)
 };
 
 #endif
@@ -0,0 +1,205 @@
+#ifndef TENSOR_ALLOC_
+#define TENSOR_ALLOC_
+
+#include <sys/mman.h>
+#include "../include/tensor.h"
+
+template <typename XPU>
+MemPool<XPU>& MemPool<XPU>::get (const int did)
+{ static MemPool<XPU> pool[CUDA_NUM_DEVICES];
+  CHECK (did >= 0 && did < CUDA_NUM_DEVICES);
+  return pool[did];
+}
+
+// 2 MB以下每个2的幂分4档，以上按整2 MB页取整
+template <typename XPU>
+size_t MemPool<XPU>::get_class (const size_t len)
+{ const size_t page = MEM_HUGE_PAGE;
+  if (len <= 256)
+    return 256;
+  if (len >= page)
+    return (len + page - 1) / page * page;
+  const int    lg   = 63 - __builtin_clzll (len - 1);
+  const size_t step = (size_t)1 << (lg - 2);
+  return (len + step - 1) / step * step;
+}
+
+template <typename XPU>
+void *MemPool<XPU>::alloc (const size_t len, const int pol)
+{ std::unique_lock<std::mutex> lock (mtx_);
+  const size_t cls = get_class (len);
+  const size_t key = cls | pol;  // 档位都是64的倍数，低位放分配策略
+  void *ptr = NULL;
+  auto it = free_.find (key);
+  if (caching && it != free_.end() && !it->second.empty())
+  { ptr = it->second.back ();
+    it->second.pop_back ();
+    held -= cls;
+    hits++;
+  } else
+  { MemBlock blk;
+    blk.len    = cls;
+    blk.offset = 0;
+    blk.pol    = pol;
+    ptr = raw_alloc (cls, pol, blk.kind);
+    blks_[ptr] = blk;
+    (blk.kind == kMemAlign ? small_ : huge_) += cls;
+    misses++;
+  }
+  blks_[ptr].live = true;
+  used += cls;
+  peak  = std::max (peak, used + held);
+  return ptr;
+}
+
+template <typename XPU>
+void MemPool<XPU>::free (void *ptr)
+{ std::unique_lock<std::mutex> lock (mtx_);
+  auto it = blks_.find (ptr);
+  CHECK (it != blks_.end() && it->second.live) << "\tblock not allocated by memory pool";
+  MemBlock &blk = it->second;
+  blk.live = false;
+  if (blk.kind == kMemMapped)
+  { mapped -= blk.len;
+    raw_free (ptr, blk);
+    blks_.erase (it);
+    return;
+  }
+  used -= blk.len;
+  if (caching)
+  { free_[blk.len | blk.pol].push_back (ptr);
+    held += blk.len;
+  } else
+  { (blk.kind == kMemAlign ? small_ : huge_) -= blk.len;
+    raw_free (ptr, blk);
+    blks_.erase (it);
+  }
+}
+
+template <typename XPU>
+void MemPool<XPU>::trim ()
+{ std::unique_lock<std::mutex> lock (mtx_);
+  raw_trim ();
+}
+
+template <typename XPU>
+void MemPool<XPU>::raw_trim ()
+{ for (auto &it : free_)
+    for (size_t i = 0; i < it.second.size(); ++i)
+    { auto blk = blks_.find (it.second[i]);
+      (blk->second.kind == kMemAlign ? small_ : huge_) -= blk->second.len;
+      raw_free (blk->first, blk->second);
+      blks_.erase (blk);
+    }
+  free_.clear ();
+  held = 0;
+}
+
+template <typename XPU>
+void MemPool<XPU>::print (const int did)
+{ std::unique_lock<std::mutex> lock (mtx_);
+  char poolstr[160];  sprintf (poolstr, "\thits\t%zu\tmisses\t%zu\tused\t%.2f MB\theld\t%.2f MB\tpeak\t%.2f MB\tmapped\t%.2f MB",
+    hits, misses, used / 1e6, held / 1e6, peak / 1e6, mapped / 1e6);
+  LOG (INFO) << "\tXPU  " << did << "  memory pool" << poolstr;
+  print_tlb ();
+}
+
+
+
+#ifdef __CUDACC__
+template <>
+void *MemPool<GPU>::raw_alloc (const size_t len, const int pol, int &kind)
+{ size_t avail, total;
+  cuda_check (cudaMemGetInfo (&avail, &total));
+  if (len > avail)
+    raw_trim ();
+  void *ptr = NULL;
+  cuda_malloc (&ptr, len);
+  kind = kMemAlign;
+  return ptr;
+}
+
+template <>
+void MemPool<GPU>::raw_free (void *ptr, const MemBlock &blk)
+{ cuda_check (cudaFree (ptr));
+}
+
+template <>
+void MemPool<GPU>::print_tlb ()
+{ }
+
+template class MemPool<GPU>;
+#else
+template <>
+void *MemPool<CPU>::raw_alloc (const size_t len, const int pol, int &kind)
+{ void *ptr = NULL;
+  if (pol == kMemHugeTLB && len >= MEM_HUGE_PAGE)
+  { ptr = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED)
+    { kind = kMemHugeTLB;
+      return ptr;
+    }
+    LOG (WARNING) << "\texplicit huge pages unavailable, using transparent huge pages\t" << len / 1e6 << " MB";
+  }
+
+  const bool thp = len >= (pol == kMemAuto ? MEM_HUGE_AUTO : MEM_HUGE_PAGE) && pol != kMemAlign;
+  const size_t align = thp ? MEM_HUGE_PAGE : MEM_ALIGN;
+  if (posix_memalign (&ptr, align, len))
+  { raw_trim ();
+    if (posix_memalign (&ptr, align, len))
+      ptr = NULL;
+  }
+  CHECK (ptr != NULL) << "\tCPU memory allocation failed\t" << len / 1e6 << " MB";
+  if (thp)
+    madvise (ptr, len, MADV_HUGEPAGE);
+  kind = thp ? kMemHuge : kMemAlign;
+  return ptr;
+}
+
+template <>
+void MemPool<CPU>::raw_free (void *ptr, const MemBlock &blk)
+{ if (blk.kind == kMemMapped)
+    munmap ((char*)ptr - blk.offset, blk.len);
+  else if (blk.kind == kMemHugeTLB)
+    munmap (ptr, blk.len);
+  else
+    ::free (ptr);
+}
+
+// 只读映射，加载同一文件的进程共用page cache里的一份
+template <>
+void *MemPool<CPU>::map (const int fd, const size_t len, const size_t offset)
+{ void *base = mmap (NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+  CHECK (base != MAP_FAILED) << "\tmmap failed\t" << len / 1e6 << " MB";
+  void *ptr = (char*)base + offset;
+  std::unique_lock<std::mutex> lock (mtx_);
+  MemBlock blk;
+  blk.len    = len;
+  blk.offset = offset;
+  blk.pol    = kMemMapped;
+  blk.kind   = kMemMapped;
+  blk.live   = true;
+  blks_[ptr] = blk;
+  mapped += len;
+  return ptr;
+}
+
+// 内存池要求大页覆盖的字节数，以及进程实际落在大页上的字节数
+template <>
+void MemPool<CPU>::print_tlb ()
+{ size_t anon_huge = 0;
+  ifstream smaps ("/proc/self/smaps_rollup");
+  for (string key; smaps >> key; )
+    if (key == "AnonHugePages:")
+    { smaps >> anon_huge;
+      break;
+    }
+  char tlbstr[128];  sprintf (tlbstr, "\t4K pages\t%zu\t2M pages\t%zu\tAnonHugePages\t%.2f MB",
+    small_ / 4096, huge_ / MEM_HUGE_PAGE, anon_huge / 1e3);
+  LOG (INFO) << "\tCPU  memory pages" << tlbstr;
+}
+
+template class MemPool<CPU>;
+#endif
+
+#endif
@@ -0,0 +1,407 @@
+#ifndef TENSOR_BLAS_
+#define TENSOR_BLAS_
+
+#include "../include/tensor.h"
+#include "../include/simd.h"
+
+template <typename DT, typename IT>
+XPU_KERNEL(kernel_epilogue) (const IT num_kernels, DT *C, const int ldc, const Epilogue<DT> ep)
+{ kernel_for (i, num_kernels)
+    C[i] = ep.apply (C[i], i / ldc, i % ldc);
+}
+
+// 行主序的C(MxN) = alpha * op(A) * op(B) + beta * C，再做epilogue
+#ifdef __CUDACC__
+static void cublas_gemm (cublasHandle_t h, cublasOperation_t ta, cublasOperation_t tb, int m, int n, int k,
+  const float  *alpha, const float  *A, int lda, const float  *B, int ldb, const float  *beta, float  *C, int ldc)
+{ cuda_check (cublasSgemm (h, ta, tb, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc));
+}
+static void cublas_gemm (cublasHandle_t h, cublasOperation_t ta, cublasOperation_t tb, int m, int n, int k,
+  const double *alpha, const double *A, int lda, const double *B, int ldb, const double *beta, double *C, int ldc)
+{ cuda_check (cublasDgemm (h, ta, tb, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc));
+}
+
+template <typename DT>
+static void gemm (const bool transA, const bool transB, const int M, const int N, const int K, const DT alpha,
+  const DT *A, const int lda, const DT *B, const int ldb, const DT beta, DT *C, const int ldc,
+  const Epilogue<DT> &ep, cublasHandle_t handle, cudaStream_t stream)
+{ // cublas是列主序，C' = op(B)' * op(A)'
+  cublas_gemm (handle, transB ? CUBLAS_OP_T : CUBLAS_OP_N, transA ? CUBLAS_OP_T : CUBLAS_OP_N,
+    N, M, K, &alpha, B, ldb, A, lda, &beta, C, ldc);
+  if (!ep.is_identity ())
+    XPU_KERNEL_LAUNCH (kernel_epilogue, cuda_get_blocks(M*N), CUDA_NUM_THREADS, 0, stream, M*N, C, ldc, ep);
+}
+
+static void cublas_gemm_strided (cublasHandle_t h, cublasOperation_t ta, cublasOperation_t tb, int m, int n, int k,
+  const float  *alpha, const float  *A, int lda, long long sa, const float  *B, int ldb, long long sb,
+  const float  *beta, float  *C, int ldc, long long sc, int batch)
+{ cuda_check (cublasSgemmStridedBatched (h, ta, tb, m, n, k, alpha, A, lda, sa, B, ldb, sb, beta, C, ldc, sc, batch));
+}
+static void cublas_gemm_strided (cublasHandle_t h, cublasOperation_t ta, cublasOperation_t tb, int m, int n, int k,
+  const double *alpha, const double *A, int lda, long long sa, const double *B, int ldb, long long sb,
+  const double *beta, double *C, int ldc, long long sc, int batch)
+{ cuda_check (cublasDgemmStridedBatched (h, ta, tb, m, n, k, alpha, A, lda, sa, B, ldb, sb, beta, C, ldc, sc, batch));
+}
+#else
+#define GEMM_MR	6     // 微内核行数，列数为两条向量
+#define GEMM_KC	256   // A、B的panel在k方向的长度，B的微panel留在L1
+#define GEMM_MC	96    // 一个任务的行数，A的块留在L2
+#define GEMM_NT	256   // 一个任务的列数
+#define GEMM_NC	4096  // 打包B的列数，留在L3
+
+// A的[i0, i0+mc)行打包成MR行一组，组内按k连续；不足的行补0
+template <typename DT>
+static void gemm_pack_a (const bool transA, const DT *A, const int lda, const int i0, const int mc,
+  const int p0, const int kc, DT *pack)
+{ for (int r = 0; r < GEMM_MR; ++r)
+  { const int i = i0 + r;
+    for (int k = 0; k < kc; ++k)
+      pack[k*GEMM_MR+r] = r >= mc ? (DT)0 : transA ? A[(p0+k)*lda+i] : A[i*lda+p0+k];
+  }
+}
+
+template <typename DT>
+static void gemm_pack_b (const bool transB, const DT *B, const int ldb, const int j0, const int nc,
+  const int p0, const int kc, const int nr, DT *pack)
+{ for (int k = 0; k < kc; ++k)
+    for (int c = 0; c < nr; ++c)
+    { const int j = j0 + c;
+      pack[k*nr+c] = c >= nc ? (DT)0 : transB ? B[j*ldb+p0+k] : B[(p0+k)*ldb+j];
+    }
+}
+
+// GEMM_MR x 2W的寄存器块，k方向走完后与C合并；first时按beta缩放C，last时做epilogue
+template <typename DT, int W>
+SIMD_INLINE void gemm_micro (const int kc, const DT *ap, const DT *bp, const DT alpha, const DT beta,
+  DT *C, const int ldc, const int i0, const int j0, const int mr, const int nr,
+  const bool first, const bool last, const Epilogue<DT> &ep)
+{ typedef Packet<DT, W> P;
+  const int L = P::lanes;
+  P c0[GEMM_MR], c1[GEMM_MR];
+  for (int r = 0; r < GEMM_MR; ++r)
+    c0[r] = c1[r] = P ((DT)0);
+  for (int k = 0; k < kc; ++k, ap += GEMM_MR, bp += 2*L)
+  { const P b0 = P::load (bp), b1 = P::load (bp+L);
+    for (int r = 0; r < GEMM_MR; ++r)
+    { const P a (ap[r]);
+      c0[r] = fmadd (a, b0, c0[r]);
+      c1[r] = fmadd (a, b1, c1[r]);
+    }
+  }
+
+  const P va (alpha), vb (beta), zero ((DT)0), slope (ep.slope);
+  const bool full = nr == 2*L;
+  for (int r = 0; r < mr; ++r)
+  { DT *cptr = C + (i0+r)*ldc + j0;
+    DT tmp[2*L];
+    if (!full)
+      for (int c = 0; c < 2*L; ++c)
+        tmp[c] = c < nr ? cptr[c] : (DT)0;
+    DT *optr = full ? cptr : tmp;
+    P v0 = c0[r] * va, v1 = c1[r] * va;
+    if (!first)
+    { v0 = v0 + P::load (optr);  v1 = v1 + P::load (optr+L);
+    } else if (beta != (DT)0)
+    { v0 = fmadd (vb, P::load (optr), v0);  v1 = fmadd (vb, P::load (optr+L), v1);
+    }
+    if (last && !ep.is_identity ())
+    { if (ep.bias && ep.brow)
+      { const P b (ep.bias[i0+r]);  v0 = v0 + b;  v1 = v1 + b;
+      } else if (ep.bias)
+      { DT bias[2*L];
+        for (int c = 0; c < 2*L; ++c)
+          bias[c] = c < nr ? ep.bias[j0+c] : (DT)0;
+        v0 = v0 + P::load (bias);  v1 = v1 + P::load (bias+L);
+      }
+      v0 = max (v0, zero) + slope * min (v0, zero);
+      v1 = max (v1, zero) + slope * min (v1, zero);
+    }
+    v0.store (optr);  v1.store (optr+L);
+    if (!full)
+      for (int c = 0; c < nr; ++c)
+        cptr[c] = tmp[c];
+  }
+}
+
+// 一个任务：行[i0, i1)乘打包B里的列[j0, j1)
+template <typename DT, int W>
+SIMD_INLINE void gemm_macro_loop (const int kc, const DT *apack, const DT *bpack, const DT alpha, const DT beta,
+  DT *C, const int ldc, const int M, const int i0, const int i1, const int jc, const int j0, const int j1, const int nc,
+  const bool first, const bool last, const Epilogue<DT> &ep)
+{ const int nr = 2 * W / sizeof(DT);
+  for (int j = j0; j < j1; j += nr)
+    for (int i = i0; i < i1; i += GEMM_MR)
+      gemm_micro<DT, W> (kc, apack + i*kc, bpack + j*kc, alpha, beta, C, ldc, i, jc+j,
+        std::min (GEMM_MR, M-i), std::min (nr, nc-j), first, last, ep);
+}
+
+#define GEMM_TARGET(level, attr, W) \
+template <typename DT> attr \
+void gemm_macro_ ## level (const int kc, const DT *apack, const DT *bpack, const DT alpha, const DT beta, \
+  DT *C, const int ldc, const int M, const int i0, const int i1, const int jc, const int j0, const int j1, const int nc, \
+  const bool first, const bool last, const Epilogue<DT> &ep) \
+{ gemm_macro_loop<DT, W> (kc, apack, bpack, alpha, beta, C, ldc, M, i0, i1, jc, j0, j1, nc, first, last, ep);  }
+
+#ifdef SIMD_X86
+GEMM_TARGET (sse,    __attribute__((target("sse2"))),     16)
+GEMM_TARGET (avx2,   __attribute__((target("avx2,fma"))), 32)
+GEMM_TARGET (avx512, __attribute__((target("avx512f"))),  64)
+#else
+GEMM_TARGET (sse,    , 16)
+#endif
+
+// 分块：jc按GEMM_NC，pc按GEMM_KC，每层先并行打包A、B，再按GEMM_MC x GEMM_NT的块并行计算
+// par为false时整个gemm在调用线程上做，batched按矩阵并行时用
+template <typename DT>
+static void gemm (const bool transA, const bool transB, const int M, const int N, const int K, const DT alpha,
+  const DT *A, const int lda, const DT *B, const int ldb, const DT beta, DT *C, const int ldc, const Epilogue<DT> &ep,
+  const bool par = true)
+{ if (M <= 0 || N <= 0)
+    return;
+  if (K <= 0)
+  { for (int i = 0; i < M; ++i)
+      for (int j = 0; j < N; ++j)
+        C[i*ldc+j] = ep.apply (beta == (DT)0 ? (DT)0 : beta * C[i*ldc+j], i, j);
+    return;
+  }
+  const int level = simd_level ();
+  const int W  = level >= kSimdAVX512 ? 64 : level >= kSimdAVX2 ? 32 : 16;
+  const int nr = 2 * W / sizeof(DT);
+  const int mpad = (M + GEMM_MR - 1) / GEMM_MR * GEMM_MR;
+  const int ncap = std::min (N, GEMM_NC);
+  Tensor<CPU, DT> apack;  apack.create (Shape (mpad, std::min (K, GEMM_KC), 1, 1));
+  Tensor<CPU, DT> bpack;  bpack.create (Shape ((ncap + nr - 1) / nr * nr, std::min (K, GEMM_KC), 1, 1));
+  ThreadPool &pool = ThreadPool::get ();
+  auto pfor = [&] (const int n, const int grain, const std::function<void(int, int)> &fn)
+  { if (par)  pool.parallel_for (0, n, grain, fn);
+    else      fn (0, n);
+  };
+
+  for (int jc = 0; jc < N; jc += GEMM_NC)
+  { const int nc = std::min (GEMM_NC, N - jc);
+    for (int pc = 0; pc < K; pc += GEMM_KC)
+    { const int kc = std::min (GEMM_KC, K - pc);
+      pfor ((nc + nr - 1) / nr, 8, [&] (const int begin, const int end)
+      { for (int q = begin; q < end; ++q)
+          gemm_pack_b (transB, B, ldb, jc + q*nr, nc - q*nr, pc, kc, nr, bpack.dptr + q*nr*kc);
+      });
+      pfor (mpad / GEMM_MR, 8, [&] (const int begin, const int end)
+      { for (int p = begin; p < end; ++p)
+          gemm_pack_a (transA, A, lda, p*GEMM_MR, M - p*GEMM_MR, pc, kc, apack.dptr + p*GEMM_MR*kc);
+      });
+
+      const bool first = pc == 0, last = pc + kc == K;
+      const int mt = (M  + GEMM_MC - 1) / GEMM_MC;
+      const int nt = (nc + GEMM_NT - 1) / GEMM_NT;
+      pfor (mt * nt, 1, [&] (const int begin, const int end)
+      { for (int t = begin; t < end; ++t)
+        { const int i0 = t % mt * GEMM_MC, i1 = std::min (M,  i0 + GEMM_MC);
+          const int j0 = t / mt * GEMM_NT, j1 = std::min (nc, j0 + GEMM_NT);
+#ifdef SIMD_X86
+          if      (level >= kSimdAVX512)
+            gemm_macro_avx512 (kc, apack.dptr, bpack.dptr, alpha, beta, C, ldc, M, i0, i1, jc, j0, j1, nc, first, last, ep);
+          else if (level >= kSimdAVX2)
+            gemm_macro_avx2   (kc, apack.dptr, bpack.dptr, alpha, beta, C, ldc, M, i0, i1, jc, j0, j1, nc, first, last, ep);
+          else
+#endif
+            gemm_macro_sse    (kc, apack.dptr, bpack.dptr, alpha, beta, C, ldc, M, i0, i1, jc, j0, j1, nc, first, last, ep);
+        }
+      });
+    }
+  }
+}
+
+// 矩阵数不少于线程数时按矩阵并行、每个gemm串行，否则逐个gemm内部并行
+static void gemm_batch (const int batch, const std::function<void(int, bool)> &fn)
+{ ThreadPool &pool = ThreadPool::get ();
+  if (batch >= pool.size ())
+    pool.parallel_for (0, batch, 1, [&] (const int begin, const int end)
+    { for (int b = begin; b < end; ++b)
+        fn (b, false);
+    });
+  else
+    for (int b = 0; b < batch; ++b)
+      fn (b, true);
+}
+
+#ifdef USE_MKL
+static void cblas_gemm (CBLAS_TRANSPOSE ta, CBLAS_TRANSPOSE tb, int m, int n, int k,
+  float  alpha, const float  *A, int lda, const float  *B, int ldb, float  beta, float  *C, int ldc)
+{ cblas_sgemm (CblasRowMajor, ta, tb, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+}
+static void cblas_gemm (CBLAS_TRANSPOSE ta, CBLAS_TRANSPOSE tb, int m, int n, int k,
+  double alpha, const double *A, int lda, const double *B, int ldb, double beta, double *C, int ldc)
+{ cblas_dgemm (CblasRowMajor, ta, tb, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+}
+#endif
+#endif
+
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::blas_gemm (const bool transA, const bool transB,
+  const Tensor<XPU, DT> &A, const Tensor<XPU, DT> &B, DT alpha, DT beta)
+{ blas_gemm (transA, transB, A, B, alpha, beta, Epilogue<DT> ());
+}
+
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::blas_gemm (const bool transA, const bool transB,
+  const Tensor<XPU, DT> &A, const Tensor<XPU, DT> &B, DT alpha, DT beta, const Epilogue<DT> &ep)
+{ const int Ar = A.size() / A.cols(), Br = B.size() / B.cols();
+  const int M = transA ? A.cols() : Ar;
+  const int K = transA ? Ar : A.cols();
+  const int N = transB ? Br : B.cols();
+  CHECK_EQ (K, transB ? B.cols() : Br);
+  CHECK_EQ (M, size() / cols());
+  CHECK_EQ (N, cols());
+#ifdef __CUDACC__
+  gemm (transA, transB, M, N, K, alpha, A.dptr, A.cols(), B.dptr, B.cols(), beta, dptr, cols(), ep,
+    get_blas_handle(), get_calc_stream());
+#elif defined(USE_MKL)
+  cblas_gemm (transA ? CblasTrans : CblasNoTrans, transB ? CblasTrans : CblasNoTrans,
+    M, N, K, alpha, A.dptr, A.cols(), B.dptr, B.cols(), beta, dptr, cols());
+  if (!ep.is_identity ())
+    XPU_KERNEL_LAUNCH (kernel_epilogue, cuda_get_blocks(M*N), CUDA_NUM_THREADS, 0, get_calc_stream(), M*N, dptr, N, ep);
+#else
+  gemm (transA, transB, M, N, K, alpha, A.dptr, A.cols(), B.dptr, B.cols(), beta, dptr, cols(), ep);
+#endif
+  cuda_sync_check ("blas_gemm");
+}
+#ifdef __CUDACC__
+template void TensorGPUf::blas_gemm (const bool transA, const bool transB, const TensorGPUf &A, const TensorGPUf &B, float  alpha, float  beta);
+template void TensorGPUd::blas_gemm (const bool transA, const bool transB, const TensorGPUd &A, const TensorGPUd &B, double alpha, double beta);
+template void TensorGPUf::blas_gemm (const bool transA, const bool transB, const TensorGPUf &A, const TensorGPUf &B, float  alpha, float  beta, const Epilogue<float > &ep);
+template void TensorGPUd::blas_gemm (const bool transA, const bool transB, const TensorGPUd &A, const TensorGPUd &B, double alpha, double beta, const Epilogue<double> &ep);
+#else
+template void TensorCPUf::blas_gemm (const bool transA, const bool transB, const TensorCPUf &A, const TensorCPUf &B, float  alpha, float  beta);
+template void TensorCPUd::blas_gemm (const bool transA, const bool transB, const TensorCPUd &A, const TensorCPUd &B, double alpha, double beta);
+template void TensorCPUf::blas_gemm (const bool transA, const bool transB, const TensorCPUf &A, const TensorCPUf &B, float  alpha, float  beta, const Epilogue<float > &ep);
+template void TensorCPUd::blas_gemm (const bool transA, const bool transB, const TensorCPUd &A, const TensorCPUd &B, double alpha, double beta, const Epilogue<double> &ep);
+#endif
+
+// A、B和自身各等分成batch份连续的矩阵，第b份相乘；按行的bias每份往后挪M个
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::blas_gemm_strided (const bool transA, const bool transB, const int batch,
+  const Tensor<XPU, DT> &A, const Tensor<XPU, DT> &B, DT alpha, DT beta, const Epilogue<DT> &ep)
+{ CHECK (batch > 0 && A.size() % batch == 0 && B.size() % batch == 0 && size() % batch == 0);
+  const int64_t sa = A.size() / batch, sb = B.size() / batch, sc = size() / batch;  // 单个矩阵在int内，整批可以超过
+  const int Ar = sa / A.cols(), Br = sb / B.cols();
+  const int M = transA ? A.cols() : Ar;
+  const int K = transA ? Ar : A.cols();
+  const int N = transB ? Br : B.cols();
+  CHECK_EQ (K, transB ? B.cols() : Br);
+  CHECK_EQ (M, sc / cols());
+  CHECK_EQ (N, cols());
+#ifdef __CUDACC__
+  cublas_gemm_strided (get_blas_handle(), transB ? CUBLAS_OP_T : CUBLAS_OP_N, transA ? CUBLAS_OP_T : CUBLAS_OP_N,
+    N, M, K, &alpha, B.dptr, B.cols(), sb, A.dptr, A.cols(), sa, &beta, dptr, cols(), sc, batch);
+  if (!ep.is_identity ())  // 全局行号正好是b*M+m
+    XPU_KERNEL_LAUNCH (kernel_epilogue, cuda_get_blocks(size()), CUDA_NUM_THREADS, 0, get_calc_stream(), size(), dptr, N, ep);
+#elif defined(USE_MKL)
+  for (int b = 0; b < batch; ++b)
+    cblas_gemm (transA ? CblasTrans : CblasNoTrans, transB ? CblasTrans : CblasNoTrans,
+      M, N, K, alpha, A.dptr + b*sa, A.cols(), B.dptr + b*sb, B.cols(), beta, dptr + b*sc, cols());
+  if (!ep.is_identity ())
+    XPU_KERNEL_LAUNCH (kernel_epilogue, cuda_get_blocks(size()), CUDA_NUM_THREADS, 0, get_calc_stream(), size(), dptr, N, ep);
+#else
+  gemm_batch (batch, [&] (const int b, const bool par)
+  { Epilogue<DT> epb = ep;
+    if (ep.bias && ep.brow)
+      epb.bias += b * M;
+    gemm (transA, transB, M, N, K, alpha, A.dptr + b*sa, A.cols(), B.dptr + b*sb, B.cols(), beta,
+      dptr + b*sc, cols(), epb, par);
+  });
+#endif
+  cuda_sync_check ("blas_gemm_strided");
+}
+#ifdef __CUDACC__
+template void TensorGPUf::blas_gemm_strided (const bool transA, const bool transB, const int batch, const TensorGPUf &A, const TensorGPUf &B, float  alpha, float  beta, const Epilogue<float > &ep);
+template void TensorGPUd::blas_gemm_strided (const bool transA, const bool transB, const int batch, const TensorGPUd &A, const TensorGPUd &B, double alpha, double beta, const Epilogue<double> &ep);
+#else
+template void TensorCPUf::blas_gemm_strided (const bool transA, const bool transB, const int batch, const TensorCPUf &A, const TensorCPUf &B, float  alpha, float  beta, const Epilogue<float > &ep);
+template void TensorCPUd::blas_gemm_strided (const bool transA, const bool transB, const int batch, const TensorCPUd &A, const TensorCPUd &B, double alpha, double beta, const Epilogue<double> &ep);
+#endif
+
+// 一组形状各异的矩阵乘，C[b] = alpha * op(A[b]) * op(B[b]) + beta * C[b]
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::blas_gemm_batched (const bool transA, const bool transB,
+  const vector<Tensor<XPU, DT>> &A, const vector<Tensor<XPU, DT>> &B, vector<Tensor<XPU, DT>> &C, DT alpha, DT beta)
+{ const int batch = C.size();
+  CHECK (A.size() == C.size() && B.size() == C.size());
+#ifdef __CUDACC__
+  for (int b = 0; b < batch; ++b)  // 同一个流上排队，不逐个同步
+    C[b].blas_gemm (transA, transB, A[b], B[b], alpha, beta);
+#else
+  gemm_batch (batch, [&] (const int b, const bool par)
+  { const int Ar = A[b].size() / A[b].cols(), Br = B[b].size() / B[b].cols();
+    const int M = transA ? A[b].cols() : Ar;
+    const int K = transA ? Ar : A[b].cols();
+    const int N = transB ? Br : B[b].cols();
+    CHECK_EQ (K, transB ? B[b].cols() : Br);
+    CHECK_EQ (M, C[b].size() / C[b].cols());
+    CHECK_EQ (N, C[b].cols());
+#ifdef USE_MKL
+    cblas_gemm (transA ? CblasTrans : CblasNoTrans, transB ? CblasTrans : CblasNoTrans,
+      M, N, K, alpha, A[b].dptr, A[b].cols(), B[b].dptr, B[b].cols(), beta, C[b].dptr, C[b].cols());
+#else
+    gemm (transA, transB, M, N, K, alpha, A[b].dptr, A[b].cols(), B[b].dptr, B[b].cols(), beta,
+      C[b].dptr, C[b].cols(), Epilogue<DT> (), par);
+#endif
+  });
+#endif
+}
+#ifdef __CUDACC__
+template void TensorGPUf::blas_gemm_batched (const bool transA, const bool transB, const vector<TensorGPUf> &A, const vector<TensorGPUf> &B, vector<TensorGPUf> &C, float  alpha, float  beta);
+template void TensorGPUd::blas_gemm_batched (const bool transA, const bool transB, const vector<TensorGPUd> &A, const vector<TensorGPUd> &B, vector<TensorGPUd> &C, double alpha, double beta);
+#else
+template void TensorCPUf::blas_gemm_batched (const bool transA, const bool transB, const vector<TensorCPUf> &A, const vector<TensorCPUf> &B, vector<TensorCPUf> &C, float  alpha, float  beta);
+template void TensorCPUd::blas_gemm_batched (const bool transA, const bool transB, const vector<TensorCPUd> &A, const vector<TensorCPUd> &B, vector<TensorCPUd> &C, double alpha, double beta);
+#endif
+
+
+
+// y = alpha * op(A) * x + beta * y
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::blas_gemv (const bool transA,
+  const Tensor<XPU, DT> &A, const Tensor<XPU, DT> &X, DT alpha, DT beta)
+{ const int Ar = A.size() / A.cols(), Ac = A.cols();
+  CHECK_EQ (X.size(), transA ? Ar : Ac);
+  CHECK_EQ (  size(), transA ? Ac : Ar);
+#ifdef __CUDACC__
+  gemm (transA, false, size(), 1, X.size(), alpha, A.dptr, Ac, X.dptr, 1, beta, dptr, 1, Epilogue<DT> (),
+    get_blas_handle(), get_calc_stream());
+#elif defined(USE_MKL)
+  cblas_gemm (transA ? CblasTrans : CblasNoTrans, CblasNoTrans, size(), 1, X.size(),
+    alpha, A.dptr, Ac, X.dptr, 1, beta, dptr, 1);
+#else
+  if (!transA)
+    ThreadPool::get().parallel_for (0, Ar, std::max (1, XPU_GRAIN / Ac), [&] (const int begin, const int end)
+    { for (int i = begin; i < end; ++i)
+      { const DT *aptr = A.dptr + i * Ac;
+        DT sum = 0;
+        for (int k = 0; k < Ac; ++k)
+          sum += aptr[k] * X.dptr[k];
+        dptr[i] = alpha * sum + (beta == (DT)0 ? (DT)0 : beta * dptr[i]);
+      }
+    });
+  else  // 按列分块，每块顺序扫过A的所有行
+    ThreadPool::get().parallel_for (0, Ac, 256, [&] (const int begin, const int end)
+    { for (int j = begin; j < end; ++j)
+        dptr[j] = beta == (DT)0 ? (DT)0 : beta * dptr[j];
+      for (int i = 0; i < Ar; ++i)
+      { const DT *aptr = A.dptr + i * Ac;
+        const DT xa = alpha * X.dptr[i];
+        for (int j = begin; j < end; ++j)
+          dptr[j] += xa * aptr[j];
+      }
+    });
+#endif
+  cuda_sync_check ("blas_gemv");
+}
+#ifdef __CUDACC__
+template void TensorGPUf::blas_gemv (const bool transA, const TensorGPUf &A, const TensorGPUf &X, float  alpha, float  beta);
+template void TensorGPUd::blas_gemv (const bool transA, const TensorGPUd &A, const TensorGPUd &X, double alpha, double beta);
+#else
+template void TensorCPUf::blas_gemv (const bool transA, const TensorCPUf &A, const TensorCPUf &X, float  alpha, float  beta);
+template void TensorCPUd::blas_gemv (const bool transA, const TensorCPUd &A, const TensorCPUd &X, double alpha, double beta);
+#endif
+
+#endif
@@ -7,45 +7,64 @@ using std::ios;
 
 #ifndef __CUDACC__
 Shape::Shape () :
-  rows(0), cols(0), chls(0), nums(0)
+  rows(0), cols(0), chls(0), nums(0), layout(kNCHW)
 { set_dims ();
 }
 Shape::Shape (const int a, const int b, const int c, const int d) :
-  rows(a), cols(b), chls(c), nums(d)
+  rows(a), cols(b), chls(c), nums(d), layout(kNCHW)
 { set_dims ();
 }
-Shape::Shape (const int a, const int b, const int c, const int d, const int e) :
-  rows(a), cols(b), chls(c), nums(d)
+Shape::Shape (const int a, const int b, const int c, const int d, const int64_t e) :
+  rows(a), cols(b), chls(c), nums(d), layout(kNCHW)
 { set_dims ();
   size = e;
 }
 bool Shape::operator == (const Shape &s) const
-{ return (rows == s.rows && cols == s.cols && chls == s.chls && nums == s.nums);
+{ return (rows == s.rows && cols == s.cols && chls == s.chls && nums == s.nums && layout == s.layout);
 }
 bool Shape::operator != (const Shape &s) const
 { return !(*this == s);
 }
 void Shape::set_dims ()
-{ size = rows * cols * chls * nums;
+{ size = (int64_t)rows * cols * get_chlsP () * nums;
   if      (nums > 1)  dims = 4;
   else if (chls > 1)  dims = 3;
   else if (cols > 1)  dims = 2;
   else                dims = 1;
 }
+void Shape::set_layout (const int l)
+{ CHECK (l >= kNCHW && l <= kNCHW16c);
+  layout = l;
+  set_dims ();
+}
+int Shape::get_block () const
+{ switch (layout) {
+  case kNCHW8c:  return 8;   break;
+  case kNCHW16c: return 16;  break;
+  default: return 1;
+  }
+}
+int Shape::get_chlsP () const
+{ const int b = get_block ();
+  return (chls + b - 1) / b * b;
+}
 void Shape::set_nums (const int n)
-{ CHECK_EQ ((chls * nums) % n, 0);
+{ CHECK_EQ (layout, kNCHW);
+  CHECK_EQ ((chls * nums) % n, 0);
   chls = chls * nums / n;
   nums = n;
   set_dims ();
 }
 void Shape::set_chls (const int c)
-{ CHECK_EQ ((rows * chls) % c, 0);
+{ CHECK_EQ (layout, kNCHW);
+  CHECK_EQ ((rows * chls) % c, 0);
   rows = rows * chls / c;
   chls = c;
   set_dims ();
 }
 void Shape::set_cols (const int c)
-{ CHECK_EQ ((rows * cols) % c, 0);
+{ CHECK_EQ (layout, kNCHW);
+  CHECK_EQ ((rows * cols) % c, 0);
   rows = rows * cols / c;
   cols = c;
   set_dims ();
@@ -59,26 +78,27 @@ int Shape::get_dimsX (const int d) const
   default: return 1;
   }
 }
-int Shape::get_sizeX (const int d) const
+int64_t Shape::get_sizeX (const int d) const
 { switch (d) {
   case 2: return 1;  break;
   case 1: return cols;  break;
-  case 3: return cols*rows;  break;
-  case 4: return cols*rows*chls;  break;
+  case 3: return (int64_t)cols*rows;  break;
+  case 4: return (int64_t)cols*rows*chls;  break;
   default: return size;
   }
 }
-int Shape::get_strdX (const int d) const
+int64_t Shape::get_strdX (const int d) const
 { switch (d) {
   case 2: return cols;  break;
-  case 1: return cols*rows;  break;
-  case 3: return cols*rows*chls;  break;
+  case 1: return (int64_t)cols*rows;  break;
+  case 3: return (int64_t)cols*rows*chls;  break;
   case 4: return size;  break;
   default: return size;
   }
 }
 void Shape::re_shape (const int a, const int b, const int c, const int d)
-{ CHECK_EQ (a * b * c * d, size);
+{ CHECK_EQ (layout, kNCHW);
+  CHECK_EQ ((int64_t)a * b * c * d, size);
   rows = a;
   cols = b;
   chls = c;
@@ -86,7 +106,8 @@ void Shape::re_shape (const int a, const int b, const int c, const int d)
   set_dims ();
 }
 void Shape::print ()
-{ char shapestr[64];  sprintf (shapestr, "\tshape\t%d\t%d\t%d\t%d\n", rows, cols, chls, nums);
+{ static const char *names[] = { "", "\tnhwc", "\tnchw8c", "\tnchw16c" };
+  char shapestr[64];  sprintf (shapestr, "\tshape\t%d\t%d\t%d\t%d%s\n", rows, cols, chls, nums, names[layout]);
   LOG (INFO) << shapestr;
 }
 #endif
@@ -122,27 +143,58 @@ template TensorGPUf:: Tensor();
 template TensorGPUd:: Tensor();
 template TensorGPUf::~Tensor();
 template TensorGPUd::~Tensor();
+template TensorGPUh:: Tensor();
+template TensorGPUh::~Tensor();
+template Tensor<GPU, uint32_t>:: Tensor();
+template Tensor<GPU, uint32_t>::~Tensor();
 #else
 template TensorCPUf:: Tensor();
 template TensorCPUd:: Tensor();
 template TensorCPUf::~Tensor();
 template TensorCPUd::~Tensor();
+template TensorCPUh:: Tensor();
+template TensorCPUh::~Tensor();
+template Tensor<CPU, int8_t>:: Tensor();
+template Tensor<CPU, int8_t>::~Tensor();
+template Tensor<CPU, uint32_t>:: Tensor();
+template Tensor<CPU, uint32_t>::~Tensor();
 #endif
 
 template <typename XPU, typename DT>
-void Tensor<XPU, DT>::create (const Shape &s, const int did)
-{ shape = s;
+void Tensor<XPU, DT>::create (const Shape &s, const int did, const int pol)
+{ if (cherry)
+    mem_free ();
+  shape = s;
   did_  = did;
-  mem_free ();
-  mem_alloc();
+  mem_alloc(pol);
   cherry = true;
 }
 #ifdef __CUDACC__
-template void TensorGPUf::create (const Shape &s, const int did);
-template void TensorGPUd::create (const Shape &s, const int did);
+template void TensorGPUf::create (const Shape &s, const int did, const int pol);
+template void TensorGPUd::create (const Shape &s, const int did, const int pol);
+template void TensorGPUh::create (const Shape &s, const int did, const int pol);
+template void Tensor<GPU, uint32_t>::create (const Shape &s, const int did, const int pol);
+#else
+template void TensorCPUf::create (const Shape &s, const int did, const int pol);
+template void TensorCPUd::create (const Shape &s, const int did, const int pol);
+template void TensorCPUh::create (const Shape &s, const int did, const int pol);
+template void Tensor<CPU, int8_t>::create (const Shape &s, const int did, const int pol);
+template void Tensor<CPU, uint32_t>::create (const Shape &s, const int did, const int pol);
+#endif
+
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::release ()
+{ if (cherry)
+    mem_free ();
+  dptr = NULL;
+  cherry = false;
+}
+#ifdef __CUDACC__
+template void TensorGPUf::release ();
+template void TensorGPUh::release ();
 #else
-template void TensorCPUf::create (const Shape &s, const int did);
-template void TensorCPUd::create (const Shape &s, const int did);
+template void TensorCPUf::release ();
+template void TensorCPUh::release ();
 #endif
 
 
@@ -151,7 +203,8 @@ template <typename XPU, typename DT>
 Tensor<XPU, DT> Tensor<XPU, DT>::section (const int begin, const int end) const
 { Tensor<XPU, DT> t;  // TODO
     int slices = end - begin;    CHECK (slices >= 1);
-    if      (shape.dims == 4)  { CHECK (slices <= nums());  t.shape = Shape (rows(), cols(), chls(), slices);  }
+    if      (shape.dims == 4)  { CHECK (slices <= nums());  t.shape = Shape (rows(), cols(), chls(), slices);  t.shape.set_layout (shape.layout);  }
+    else if (shape.layout != kNCHW)  LOG (FATAL) << "\tonly nums can be sectioned in a non-nchw layout";
     else if (shape.dims == 3)  { CHECK (slices <= chls());  t.shape = Shape (rows(), cols(), slices, nums());  }
     else                       { CHECK (slices <= rows());  t.shape = Shape (slices, cols(), chls(), nums());  }
 //  else                       { CHECK (shape.dims == 2 && begin == 0 && end == 1);  t.shape = shape;  }  // TODO
@@ -163,6 +216,8 @@ template TensorGPUf TensorGPUf::section (const int begin, const int end) const;
 template TensorGPUd TensorGPUd::section (const int begin, const int end) const;
 template TensorCPUf TensorCPUf::section (const int begin, const int end) const;
 template TensorCPUd TensorCPUd::section (const int begin, const int end) const;
+template TensorGPUh TensorGPUh::section (const int begin, const int end) const;
+template TensorCPUh TensorCPUh::section (const int begin, const int end) const;
 #endif
 
 template <typename XPU, typename DT>
@@ -180,30 +235,26 @@ template TensorGPUf& TensorGPUf::operator= (const TensorGPUf &t);
 template TensorGPUd& TensorGPUd::operator= (const TensorGPUd &t);
 template TensorCPUf& TensorCPUf::operator= (const TensorCPUf &t);
 template TensorCPUd& TensorCPUd::operator= (const TensorCPUd &t);
+template TensorGPUh& TensorGPUh::operator= (const TensorGPUh &t);
+template TensorCPUh& TensorCPUh::operator= (const TensorCPUh &t);
 #endif
 
 
 
 template <typename XPU, typename DT>
-void Tensor<XPU, DT>::mem_alloc ()
+void Tensor<XPU, DT>::mem_alloc (const int pol)
 { 
 #ifdef __CUDACC__
   LOG_IF (INFO, size_d() > 1e6) << "\tGPU  " << did_ << "  memory required for Tensor\t" << size_d() / 1e6 << " MB";
-  cuda_malloc ((void**)&dptr, size_d());
 #else
   LOG_IF (INFO, size_d() > 1e9) << "\tCPU memory required for Tensor\t" << size_d() / 1e6 << " MB";
-  dptr = (DT*) malloc (size_d());
 #endif
+  dptr = (DT*) MemPool<XPU>::get (did_).alloc (size_d(), pol);
 }
 
 template <typename XPU, typename DT>
 void Tensor<XPU, DT>::mem_free ()
-{ 
-#ifdef __CUDACC__
-  if (dptr)  cuda_check (cudaFree ((void*)dptr));
-#else
-  if (dptr)  free (dptr);
-#endif
+{ if (dptr)  MemPool<XPU>::get (did_).free ((void*)dptr);
   dptr = NULL;
 }
 
@@ -216,6 +267,7 @@ void Tensor<XPU, DT>::mem_set (const unsigned char a)
 }
 template void TensorGPUf::mem_set (const unsigned char a);
 template void TensorGPUd::mem_set (const unsigned char a);
+template void TensorGPUh::mem_set (const unsigned char a);
 #else
 template <typename XPU, typename DT>
 void Tensor<XPU, DT>::mem_set (const unsigned char a)
@@ -223,6 +275,8 @@ void Tensor<XPU, DT>::mem_set (const unsigned char a)
 }
 template void TensorCPUf::mem_set (const unsigned char a);
 template void TensorCPUd::mem_set (const unsigned char a);
+template void TensorCPUh::mem_set (const unsigned char a);
+template void Tensor<CPU, int8_t>::mem_set (const unsigned char a);
 #endif
 
 
@@ -257,6 +311,14 @@ template <>
 void TensorCPUd::memcpy_from_gpu (void *ptr)
 { cuda_memcpy ((void*)dptr, ptr, size_d(), GPU2CPU);
 }
+template <>
+void TensorGPUh::memcpy_from_gpu (void *ptr)
+{ cuda_memcpy ((void*)dptr, ptr, size_d(), GPU2GPU);
+}
+template <>
+void TensorGPUh::memcpy_from_cpu (void *ptr)
+{ cuda_memcpy ((void*)dptr, ptr, size_d(), CPU2GPU);
+}
 #else
 template <>
 void TensorCPUf::memcpy_from_cpu (void *ptr)
@@ -266,6 +328,10 @@ template <>
 void TensorCPUd::memcpy_from_cpu (void *ptr)
 {      memcpy ((void*)dptr, ptr, size_d());
 }
+template <>
+void TensorCPUh::memcpy_from_cpu (void *ptr)
+{      memcpy ((void*)dptr, ptr, size_d());
+}
 #endif
 
 #ifdef __CUDACC__
@@ -307,9 +373,12 @@ template void TensorCPUf::copy (const TensorGPUf &in);
 template void TensorCPUd::copy (const TensorGPUd &in);
 template void TensorGPUf::copy (const TensorCPUf &in);
 template void TensorGPUd::copy (const TensorCPUd &in);
+template void TensorGPUh::copy (const TensorGPUh &in);
+template void TensorGPUh::copy (const TensorCPUh &in);
 #else
 template void TensorCPUf::copy (const TensorCPUf &in);
 template void TensorCPUd::copy (const TensorCPUd &in);
+template void TensorCPUh::copy (const TensorCPUh &in);
 #endif
 
 
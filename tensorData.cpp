@@ -4,61 +4,47 @@
 #include "../include/tensor.h"
 
 #ifndef __CUDACC__
-TensorFormat::TensorFormat (const libconfig::Config &cfg) : isTrain(true)
+TensorFormat::TensorFormat (const libconfig::Config &cfg) : layout(kNCHW), isTrain(true), isHalf(false), isPrefetch(false)
 { rows	= cfg.lookup ("tformat.rows");
   cols	= cfg.lookup ("tformat.cols");
   chls	= cfg.lookup ("tformat.chls");
   nums	= cfg.lookup ("tformat.nums");
   numBatch = cfg.lookup ("tformat.numBatch");
   numClass = cfg.lookup ("tformat.numClass");
+  cfg.lookupValue ("tformat.half", isHalf);  // 可选，图像缓冲以bf16存放
+  cfg.lookupValue ("tformat.prefetch", isPrefetch);  // 可选，张量数据映射后预读
+  string lstr = "nchw";
+  cfg.lookupValue ("tformat.layout", lstr);  // 可选，nhwc时图像解码直接写进缓冲，第一层前自动重排
+  CHECK (lstr == "nchw" || lstr == "nhwc") << "	unknown tformat.layout	" << lstr;
+  layout = lstr == "nhwc" ? kNHWC : kNCHW;
 };
 #endif
 
 
 
-template <typename XPU, typename DT>
-void Tensor<XPU, DT>::get_mean (Tensor<XPU, DT> &mean) const
-{ mean.mem_set (0);
-  for (int i = 0; i < nums(); ++i)
-    mean.blas_axpy ((*this)[i], 1.);
-  mean.blas_scal (1./nums());
-}
-#ifdef __CUDACC__
-template void TensorGPUf::get_mean (TensorGPUf &mean) const;
-template void TensorGPUd::get_mean (TensorGPUd &mean) const;
-#else
-template void TensorCPUf::get_mean (TensorCPUf &mean) const;
-template void TensorCPUd::get_mean (TensorCPUd &mean) const;
-#endif
-
-template <typename XPU, typename DT>
-void Tensor<XPU, DT>::sub_mean (const Tensor<XPU, DT> &mean)
-{ for (int i = 0; i < nums(); ++i)
-    (*this)[i].blas_axpy (mean, -1);
-}
-#ifdef __CUDACC__
-template void TensorGPUf::sub_mean (const TensorGPUf &mean);
-template void TensorGPUd::sub_mean (const TensorGPUd &mean);
-#else
-template void TensorCPUf::sub_mean (const TensorCPUf &mean);
-template void TensorCPUd::sub_mean (const TensorCPUd &mean);
-#endif
-
-
-
 #ifdef __CUDACC__
 template <typename DT>
 void DataBuffer<DT>::page_lock ()
-{ cuda_check (cudaHostRegister ( data_.dptr,  data_.size_d(), cudaHostRegisterPortable));
+{ if (hdata_.dptr)
+    cuda_check (cudaHostRegister (hdata_.dptr, hdata_.size_d(), cudaHostRegisterPortable));
+  if (!mapped_)  // 映射的文件锁页会把整个文件读进来
+  { if (data_.dptr)
+      cuda_check (cudaHostRegister ( data_.dptr,  data_.size_d(), cudaHostRegisterPortable));
+    cuda_check (cudaHostRegister (label_.dptr, label_.size_d(), cudaHostRegisterPortable));
+  }
   cuda_check (cudaHostRegister ( pred_.dptr,  pred_.size_d(), cudaHostRegisterPortable));
-  cuda_check (cudaHostRegister (label_.dptr, label_.size_d(), cudaHostRegisterPortable));
 }
 template void DataBuffer<float>::page_lock ();
 template <typename DT>
 void DataBuffer<DT>::page_unlk ()
-{ cuda_check (cudaHostUnregister ( data_.dptr));
+{ if (hdata_.dptr)
+    cuda_check (cudaHostUnregister (hdata_.dptr));
+  if (!mapped_)
+  { if (data_.dptr)
+      cuda_check (cudaHostUnregister ( data_.dptr));
+    cuda_check (cudaHostUnregister (label_.dptr));
+  }
   cuda_check (cudaHostUnregister ( pred_.dptr));
-  cuda_check (cudaHostUnregister (label_.dptr));
 }
 template void DataBuffer<float>::page_unlk ();
 #else
@@ -67,6 +53,7 @@ void DataBuffer<DT>::reset_image_buf ()
 { if (image_.imgList.empty())
     return;
    data_.mem_set (0);
+  hdata_.mem_set (0);
    pred_.mem_set (0);
   label_.mem_set (0);
   inums_ = 0;
@@ -77,31 +64,80 @@ template <typename DT>
 void DataBuffer<DT>::create (const TensorFormat &tf, const int did)
 { Shape dshape (tf.rows, tf.cols, tf.chls, tf.nums*tf.numBatch);
   Shape lshape (      1, tf.numClass,   1, tf.nums*tf.numBatch);
+  dshape.set_layout (tf.layout);
   did_ = did;
-   data_.create (dshape, did_);
+  prefetch_ = tf.isPrefetch;
+  if (tf.isHalf)
+    hdata_.create (dshape, did_, kMemHugeTLB);
+  else
+     data_.create (dshape, did_, kMemHugeTLB);
    pred_.create (lshape, did_);
   label_.create (lshape, did_);
-  dnums_ = data_.nums();  // TODO
+  dnums_ = dshape.nums;  // TODO
 }
 template void DataBuffer<float>::create (const TensorFormat &tf, const int did);
 
 template <typename DT>
 void DataBuffer<DT>::read_tensor (const ParaFileData &pd)
-{  data_.load (pd. data, did_);
+{ if (hdata_.dptr)  // bf16缓冲：映射的float数据转换一遍就释放
+  { Tensor<CPU, DT> data;  data.load (pd.data, did_);
+    hdata_.create (data.shape, did_, kMemHugeTLB);
+    hdata_ = data;
+  } else
+     data_.load (pd. data, did_);
   label_.load (pd.label, did_);
+  if (prefetch_)
+  { if (data_.dptr)
+       data_.prefetch ();
+    label_.prefetch ();
+  }
    pred_.create (label_.shape, did_);
-  dnums_ = lnums_ = inums_ = data_.nums();  // TODO
+  dnums_ = lnums_ = inums_ = label_.nums();  // TODO
+  mapped_ = true;
 }
 template void DataBuffer<float>::read_tensor (const ParaFileData &pd);
 
 template <typename DT>
 void DataBuffer<DT>::read_stats  (const ParaFileData &pd)
-{   mean_.load (pd.  mean, 0);
+{ const int layout = hdata_.dptr ? hdata_.shape.layout : data_.shape.layout;
+  if (layout == kNCHW)
+    mean_.load (pd.mean, 0);
+  else  // 均值文件总按nchw存，转成缓冲的布局
+  { Tensor<CPU, DT> mean;  mean.load (pd.mean, 0);
+    Shape mshape = mean.shape;  mshape.set_layout (layout);
+    mean_.create (mshape);
+    mean_.relayout (mean);
+  }
 //eigvec_.load (pd.eigvec, 0);
 //eigval_.load (pd.eigval, 0);
 }
 template void DataBuffer<float>::read_stats  (const ParaFileData &pd);
 
+// 读[begin, end)这些图片，bf16缓冲先解码到float再整块转换
+template <>
+void DataBuffer<float>::read_image_slab (const TensorFormat &format, const int begin, const int end, const bool is_label)
+{ TensorCPUf slab;
+  if (hdata_.dptr)
+  { Shape sshape (hdata_.rows(), hdata_.cols(), hdata_.chls(), end-begin);
+    sshape.set_layout (hdata_.shape.layout);
+    slab.create (sshape);
+  }
+  TensorCPUf &dst = hdata_.dptr ? slab : data_;
+  const int base  = hdata_.dptr ? begin : 0;
+  ThreadPool::get().parallel_for (begin, end, 1, [&] (const int b, const int e)
+  { for (int t = b; t < e; ++t)
+    { const int idx = curr_no_ + t;
+      const string name = image_.image_path + image_.imgList[idx];
+      Philox rng (seed_, reads_ << 32 | idx);
+      dst.read_image_data (format, name, t-base, mean_, rng);
+      if (is_label)
+        label_.read_image_label (image_, name, t);
+    }
+  });
+  if (hdata_.dptr)
+    hdata_.section (begin, end) = slab;
+}
+
 template <>
 void DataBuffer<float>::read_image_thread (const TensorFormat &format)
 { if (image_.imgList.empty())
@@ -109,14 +145,9 @@ void DataBuffer<float>::read_image_thread (const TensorFormat &format)
   if (curr_no_ + dnums_ > lnums_)
     curr_no_ = 0;
   for (inums_ = 0; inums_ < dnums_; inums_ += 32)
-#pragma omp parallel for num_threads(4)
-    for (int t = inums_; t < inums_+32; ++t)
-    { const int idx = curr_no_ + t;
-      const string name = image_.image_path + image_.imgList[idx];
-       data_.read_image_data  (format, name, t, mean_);
-      label_.read_image_label (image_, name, t);
-    }
+    read_image_slab (format, inums_, inums_+32, true);
   curr_no_ += dnums_;
+  reads_++;
 }
 
 template <>
@@ -125,13 +156,11 @@ void DataBuffer<float>::read_image_openmp (const TensorFormat &format)
     return;
   if (curr_no_ + dnums_ > lnums_)
     curr_no_ = 0;
-#pragma omp parallel for
-  for (int i = 0; i < dnums_; ++i)
-  { const int idx = curr_no_ + i;
-    const string name = image_.image_path + image_.imgList[idx];
-     data_.read_image_data  (format, name, i, mean_);
-  }
+  const int step = hdata_.dptr ? 256 : dnums_;  // 限制float暂存的大小
+  for (int i = 0; i < dnums_; i += step)
+    read_image_slab (format, i, std::min (i+step, dnums_), false);
   curr_no_ += dnums_;
+  reads_++;
   LOG (INFO) << "\timage read\tnumImages = " << dnums_;
 }
 
@@ -144,19 +173,31 @@ template void DataBuffer<float>::read (const ParaFileData &pd);
 
 template <typename DT>
 void DataBuffer<DT>::get_mean (const ParaFileData &pd, const TensorFormat &tf)
-{ Tensor<CPU, DT> mean_b;  mean_b.create (data_[0].shape);
-  Tensor<CPU, DT> mean_g;  mean_g.create (data_[0].shape);  mean_g.mem_set (0);
+{ const Shape mshape = hdata_.dptr ? hdata_[0].shape : data_[0].shape;
+  Tensor<CPU, DT> mean_b;  mean_b.create (mshape);
+  Tensor<CPU, DT> mean_g;  mean_g.create (mshape);  mean_g.mem_set (0);
 
   const int bufs = lnums_ / dnums_;
   for (int b = 0; b < bufs; ++b)
   { if (pd.type == "image")
       read_image_openmp (tf);
-    data_. get_mean  (mean_b);
-    mean_g.blas_axpy (mean_b, 1.);
+    if (hdata_.dptr)  // 逐张展开成float再累加
+    { mean_b.mem_set (0);
+      for (int i = 0; i < dnums_; ++i)
+        mean_b += hdata_[i];
+      mean_b *= (DT)1 / dnums_;
+    } else
+      data_. get_mean  (mean_b);
+    mean_g += mean_b;
   }
 
-  mean_g.blas_scal (1./bufs);
-  mean_g.save (pd.mean);
+  mean_g *= (DT)1 / bufs;
+  if (mshape.layout != kNCHW)
+  { Tensor<CPU, DT> mean;  mean.create (Shape (mshape.rows, mshape.cols, mshape.chls, 1));
+    mean.relayout (mean_g);
+    mean.save (pd.mean);
+  } else
+    mean_g.save (pd.mean);
 //mean_g.print (112);
 }
 template void DataBuffer<float>::get_mean (const ParaFileData &pd, const TensorFormat &tf);
@@ -167,19 +208,23 @@ void DataBuffer<DT>::sampling (const ParaFileData &pd, const TensorFormat &tf, c
   const int bufs = lnums_ / nums;
   const int cols = 1024;
   const int dims = data_.shape.get_dimsX (keepdim);
-  const int strd = data_.shape.get_sizeX (keepdim);
-  const int rows = 2147483648 / dims / cols / bufs;
+  const int64_t strd = data_.shape.get_sizeX (keepdim);
+  const int64_t most = (int64_t)1 << 31;  // 采样矩阵的元素上限，与buffer大小无关
+  const int rows = most / dims / cols / bufs;
+  CHECK (!hdata_.dptr) << "\tsampling needs an fp32 image buffer";
+  CHECK_EQ (data_.shape.layout, kNCHW) << "\tsampling needs an nchw image buffer";
 
   Shape sshape (rows, dims, cols, bufs);  sample.create (sshape);
   for (int b = 0; b < bufs; ++b)
   { if (pd.type == "image")
       read_image_openmp (tf);
     DT *sptr = sample[b].dptr;
+    Philox rng (seed_, (uint64_t)1 << 62 | b);
     for (int i = 0; i < rows*cols; ++i)
-    { const int idx = rand() % nums;  // i / strd;
-      const int pos = rand() % strd;  // i % strd;
+    { const int idx = rng.next (nums);  // i / strd;
+      const int64_t pos = (int64_t)(((uint64_t)rng () << 32 | rng ()) % strd);  // i % strd;
       for (int j = 0; j < dims; ++j)
-        sptr[i*dims+j] = data_.dptr[(idx*dims+j)*strd+pos];
+        sptr[(int64_t)i*dims+j] = data_.dptr[((int64_t)idx*dims+j)*strd+pos];
     }
   }
   sample.shape.re_shape (rows*cols*bufs, dims, 1, 1);
@@ -221,8 +266,20 @@ template void DataBatch<CPU, float>::reset ();
 
 template <typename XPU, typename DT>
 void DataBatch<XPU, DT>::copy (const DataBuffer<DT> &in)
-{  data_.copy (in. data_.section (curr_no_, curr_no_+dnums_));
+{ if (in.hdata_.dptr)  // 16位上传，到设备再展开成float
+  {
+#ifdef __CUDACC__
+    hdata_.create (data_.shape, data_.did_);
+    hdata_.copy (in.hdata_.section (curr_no_, curr_no_+dnums_));
+    data_ = hdata_;
+#else
+    data_ = in.hdata_.section (curr_no_, curr_no_+dnums_);
+#endif
+  } else
+     data_.copy (in. data_.section (curr_no_, curr_no_+dnums_));
   label_.copy (in.label_.section (curr_no_, curr_no_+dnums_));
+  if (mean_.dptr)
+    data_.sub_mean (mean_);
 }
 #ifdef __CUDACC__
 template void DataBatch<GPU, float>::copy (const DataBuffer<float> &in);
@@ -243,7 +300,7 @@ template void DataBatch<CPU, float>::send (DataBuffer<float> &in) const;
 template <typename XPU, typename DT>
 void DataBatch<XPU, DT>::next (const DataBuffer<DT> &in)
 { curr_no_ += dnums_;
-  if (curr_no_ > in.data_.nums())
+  if (curr_no_ > in.dnums_)
     curr_no_ = 0;
 }
 #ifdef __CUDACC__
@@ -254,9 +311,9 @@ template void DataBatch<CPU, float>::next (const DataBuffer<float> &in);
 
 template <typename XPU, typename DT>
 void DataBatch<XPU, DT>::rand (const DataBuffer<DT> &in)
-{ curr_no_ = std::max (0, ::rand() % in.data_.nums() - dnums_);  // TODO
-   data_.copy (in. data_.section (curr_no_, curr_no_+dnums_));
-  label_.copy (in.label_.section (curr_no_, curr_no_+dnums_));
+{ Philox rng (in.seed_, (uint64_t)3 << 62 | draws_++);
+  curr_no_ = std::max (0, (int)rng.next (in.label_.nums()) - dnums_);  // TODO
+  copy (in);
 }
 #ifdef __CUDACC__
 template void DataBatch<GPU, float>::rand (const DataBuffer<float> &in);
@@ -264,4 +321,17 @@ template void DataBatch<GPU, float>::rand (const DataBuffer<float> &in);
 template void DataBatch<CPU, float>::rand (const DataBuffer<float> &in);
 #endif
 
+// 映射的张量数据不改，均值改在每个batch上减
+template <typename XPU, typename DT>
+void DataBatch<XPU, DT>::set_mean (const Tensor<CPU, DT> &mean, const int did)
+{ did_ = did;
+  mean_.create (mean.shape, did_);
+  mean_.copy (mean);
+}
+#ifdef __CUDACC__
+template void DataBatch<GPU, float>::set_mean (const TensorCPUf &mean, const int did);
+#else
+template void DataBatch<CPU, float>::set_mean (const TensorCPUf &mean, const int did);
+#endif
+
 #endif
@@ -0,0 +1,120 @@
+#ifndef TENSOR_FILE_
+#define TENSOR_FILE_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/tensor.h"
+
+#define TENSOR_MAGIC	"NBDLTNSR"
+#define TENSOR_VERSION	2  // 2起文件头记布局，1的文件按NCHW读
+#define TENSOR_ALIGN	4096
+
+// 数据从TENSOR_ALIGN开始，映射后可以直接当dptr用
+class TensorHeader {
+public:
+  char magic[8];
+  int version, dtype;
+  int align, dims;
+  int64_t rows, cols, chls, nums;
+  int64_t offset, bytes;
+  int layout, reserved;  // version 2
+};
+
+template <typename DT> int get_dtype ();
+template <> inline int get_dtype<float > () { return 1;  }
+template <> inline int get_dtype<double> () { return 2;  }
+
+
+
+#ifndef __CUDACC__
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::save (const string file)
+{ TensorHeader head;
+  memset (&head, 0, sizeof(head));
+  memcpy (head.magic, TENSOR_MAGIC, sizeof(head.magic));
+  head.version = TENSOR_VERSION;
+  head.dtype   = get_dtype<DT> ();
+  head.align   = TENSOR_ALIGN;
+  head.dims    = shape.dims;
+  head.layout  = shape.layout;
+  head.rows    = rows();
+  head.cols    = cols();
+  head.chls    = chls();
+  head.nums    = nums();
+  head.offset  = TENSOR_ALIGN;
+  head.bytes   = size_d();
+
+  ofstream fp (file.c_str(), std::ios::out | std::ios::binary);
+  CHECK (fp.is_open()) << "\tcannot open tensor file\t" << file;
+  vector<char> pad (head.offset - sizeof(head), 0);
+  fp.write ((char*)&head, sizeof(head));
+  fp.write (pad.data(), pad.size());
+  fp.write ((char*)dptr, head.bytes);
+  CHECK (fp.good()) << "\twrite tensor file failed\t" << file;
+  LOG (INFO) << "\ttensor saved\t" << file;
+}
+template void TensorCPUf::save (const string file);
+template void TensorCPUd::save (const string file);
+
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::load (const string file, const int did)
+{ const int fd = open (file.c_str(), O_RDONLY);
+  CHECK (fd >= 0) << "\tcannot open tensor file\t" << file;
+  TensorHeader head;
+  struct stat fs;
+  const int     rc  = fstat (fd, &fs);
+  const ssize_t got = pread (fd, &head, sizeof(head), 0);
+  CHECK_EQ (rc, 0) << "\tcannot stat tensor file\t" << file;
+  CHECK (got == sizeof(head) && !memcmp (head.magic, TENSOR_MAGIC, sizeof(head.magic))) << "\tnot a tensor file\t" << file;
+  CHECK_LE (head.version, TENSOR_VERSION) << "\tunsupported tensor file version\t" << file;
+  CHECK_EQ (head.dtype, get_dtype<DT> ()) << "\ttensor file data type mismatch\t" << file;
+  CHECK_EQ (head.offset + head.bytes, (int64_t)fs.st_size) << "\ttensor file truncated\t" << file;
+
+  if (head.version < 2)
+    head.layout = kNCHW;
+
+  if (cherry)
+    mem_free ();
+  shape = Shape (head.rows, head.cols, head.chls, head.nums);
+  shape.set_layout (head.layout);
+  did_  = did;
+  CHECK_EQ (shape.dims, head.dims) << "\ttensor file dims mismatch\t" << file;
+  CHECK_EQ ((int64_t)size_d(), head.bytes) << "\ttensor file size mismatch\t" << file;
+  dptr  = (DT*) MemPool<XPU>::get (did_).map (fd, fs.st_size, head.offset);
+  cherry = true;
+  close (fd);
+  LOG (INFO) << "\ttensor mapped\t" << file << "\t" << size_d() / 1e6 << " MB";
+}
+template void TensorCPUf::load (const string file, const int did);
+template void TensorCPUd::load (const string file, const int did);
+
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::prefetch () const
+{ const size_t page = TENSOR_ALIGN;
+  const size_t addr = (size_t)dptr / page * page;
+  madvise ((void*)addr, (size_t)dptr + size_d() - addr, MADV_WILLNEED);
+}
+template void TensorCPUf::prefetch () const;
+template void TensorCPUd::prefetch () const;
+#else
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::save (const string file)
+{ Tensor<CPU, DT> host;  host.create (shape, did_);
+  host.copy (*this);
+  host.save (file);
+}
+template void TensorGPUf::save (const string file);
+template void TensorGPUd::save (const string file);
+
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::load (const string file, const int did)
+{ Tensor<CPU, DT> host;  host.load (file, did);
+  create (host.shape, did);
+  copy (host);
+}
+template void TensorGPUf::load (const string file, const int did);
+template void TensorGPUd::load (const string file, const int did);
+#endif
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef TENSOR_LAYOUT_
+#define TENSOR_LAYOUT_
+
+#include "../include/tensor.h"
+#include "../include/simd.h"
+
+// 逻辑坐标(n, c, h, w)在某个布局下的偏移
+class LayoutIndex {
+public:
+  explicit LayoutIndex (const Shape &s) :
+    layout(s.layout), rows(s.rows), cols(s.cols), chls(s.chls), blk(s.get_block ()), cblk(s.get_chlsP () / s.get_block ()) { }
+  XPU_CALLABLE_INLINE int64_t offset (const int64_t n, const int c, const int h, const int w) const
+  { switch (layout)
+    { case kNCHW:  return ((n * chls + c) * rows + h) * cols + w;
+      case kNHWC:  return ((n * rows + h) * cols + w) * chls + c;
+      default:     return (((n * cblk + c / blk) * rows + h) * cols + w) * blk + c % blk;
+    }
+  }
+  int layout, rows, cols, chls, blk, cblk;
+};
+
+template <typename DT, typename IT>
+XPU_KERNEL(kernel_relayout) (const IT num_kernels, const DT *a, const LayoutIndex la, DT *y, const LayoutIndex ly)
+{ kernel_for (i, num_kernels)
+  { IT j = i;
+    const int w = j % la.cols;  j /= la.cols;
+    const int h = j % la.rows;  j /= la.rows;
+    const int c = j % la.chls;  j /= la.chls;
+    y[ly.offset (j, c, h, w)] = a[la.offset (j, c, h, w)];
+  }
+}
+
+
+
+#ifndef __CUDACC__
+#define LAYOUT_TILE	8
+
+// dst[j*ldd + i] = src[i*lds + j]，按8x8的块走，读写两边都落在同几条缓存行上
+template <typename DT>
+static void transpose_tile (const int R, const int C, const DT *src, const int lds, DT *dst, const int ldd)
+{ for (int i = 0; i < R; ++i)
+    for (int j = 0; j < C; ++j)
+      dst[j*ldd + i] = src[i*lds + j];
+}
+
+#ifdef SIMD_X86
+__attribute__((target("avx2")))
+static void transpose_tile_avx2 (const float *src, const int lds, float *dst, const int ldd)
+{ __m256 r0 = _mm256_loadu_ps (src        ), r1 = _mm256_loadu_ps (src +   lds);
+  __m256 r2 = _mm256_loadu_ps (src + 2*lds), r3 = _mm256_loadu_ps (src + 3*lds);
+  __m256 r4 = _mm256_loadu_ps (src + 4*lds), r5 = _mm256_loadu_ps (src + 5*lds);
+  __m256 r6 = _mm256_loadu_ps (src + 6*lds), r7 = _mm256_loadu_ps (src + 7*lds);
+  __m256 t0 = _mm256_unpacklo_ps (r0, r1), t1 = _mm256_unpackhi_ps (r0, r1);
+  __m256 t2 = _mm256_unpacklo_ps (r2, r3), t3 = _mm256_unpackhi_ps (r2, r3);
+  __m256 t4 = _mm256_unpacklo_ps (r4, r5), t5 = _mm256_unpackhi_ps (r4, r5);
+  __m256 t6 = _mm256_unpacklo_ps (r6, r7), t7 = _mm256_unpackhi_ps (r6, r7);
+  r0 = _mm256_shuffle_ps (t0, t2, _MM_SHUFFLE (1,0,1,0));  r1 = _mm256_shuffle_ps (t0, t2, _MM_SHUFFLE (3,2,3,2));
+  r2 = _mm256_shuffle_ps (t1, t3, _MM_SHUFFLE (1,0,1,0));  r3 = _mm256_shuffle_ps (t1, t3, _MM_SHUFFLE (3,2,3,2));
+  r4 = _mm256_shuffle_ps (t4, t6, _MM_SHUFFLE (1,0,1,0));  r5 = _mm256_shuffle_ps (t4, t6, _MM_SHUFFLE (3,2,3,2));
+  r6 = _mm256_shuffle_ps (t5, t7, _MM_SHUFFLE (1,0,1,0));  r7 = _mm256_shuffle_ps (t5, t7, _MM_SHUFFLE (3,2,3,2));
+  _mm256_storeu_ps (dst        , _mm256_permute2f128_ps (r0, r4, 0x20));
+  _mm256_storeu_ps (dst +   ldd, _mm256_permute2f128_ps (r1, r5, 0x20));
+  _mm256_storeu_ps (dst + 2*ldd, _mm256_permute2f128_ps (r2, r6, 0x20));
+  _mm256_storeu_ps (dst + 3*ldd, _mm256_permute2f128_ps (r3, r7, 0x20));
+  _mm256_storeu_ps (dst + 4*ldd, _mm256_permute2f128_ps (r0, r4, 0x31));
+  _mm256_storeu_ps (dst + 5*ldd, _mm256_permute2f128_ps (r1, r5, 0x31));
+  _mm256_storeu_ps (dst + 6*ldd, _mm256_permute2f128_ps (r2, r6, 0x31));
+  _mm256_storeu_ps (dst + 7*ldd, _mm256_permute2f128_ps (r3, r7, 0x31));
+}
+#endif
+
+template <typename DT>
+static void transpose_plane (const int R, const int C, const DT *src, const int lds, DT *dst, const int ldd)
+{ for (int i = 0; i < R; i += LAYOUT_TILE)
+    for (int j = 0; j < C; j += LAYOUT_TILE)
+      transpose_tile (std::min (LAYOUT_TILE, R-i), std::min (LAYOUT_TILE, C-j), src + i*lds + j, lds, dst + j*ldd + i, ldd);
+}
+
+static void transpose_plane (const int R, const int C, const float *src, const int lds, float *dst, const int ldd)
+{
+#ifdef SIMD_X86
+  const bool avx2 = simd_level () >= kSimdAVX2;
+#else
+  const bool avx2 = false;
+#endif
+  for (int i = 0; i < R; i += LAYOUT_TILE)
+    for (int j = 0; j < C; j += LAYOUT_TILE)
+    { const int rn = std::min (LAYOUT_TILE, R-i), cn = std::min (LAYOUT_TILE, C-j);
+#ifdef SIMD_X86
+      if (avx2 && rn == LAYOUT_TILE && cn == LAYOUT_TILE)
+        transpose_tile_avx2 (src + i*lds + j, lds, dst + j*ldd + i, ldd);
+      else
+#endif
+        transpose_tile (rn, cn, src + i*lds + j, lds, dst + j*ldd + i, ldd);
+    }
+}
+
+// 每张图或每个通道块是一个任务，nchw与其它布局之间都是一个平面转置，nhwc与分块之间是成段拷贝
+// 两种分块布局之间返回false，交给通用kernel
+template <typename DT>
+static bool relayout_cpu (const Tensor<CPU, DT> &in, Tensor<CPU, DT> &out)
+{ const Shape &si = in.shape, &so = out.shape;
+  const int N = si.nums, C = si.chls, HW = si.rows * si.cols;
+  const int B  = std::max (si.get_block (), so.get_block ());
+  const int CB = (C + B - 1) / B;
+  const DT *a = in.dptr;  DT *y = out.dptr;
+  const int li = si.layout, lo = so.layout;
+  if (si.get_block () > 1 && so.get_block () > 1)
+    return false;
+
+  ThreadPool &pool = ThreadPool::get ();
+  if (li == kNCHW && lo == kNHWC)
+    pool.parallel_for (0, N, std::max (1, XPU_GRAIN / (C*HW)), [&] (const int begin, const int end)
+    { for (int n = begin; n < end; ++n)
+        transpose_plane (C, HW, a + (int64_t)n*C*HW, HW, y + (int64_t)n*C*HW, C);
+    });
+  else if (li == kNHWC && lo == kNCHW)
+    pool.parallel_for (0, N, std::max (1, XPU_GRAIN / (C*HW)), [&] (const int begin, const int end)
+    { for (int n = begin; n < end; ++n)
+        transpose_plane (HW, C, a + (int64_t)n*C*HW, C, y + (int64_t)n*C*HW, HW);
+    });
+  else
+    pool.parallel_for (0, N * CB, std::max (1, XPU_GRAIN / (B*HW)), [&] (const int begin, const int end)
+    { for (int t = begin; t < end; ++t)
+      { const int n = t / CB, cb = t % CB, c0 = cb * B, cn = std::min (B, C - c0);
+        const int64_t ob = ((int64_t)n * CB + cb) * HW * B;  // 分块布局里这个块的起点
+        if      (li == kNCHW)
+          transpose_plane (cn, HW, a + ((int64_t)n*C + c0) * HW, HW, y + ob, B);
+        else if (lo == kNCHW)
+          transpose_plane (HW, cn, a + ob, B, y + ((int64_t)n*C + c0) * HW, HW);
+        else if (li == kNHWC)
+          for (int p = 0; p < HW; ++p)
+            memcpy (y + ob + p*B, a + ((int64_t)n*HW + p) * C + c0, cn * sizeof(DT));
+        else
+          for (int p = 0; p < HW; ++p)
+            memcpy (y + ((int64_t)n*HW + p) * C + c0, a + ob + p*B, cn * sizeof(DT));
+      }
+    });
+  return true;
+}
+#endif
+
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::relayout (const Tensor<XPU, DT> &in)
+{ CHECK (rows() == in.rows() && cols() == in.cols() && chls() == in.chls() && nums() == in.nums())
+    << "\trelayout keeps the logical dims";
+  if (shape.layout == in.shape.layout)
+  { copy (in);
+    return;
+  }
+  if (shape.get_chlsP () != chls ())
+    mem_set (0);  // 补齐的通道置零
+#ifndef __CUDACC__
+  if (relayout_cpu (in, *this))
+    return;
+#endif
+  const int64_t N = (int64_t)rows() * cols() * chls() * nums();
+  if (N <= INT_MAX)
+    XPU_KERNEL_LAUNCH (kernel_relayout, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream(),
+      (int)N, in.dptr, LayoutIndex (in.shape), dptr, LayoutIndex (shape));
+  else
+    XPU_KERNEL_LAUNCH (kernel_relayout, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream(),
+      N, in.dptr, LayoutIndex (in.shape), dptr, LayoutIndex (shape));
+  cuda_sync_check ("kernel_relayout");
+}
+#ifdef __CUDACC__
+template void TensorGPUf::relayout (const TensorGPUf &in);
+template void TensorGPUd::relayout (const TensorGPUd &in);
+template void TensorGPUh::relayout (const TensorGPUh &in);
+#else
+template void TensorCPUf::relayout (const TensorCPUf &in);
+template void TensorCPUd::relayout (const TensorCPUd &in);
+template void TensorCPUh::relayout (const TensorCPUh &in);
+#endif
+
+#endif
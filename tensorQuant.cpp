@@ -0,0 +1,157 @@
+#ifndef TENSOR_QUANT_
+#define TENSOR_QUANT_
+
+#include "../include/tensor.h"
+#include "../include/simd.h"
+
+#ifndef __CUDACC__
+#define QUANT_ALIGN	64  // k方向补齐到一条512位向量
+
+// x每个样本是chls个长为plane的通道，累计每个通道的绝对值最大
+void QTensor::calib (const Tensor<CPU, float> &x, const int chls, const int plane)
+{ const int nums = x.nums();
+  CHECK_EQ (x.size(), nums * chls * plane);
+  if (cmax_.empty ())
+    cmax_.resize (chls, 0.f);
+  CHECK_EQ ((int)cmax_.size(), chls);
+  ThreadPool::get().parallel_for (0, chls, std::max (1, XPU_GRAIN / (plane * nums)), [&] (const int begin, const int end)
+  { for (int c = begin; c < end; ++c)
+    { float amax = cmax_[c];
+      for (int n = 0; n < nums; ++n)
+      { const float *xptr = x.dptr + (n * chls + c) * plane;
+        for (int p = 0; p < plane; ++p)
+          amax = std::max (amax, fabsf (xptr[p]));
+      }
+      cmax_[c] = amax;
+    }
+  });
+}
+
+// w为rows x cols，相邻group个k属于同一个输入通道
+// 按sqrt(激活上界/权重上界)把激活的通道差异挪一部分到权重上，再各自量化
+void QTensor::quantize (const Tensor<CPU, float> &w, const int rows, const int group)
+{ const int chls = cmax_.size();
+  CHECK (chls > 0) << "\tcalibrate before quantizing";
+  this->rows = rows;
+  cols = w.size() / rows;
+  kpad = (cols + QUANT_ALIGN - 1) / QUANT_ALIGN * QUANT_ALIGN;
+  CHECK_EQ (cols, chls * group);
+
+  vector<float> smth (chls, 1.f);
+  float amax = 0.f;
+  for (int c = 0; c < chls; ++c)
+  { float wmax = 0.f;
+    for (int m = 0; m < rows; ++m)
+      for (int k = c*group; k < (c+1)*group; ++k)
+        wmax = std::max (wmax, fabsf (w.dptr[m*cols+k]));
+    if (cmax_[c] > 0.f && wmax > 0.f)
+      smth[c] = sqrtf (cmax_[c] / wmax);
+    amax = std::max (amax, cmax_[c] / smth[c]);
+  }
+  scale = amax > 0.f ? amax / 127.f : 1.f;
+
+  wmat_.create (Shape (rows, kpad, 1, 1));  wmat_.mem_set (0);
+  scal_.create (Shape (rows,    1, 1, 1));
+  smth_.create (Shape (kpad,    1, 1, 1));  smth_.mem_set (0);
+  csum_.assign (rows, 0);
+  for (int k = 0; k < cols; ++k)
+    smth_.dptr[k] = 1.f / (smth[k/group] * scale);
+
+  ThreadPool::get().parallel_for (0, rows, 1, [&] (const int begin, const int end)
+  { for (int m = begin; m < end; ++m)
+    { const float *wptr = w.dptr + m * cols;
+      float wmax = 0.f;
+      for (int k = 0; k < cols; ++k)
+        wmax = std::max (wmax, fabsf (wptr[k] * smth[k/group]));
+      const float wscal = wmax > 0.f ? wmax / 127.f : 1.f;
+      int8_t *qptr = wmat_.dptr + m * kpad;
+      int sum = 0;
+      for (int k = 0; k < cols; ++k)
+      { qptr[k] = (int8_t) lrintf (wptr[k] * smth[k/group] / wscal);
+        sum += qptr[k];
+      }
+      csum_[m] = 128 * sum;
+      scal_.dptr[m] = wscal * scale;
+    }
+  });
+  cmax_.clear ();
+  LOG (INFO) << "\tint8 weights packed\trows = " << rows << "\tcols = " << cols << "\tact scale = " << scale;
+}
+
+// x[n*ldn + k*ldk]量化成加128的uint8，每个样本占kpad个字节，补齐部分为零点
+void QTensor::quantize_act (const float *x, const int nums, const int ldn, const int ldk, int8_t *q) const
+{ ThreadPool::get().parallel_for (0, nums, std::max (1, XPU_GRAIN / kpad), [&] (const int begin, const int end)
+  { for (int n = begin; n < end; ++n)
+    { uint8_t *qptr = (uint8_t*)q + n * kpad;
+      const float *xptr = x + n * ldn;
+      for (int k = 0; k < cols; ++k)
+      { const int v = lrintf (xptr[k*ldk] * smth_.dptr[k]);
+        qptr[k] = (uint8_t)(std::min (127, std::max (-127, v)) + 128);
+      }
+      for (int k = cols; k < kpad; ++k)
+        qptr[k] = 128;
+    }
+  });
+}
+
+
+
+// 一个tile是4个输出通道乘一个样本，返回未扣零点的int32点积
+static void qgemm_tile_generic (const int kpad, const uint8_t *a, const int8_t *w, const int mnum, int *acc)
+{ for (int j = 0; j < mnum; ++j)
+  { const int8_t *wptr = w + j * kpad;
+    int sum = 0;
+    for (int k = 0; k < kpad; ++k)
+      sum += (int)a[k] * (int)wptr[k];
+    acc[j] = sum;
+  }
+}
+
+#ifdef SIMD_X86
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static void qgemm_tile_vnni (const int kpad, const uint8_t *a, const int8_t *w, const int mnum, int *acc)
+{ __m512i s0 = _mm512_setzero_si512 (), s1 = s0, s2 = s0, s3 = s0;
+  const int8_t *w0 = w, *w1 = w + kpad * std::min (1, mnum-1), *w2 = w + kpad * std::min (2, mnum-1), *w3 = w + kpad * std::min (3, mnum-1);
+  for (int k = 0; k < kpad; k += QUANT_ALIGN)
+  { const __m512i va = _mm512_loadu_si512 (a + k);
+    s0 = _mm512_dpbusd_epi32 (s0, va, _mm512_loadu_si512 (w0 + k));
+    s1 = _mm512_dpbusd_epi32 (s1, va, _mm512_loadu_si512 (w1 + k));
+    s2 = _mm512_dpbusd_epi32 (s2, va, _mm512_loadu_si512 (w2 + k));
+    s3 = _mm512_dpbusd_epi32 (s3, va, _mm512_loadu_si512 (w3 + k));
+  }
+  const int sum[4] = { _mm512_reduce_add_epi32 (s0), _mm512_reduce_add_epi32 (s1),
+                       _mm512_reduce_add_epi32 (s2), _mm512_reduce_add_epi32 (s3) };
+  for (int j = 0; j < mnum; ++j)
+    acc[j] = sum[j];
+}
+#endif
+
+// y[m*ldm + n*ldn] = (w[m] . q[n] - 零点) * scal[m] + bias[m]，反量化和偏置在写回时一起做
+void QTensor::gemm (const int nums, const int8_t *q, const float *bias, float *y, const int ldm, const int ldn) const
+{ CHECK (is_packed ());
+  const int mblk  = (rows + 3) / 4;
+  const bool vnni = simd_level () >= kSimdVNNI;
+  ThreadPool::get().parallel_for (0, mblk * nums, std::max (1, XPU_GRAIN * 4 / kpad), [&] (const int begin, const int end)
+  { int acc[4];
+    for (int t = begin; t < end; ++t)
+    { const int n  = t / mblk;
+      const int m0 = t % mblk * 4;
+      const int mnum = std::min (4, rows - m0);
+      const uint8_t *aptr = (const uint8_t*)q + n * kpad;
+      const int8_t  *wptr = wmat_.dptr + m0 * kpad;
+#ifdef SIMD_X86
+      if (vnni)
+        qgemm_tile_vnni    (kpad, aptr, wptr, mnum, acc);
+      else
+#endif
+        qgemm_tile_generic (kpad, aptr, wptr, mnum, acc);
+      for (int j = 0; j < mnum; ++j)
+      { const int m = m0 + j;
+        y[m*ldm + n*ldn] = (acc[j] - csum_[m]) * scal_.dptr[m] + (bias ? bias[m] : 0.f);
+      }
+    }
+  });
+}
+#endif
+
+#endif
@@ -3,56 +3,66 @@
 
 #include "../include/tensor.h"
 
-#ifndef __CUDACC__
-void rand_check (const int status)
-{ CHECK_EQ (status, VSL_STATUS_OK);
-}
-#endif
-
+template <typename XPU>
+Random<XPU>::Random (const int did) : did_(did), seed_(1), offset_(0) { }
+template <typename XPU>
+Random<XPU>::~Random () { }
 #ifdef __CUDACC__
-template <>
-Random<GPU>::Random (const int did) : did_(did) { }
+template Random<GPU>::Random (const int did);
+template Random<GPU>::~Random ();
 #else
-template <>
-Random<CPU>::Random (const int did) : did_(did)
-{ rand_check (vslNewStream (&vStream_, VSL_BRNG_MT19937, 1));
-}
-#endif
-
-#ifdef __CUDACC__
-template <>
-Random<GPU>::~Random () { }
-#else
-template <>
-Random<CPU>::~Random ()
-{ rand_check (vslDeleteStream (&vStream_));
-}
+template Random<CPU>::Random (const int did);
+template Random<CPU>::~Random ();
 #endif
 
 #ifdef __CUDACC__
 template <>
 void Random<GPU>::set_seed (int seed)
-{ cuda_check (curandSetPseudoRandomGeneratorSeed (dnnctx[did_]->curand_, seed));
+{ seed_ = seed;
+  cuda_check (curandSetPseudoRandomGeneratorSeed (dnnctx[did_]->curand_, seed));
 }
 #else
 template <>
 void Random<CPU>::set_seed (int seed)
-{ rand_check (vslDeleteStream (&vStream_));
-  rand_check (vslNewStream (&vStream_, VSL_BRNG_MT19937, seed));
+{ seed_   = seed;
+  offset_ = 0;
+}
+
+// 第g组的4个数只由(seed, offset+g)决定，按组切给线程池
+template <typename Fill>
+static void philox_fill (const uint64_t seed, uint64_t &offset, float *data, const int64_t size, const Fill &fill)
+{ const uint64_t base = offset;
+  const int64_t groups = (size + 3) / 4;
+  ThreadPool::get().parallel_for ((int64_t)0, groups, (int64_t)XPU_GRAIN / 4, [&] (const int64_t begin, const int64_t end)
+  { const uint32_t key[2] = { (uint32_t)seed, (uint32_t)(seed >> 32) };
+    uint32_t ctr[4] = { 0, 0, 0, 0 }, out[4];
+    float val[4];
+    for (int64_t g = begin; g < end; ++g)
+    { const uint64_t c = base + g;
+      ctr[0] = (uint32_t)c;  ctr[1] = (uint32_t)(c >> 32);
+      Philox::block (key, ctr, out);
+      fill (out, val);
+      const int n = (int)std::min ((int64_t)4, size - g * 4);
+      for (int j = 0; j < n; ++j)
+        data[g*4+j] = val[j];
+    }
+  });
+  offset += groups;
 }
 #endif
 
 
 
+template <typename IT>
 XPU_KERNEL(tensor_scale) (
-  const int num_kernels, float *data, const float a,  const float b)
+  const IT num_kernels, float *data, const float a,  const float b)
 { kernel_for (index, num_kernels)
     data[index] = data[index] * (b - a) + a;
 }
 
-template <typename DT>
+template <typename DT, typename IT>
 XPU_KERNEL(tensor_constant) (
-  const int num_kernels, DT *data, const DT a)
+  const IT num_kernels, DT *data, const DT a)
 { kernel_for (index, num_kernels)
     data[index] = a;
 }
@@ -61,22 +71,29 @@ XPU_KERNEL(tensor_constant) (
 
 #ifdef __CUDACC__
 template <>
-void Random<GPU>::gaussian (float *data, int size, const float mu, const float sigma) const
+void Random<GPU>::gaussian (float *data, int64_t size, const float mu, const float sigma) const
 { CHECK (sigma > 0.f);
   cuda_check (curandGenerateNormal (dnnctx[did_]->curand_, data, size, mu, sigma));
 }
 #else
 template <>
-void Random<CPU>::gaussian (float *data, int size, const float mu, const float sigma) const
+void Random<CPU>::gaussian (float *data, int64_t size, const float mu, const float sigma) const
 { CHECK (sigma > 0.f);
-  rand_check (vsRngGaussian (0, vStream_, size, data, mu, sigma)); // TODO
+  philox_fill (seed_, offset_, data, size, [&] (const uint32_t *x, float *y)
+  { for (int j = 0; j < 4; j += 2)  // Box-Muller，一对均匀数出一对正态数
+    { const float r = sqrtf (-2.f * logf (Philox::to_uniform (x[j])));
+      const float t = 6.2831853f * Philox::to_uniform (x[j+1]);
+      y[j]   = mu + sigma * r * cosf (t);
+      y[j+1] = mu + sigma * r * sinf (t);
+    }
+  });
 }
 #endif
 
 #ifdef __CUDACC__
 template <>
-void Random<GPU>::uniform  (float *data, int size, const float  a, const float b) const
-{ const int N = size;
+void Random<GPU>::uniform  (float *data, int64_t size, const float  a, const float b) const
+{ const int64_t N = size;
   cuda_check (curandGenerateUniform (dnnctx[did_]->curand_, data, N));
   if (a != 0.f || b != 1.f)
   XPU_KERNEL_LAUNCH (tensor_scale, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, dnnctx[did_]->stream_,
@@ -84,9 +101,11 @@ void Random<GPU>::uniform  (float *data, int size, const float  a, const float b
 }
 #else
 template <>
-void Random<CPU>::uniform  (float *data, int size, const float  a, const float b) const
-{ const int N = size;
-  rand_check (vsRngUniform (0, vStream_, N, data, a, b)); // TODO
+void Random<CPU>::uniform  (float *data, int64_t size, const float  a, const float b) const
+{ philox_fill (seed_, offset_, data, size, [&] (const uint32_t *x, float *y)
+  { for (int j = 0; j < 4; ++j)
+      y[j] = a + (b - a) * Philox::to_uniform (x[j]);
+  });
 }
 #endif
 
@@ -107,7 +126,7 @@ template void TensorCPUf::init (const Random<CPU> &random, const int method, con
 
 template <typename XPU, typename DT>
 void Tensor<XPU, DT>::init (const DT a)
-{ const int N = size();
+{ const int64_t N = size();
   XPU_KERNEL_LAUNCH (tensor_constant, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, dnnctx[did_]->stream_,
     N, dptr, a);
 }
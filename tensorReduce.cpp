@@ -0,0 +1,280 @@
+#ifndef TENSOR_REDUCE_
+#define TENSOR_REDUCE_
+
+#include "../include/tensor.h"
+
+// 张量看成[A][D][B]，保留D这一维，对A、B归约或广播
+// keepdim与Shape::get_dimsX一致：D = get_dimsX(keepdim)，B = get_sizeX(keepdim)
+class ReduceDims {
+public:
+  explicit ReduceDims (const Shape &s, const int keepdim) :
+    D(s.get_dimsX (keepdim)), B(s.get_sizeX (keepdim)), A(s.size / (s.get_dimsX (keepdim) * s.get_sizeX (keepdim)))
+  { CHECK_EQ (s.layout, kNCHW) << "\trelayout to nchw before reducing";  }
+  explicit ReduceDims (const int64_t a, const int d, const int64_t b) : D(d), B(b), A(a) { }
+  int D;
+  int64_t B, A;  // 归约掉的两段可以超过2^31
+};
+
+template <typename DT>
+XPU_KERNEL(kernel_reduce) (const int num_kernels, const DT *x, const int64_t A, const int D, const int64_t B,
+  DT *mean, DT *var)
+{ kernel_for (d, num_kernels)
+  { DT m = 0, m2 = 0;  int64_t n = 0;
+    for (int64_t a = 0; a < A; ++a)
+      for (int64_t b = 0; b < B; ++b)
+      { const DT v = x[((int64_t)a*D+d)*B+b];
+        const DT delta = v - m;
+        m  += delta / ++n;
+        m2 += delta * (v - m);
+      }
+    mean[d] = m;
+    if (var)  var[d] = m2 / n;
+  }
+}
+
+template <class Oper, typename DT, typename IT>
+XPU_KERNEL(kernel_bdcast) (const IT num_kernels, DT *y, const DT *bin, const int D, const IT B)
+{ Oper op;
+  kernel_for (i, num_kernels)
+    y[i] = op (y[i], bin[(i / B) % D]);
+}
+
+#ifndef __CUDACC__
+// (na, ma, m2a)并上(nb, mb, m2b)，Chan的合并公式
+template <typename DT>
+inline void welford_merge (double &na, DT &ma, DT &m2a, const double nb, const DT mb, const DT m2b)
+{ if (nb == 0)
+    return;
+  const double n = na + nb;
+  const DT delta = mb - ma;
+  ma  += delta * (DT)(nb / n);
+  m2a += m2b + delta * delta * (DT)(na * nb / n);
+  na   = n;
+}
+
+// 一遍扫描求均值和方差，var为NULL时只求均值
+// B==1时d连续，块内对每个a扫一行，逐元素Welford，d方向可向量化；
+// B>1时每段B个连续元素先在缓存里求段内均值和M2，再与之前的合并
+// d太少时沿a再切S份，最后按d合并
+template <typename DT>
+static void reduce_cpu (const DT *x, const ReduceDims &r, DT *mean, DT *var)
+{ const int64_t A = r.A, B = r.B;
+  const int D = r.D;
+  ThreadPool &pool = ThreadPool::get ();
+  const int dblk = B == 1 ? 256 : (int)std::max ((int64_t)1, XPU_GRAIN / (A * B));
+  const int dnum = (D + dblk - 1) / dblk;
+  const int S    = (int)std::max ((int64_t)1, std::min (A, (int64_t)pool.size() * 4 / dnum));
+  Tensor<CPU, DT> part;  part.create (Shape (2, D, S, 1));  // 每份的均值、M2
+  DT *pmean = part.dptr, *pm2 = part.dptr + D * S;
+
+  pool.parallel_for (0, dnum * S, 1, [&] (const int begin, const int end)
+  { for (int t = begin; t < end; ++t)
+    { const int d0 = t % dnum * dblk, d1 = std::min (D, d0 + dblk);
+      const int s  = t / dnum;
+      const int64_t a0 = A * s / S, a1 = A * (s+1) / S;
+      DT *m = pmean + s * D, *m2 = pm2 + s * D;
+      for (int d = d0; d < d1; ++d)
+        m[d] = m2[d] = 0;
+      if (B == 1)
+        for (int64_t a = a0; a < a1; ++a)
+        { const DT *xptr = x + a * D;
+          const DT inv = (DT)1 / (a - a0 + 1);
+          for (int d = d0; d < d1; ++d)
+          { const DT delta = xptr[d] - m[d];
+            m [d] += delta * inv;
+            m2[d] += delta * (xptr[d] - m[d]);
+          }
+        }
+      else
+        for (int d = d0; d < d1; ++d)
+        { double n = 0;
+          for (int64_t a = a0; a < a1; ++a)
+          { const DT *xptr = x + (a*D+d)*B;
+            DT sum = 0;
+            for (int64_t b = 0; b < B; ++b)
+              sum += xptr[b];
+            const DT bm = sum / B;
+            DT bm2 = 0;
+            for (int64_t b = 0; b < B; ++b)
+              bm2 += (xptr[b] - bm) * (xptr[b] - bm);
+            welford_merge (n, m[d], m2[d], (double)B, bm, bm2);
+          }
+        }
+    }
+  });
+
+  pool.parallel_for (0, D, 1024, [&] (const int begin, const int end)
+  { for (int d = begin; d < end; ++d)
+    { double n = 0;  DT m = 0, m2 = 0;
+      for (int s = 0; s < S; ++s)
+      { const int64_t a0 = A * s / S, a1 = A * (s+1) / S;
+        welford_merge (n, m, m2, (double)(a1 - a0) * B, pmean[s*D+d], pm2[s*D+d]);
+      }
+      mean[d] = m;
+      if (var)  var[d] = m2 / (DT)n;
+    }
+  });
+}
+
+template <class Oper, typename DT>
+static void bdcast_cpu (DT *y, const DT *bin, const ReduceDims &r)
+{ const int64_t A = r.A, B = r.B;
+  const int D = r.D;
+  Oper op;
+  ThreadPool::get().parallel_for ((int64_t)0, A * D, std::max ((int64_t)1, XPU_GRAIN / B), [&] (const int64_t begin, const int64_t end)
+  { if (B == 1)
+      for (int64_t i = begin; i < end; )  // 一段连续的d
+      { const int64_t a = i / D;
+        const int d0 = i % D, d1 = (int)std::min ((int64_t)D, d0 + end - i);
+        DT *yptr = y + a * D;
+        for (int d = d0; d < d1; ++d)
+          yptr[d] = op (yptr[d], bin[d]);
+        i += d1 - d0;
+      }
+    else
+      for (int64_t i = begin; i < end; ++i)
+      { DT *yptr = y + i * B;
+        const DT v = bin[i % D];
+        for (int64_t b = 0; b < B; ++b)
+          yptr[b] = op (yptr[b], v);
+      }
+  });
+}
+#endif
+
+template <typename XPU, typename DT>
+static void reduce (const Tensor<XPU, DT> &in, const ReduceDims &r, DT *mean, DT *var)
+{
+#ifdef __CUDACC__
+  XPU_KERNEL_LAUNCH (kernel_reduce, cuda_get_blocks(r.D), CUDA_NUM_THREADS, 0, in.get_calc_stream(),
+    r.D, in.dptr, r.A, r.D, r.B, mean, var);
+#else
+  reduce_cpu (in.dptr, r, mean, var);
+#endif
+  cuda_sync_check ("kernel_reduce");
+}
+
+template <class Oper, typename XPU, typename DT>
+static void bdcast (Tensor<XPU, DT> &out, const DT *bin, const ReduceDims &r)
+{
+#ifdef __CUDACC__
+  const int64_t N = out.size();
+  if (out.is_index32 ())
+    kernel_bdcast_kernel<Oper><<<cuda_get_blocks(N), CUDA_NUM_THREADS, 0, out.get_calc_stream()>>> ((int)N, out.dptr, bin, r.D, (int)r.B);
+  else
+    kernel_bdcast_kernel<Oper><<<cuda_get_blocks(N), CUDA_NUM_THREADS, 0, out.get_calc_stream()>>> (N, out.dptr, bin, r.D, r.B);
+#else
+  bdcast_cpu<Oper> (out.dptr, bin, r);
+#endif
+  cuda_sync_check ("kernel_bdcast");
+}
+
+
+
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::reduce_sum (const Tensor<XPU, DT> &in, const int keepdim)
+{ const ReduceDims r (in.shape, keepdim);  CHECK_EQ (size(), r.D);
+  reduce (in, r, dptr, (DT*)NULL);
+  *this *= (DT)r.A * r.B;
+}
+
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::reduce_mean (const Tensor<XPU, DT> &in, const int keepdim)
+{ const ReduceDims r (in.shape, keepdim);  CHECK_EQ (size(), r.D);
+  reduce (in, r, dptr, (DT*)NULL);
+}
+
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::reduce_var (const Tensor<XPU, DT> &in, const int keepdim)
+{ Tensor<XPU, DT> mean;  mean.create (shape, did_);
+  reduce_var (in, keepdim, mean);
+}
+
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::reduce_var (const Tensor<XPU, DT> &in, const int keepdim, Tensor<XPU, DT> &mean)
+{ const ReduceDims r (in.shape, keepdim);  CHECK_EQ (size(), r.D);  CHECK_EQ (mean.size(), r.D);
+  reduce (in, r, mean.dptr, dptr);
+}
+
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::bdcast_add (const Tensor<XPU, DT> &bin, const int keepdim)
+{ const ReduceDims r (shape, keepdim);  CHECK_EQ (bin.size(), r.D);
+  bdcast<opplus<DT>> (*this, bin.dptr, r);
+}
+
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::bdcast_sub (const Tensor<XPU, DT> &bin, const int keepdim)
+{ const ReduceDims r (shape, keepdim);  CHECK_EQ (bin.size(), r.D);
+  bdcast<opsub<DT>> (*this, bin.dptr, r);
+}
+
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::bdcast_mul (const Tensor<XPU, DT> &bin, const int keepdim)
+{ const ReduceDims r (shape, keepdim);  CHECK_EQ (bin.size(), r.D);
+  bdcast<opmul<DT>> (*this, bin.dptr, r);
+}
+
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::bdcast_div (const Tensor<XPU, DT> &bin, const int keepdim)
+{ const ReduceDims r (shape, keepdim);  CHECK_EQ (bin.size(), r.D);
+  bdcast<opdiv<DT>> (*this, bin.dptr, r);
+}
+
+// 按nums求每个位置的均值，mean的大小为size() / nums()
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::get_mean (Tensor<XPU, DT> &mean) const
+{ const ReduceDims r (nums(), size() / nums(), 1);  CHECK_EQ (mean.size(), r.D);
+  reduce (*this, r, mean.dptr, (DT*)NULL);
+}
+
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::sub_mean (const Tensor<XPU, DT> &mean)
+{ const ReduceDims r (nums(), size() / nums(), 1);  CHECK_EQ (mean.size(), r.D);
+  bdcast<opsub<DT>> (*this, mean.dptr, r);
+}
+
+#ifdef __CUDACC__
+template void TensorGPUf::reduce_sum  (const TensorGPUf &in, const int keepdim);
+template void TensorGPUd::reduce_sum  (const TensorGPUd &in, const int keepdim);
+template void TensorGPUf::reduce_mean (const TensorGPUf &in, const int keepdim);
+template void TensorGPUd::reduce_mean (const TensorGPUd &in, const int keepdim);
+template void TensorGPUf::reduce_var  (const TensorGPUf &in, const int keepdim);
+template void TensorGPUd::reduce_var  (const TensorGPUd &in, const int keepdim);
+template void TensorGPUf::reduce_var  (const TensorGPUf &in, const int keepdim, TensorGPUf &mean);
+template void TensorGPUd::reduce_var  (const TensorGPUd &in, const int keepdim, TensorGPUd &mean);
+template void TensorGPUf::bdcast_add (const TensorGPUf &bin, const int keepdim);
+template void TensorGPUd::bdcast_add (const TensorGPUd &bin, const int keepdim);
+template void TensorGPUf::bdcast_sub (const TensorGPUf &bin, const int keepdim);
+template void TensorGPUd::bdcast_sub (const TensorGPUd &bin, const int keepdim);
+template void TensorGPUf::bdcast_mul (const TensorGPUf &bin, const int keepdim);
+template void TensorGPUd::bdcast_mul (const TensorGPUd &bin, const int keepdim);
+template void TensorGPUf::bdcast_div (const TensorGPUf &bin, const int keepdim);
+template void TensorGPUd::bdcast_div (const TensorGPUd &bin, const int keepdim);
+template void TensorGPUf::get_mean (TensorGPUf &mean) const;
+template void TensorGPUd::get_mean (TensorGPUd &mean) const;
+template void TensorGPUf::sub_mean (const TensorGPUf &mean);
+template void TensorGPUd::sub_mean (const TensorGPUd &mean);
+#else
+template void TensorCPUf::reduce_sum  (const TensorCPUf &in, const int keepdim);
+template void TensorCPUd::reduce_sum  (const TensorCPUd &in, const int keepdim);
+template void TensorCPUf::reduce_mean (const TensorCPUf &in, const int keepdim);
+template void TensorCPUd::reduce_mean (const TensorCPUd &in, const int keepdim);
+template void TensorCPUf::reduce_var  (const TensorCPUf &in, const int keepdim);
+template void TensorCPUd::reduce_var  (const TensorCPUd &in, const int keepdim);
+template void TensorCPUf::reduce_var  (const TensorCPUf &in, const int keepdim, TensorCPUf &mean);
+template void TensorCPUd::reduce_var  (const TensorCPUd &in, const int keepdim, TensorCPUd &mean);
+template void TensorCPUf::bdcast_add (const TensorCPUf &bin, const int keepdim);
+template void TensorCPUd::bdcast_add (const TensorCPUd &bin, const int keepdim);
+template void TensorCPUf::bdcast_sub (const TensorCPUf &bin, const int keepdim);
+template void TensorCPUd::bdcast_sub (const TensorCPUd &bin, const int keepdim);
+template void TensorCPUf::bdcast_mul (const TensorCPUf &bin, const int keepdim);
+template void TensorCPUd::bdcast_mul (const TensorCPUd &bin, const int keepdim);
+template void TensorCPUf::bdcast_div (const TensorCPUf &bin, const int keepdim);
+template void TensorCPUd::bdcast_div (const TensorCPUd &bin, const int keepdim);
+template void TensorCPUf::get_mean (TensorCPUf &mean) const;
+template void TensorCPUd::get_mean (TensorCPUd &mean) const;
+template void TensorCPUf::sub_mean (const TensorCPUf &mean);
+template void TensorCPUd::sub_mean (const TensorCPUd &mean);
+#endif
+
+#endif
@@ -2,18 +2,19 @@
 #define TENSOR_VML_
 
 #include "../include/tensor.h"
+#include "../include/simd.h"
 using std::max;
 using std::min;
 
-template <typename DT>
-XPU_KERNEL(kernel_add) (const int num_kernels, const DT val, DT *y)
+template <typename DT, typename IT>
+XPU_KERNEL(kernel_add) (const IT num_kernels, const DT val, DT *y)
 { kernel_for (i, num_kernels)
     y[i] += val;
 }
 
 template <typename XPU, typename DT>
 void Tensor<XPU, DT>::add (const DT val)
-{ const int N = size();
+{ const int64_t N = size();
   XPU_KERNEL_LAUNCH (kernel_add, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream(),
     N, val, dptr);
 };
@@ -25,15 +26,15 @@ template void TensorCPUf::add (const float  val);
 template void TensorCPUd::add (const double val);
 #endif
 
-template <typename DT>
-XPU_KERNEL(kernel_proj) (const int num_kernels, const DT *a, const DT val, DT *y)
+template <typename DT, typename IT>
+XPU_KERNEL(kernel_proj) (const IT num_kernels, const DT *a, const DT val, DT *y)
 { kernel_for (i, num_kernels)
     y[i] = min (val/a[i], (DT)1);
 }
 
 template <typename XPU, typename DT>
 void Tensor<XPU, DT>::blas_vproj (const Tensor<XPU, DT> &in, const DT val)
-{ const int N = size();
+{ const int64_t N = size();
   XPU_KERNEL_LAUNCH (kernel_proj, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream(),
     N, in.dptr, val, dptr);
   cuda_sync_check ("cublas_vproj");
@@ -48,15 +49,95 @@ template void TensorCPUd::blas_vproj (const TensorCPUd &in, const double val);
 
 
 
-template <class Oper, typename DT>
-XPU_KERNEL(binary_vexpr) (const int num_kernels, const DT *a, const DT *b, DT *y)
+// 一个kernel展开一行k = (c, kh, kw)，输出位置从p0起连续pc个，行内递推坐标不做除法
+template <typename DT>
+XPU_KERNEL(kernel_im2col) (const int num_kernels, const DT *im, const int rows, const int cols,
+  const int ksize, const int pad, const int stride, const int w_col, const int p0, const int pc, DT *col)
+{ kernel_for (k, num_kernels)
+  { const int c  = k / (ksize * ksize);
+    const int kh = k / ksize % ksize, kw = k % ksize;
+    const DT *imc = im + (int64_t)c * rows * cols;
+    DT *colk = col + (int64_t)k * pc;
+    int oh = p0 / w_col, ow = p0 % w_col;
+    for (int q = 0; q < pc; ++q)
+    { const int ih = oh * stride - pad + kh;
+      const int iw = ow * stride - pad + kw;
+      colk[q] = (ih >= 0 && ih < rows && iw >= 0 && iw < cols) ? imc[ih * cols + iw] : (DT)0;
+      if (++ow == w_col)  { ow = 0;  ++oh;  }
+    }
+  }
+}
+
+// 一个kernel负责一个通道，该通道的ksize*ksize行都累加到同一平面，通道之间不冲突
+template <typename DT>
+XPU_KERNEL(kernel_col2im) (const int num_kernels, const DT *col, const int rows, const int cols,
+  const int ksize, const int pad, const int stride, const int w_col, const int p0, const int pc, DT *im)
+{ kernel_for (c, num_kernels)
+  { DT *imc = im + (int64_t)c * rows * cols;
+    for (int kh = 0; kh < ksize; ++kh)
+      for (int kw = 0; kw < ksize; ++kw)
+      { const DT *colk = col + (int64_t)((c * ksize + kh) * ksize + kw) * pc;
+        int oh = p0 / w_col, ow = p0 % w_col;
+        for (int q = 0; q < pc; ++q)
+        { const int ih = oh * stride - pad + kh;
+          const int iw = ow * stride - pad + kw;
+          if (ih >= 0 && ih < rows && iw >= 0 && iw < cols)
+            imc[ih * cols + iw] += colk[q];
+          if (++ow == w_col)  { ow = 0;  ++oh;  }
+        }
+      }
+  }
+}
+
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::im2col_fprop (const Patch &p, Tensor<XPU, DT> &im_col, const int p0)
+{ const int K  = chls() * p.ksize * p.ksize;
+  const int pc = im_col.cols();
+  CHECK_EQ (nums(), 1);
+  CHECK_EQ (im_col.size(), (int64_t)K * pc);
+  CHECK_LE (p0 + pc, p.h_col * p.w_col);
+  XPU_KERNEL_LAUNCH_GRAIN (kernel_im2col, max (1, XPU_GRAIN / pc), cuda_get_blocks(K), CUDA_NUM_THREADS, 0, get_calc_stream(),
+    K, dptr, rows(), cols(), p.ksize, p.pad, p.stride, p.w_col, p0, pc, im_col.dptr);
+  cuda_sync_check ("im2col_fprop");
+}
+#ifdef __CUDACC__
+template void TensorGPUf::im2col_fprop (const Patch &p, TensorGPUf &im_col, const int p0);
+template void TensorGPUd::im2col_fprop (const Patch &p, TensorGPUd &im_col, const int p0);
+#else
+template void TensorCPUf::im2col_fprop (const Patch &p, TensorCPUf &im_col, const int p0);
+template void TensorCPUd::im2col_fprop (const Patch &p, TensorCPUd &im_col, const int p0);
+#endif
+
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::col2im_bprop (const Patch &p, const Tensor<XPU, DT> &im_col, const int p0)
+{ const int C  = chls();
+  const int pc = im_col.cols();
+  CHECK_EQ (nums(), 1);
+  CHECK_EQ (im_col.size(), (int64_t)C * p.ksize * p.ksize * pc);
+  CHECK_LE (p0 + pc, p.h_col * p.w_col);
+  XPU_KERNEL_LAUNCH_GRAIN (kernel_col2im, max (1, XPU_GRAIN / (p.ksize * p.ksize * pc)), cuda_get_blocks(C), CUDA_NUM_THREADS, 0, get_calc_stream(),
+    C, im_col.dptr, rows(), cols(), p.ksize, p.pad, p.stride, p.w_col, p0, pc, dptr);
+  cuda_sync_check ("col2im_bprop");
+}
+#ifdef __CUDACC__
+template void TensorGPUf::col2im_bprop (const Patch &p, const TensorGPUf &im_col, const int p0);
+template void TensorGPUd::col2im_bprop (const Patch &p, const TensorGPUd &im_col, const int p0);
+#else
+template void TensorCPUf::col2im_bprop (const Patch &p, const TensorCPUf &im_col, const int p0);
+template void TensorCPUd::col2im_bprop (const Patch &p, const TensorCPUd &im_col, const int p0);
+#endif
+
+
+
+template <class Oper, typename DT, typename IT>
+XPU_KERNEL(binary_vexpr) (const IT num_kernels, const DT *a, const DT *b, DT *y)
 { Oper op;
   kernel_for (i, num_kernels)
     y[i] = op (a[i], b[i]);
 }
 
-template <class Oper, typename DT>
-XPU_KERNEL(unary_vexpr)  (const int num_kernels, const DT *a, DT *y)
+template <class Oper, typename DT, typename IT>
+XPU_KERNEL(unary_vexpr)  (const IT num_kernels, const DT *a, DT *y)
 { Oper op;
   kernel_for (i, num_kernels)
     y[i] = op (a[i]);
@@ -67,28 +148,28 @@ XPU_KERNEL(unary_vexpr)  (const int num_kernels, const DT *a, DT *y)
 #ifdef __CUDACC__
 template <typename XPU, typename DT>
 void Tensor<XPU, DT>::blas_vadd (const Tensor<XPU, DT> &A, const Tensor<XPU, DT> &B)
-{ const int N = size();  CHECK_EQ (A.size(), B.size());
+{ const int64_t N = size();  CHECK_EQ (A.size(), B.size());
   binary_vexpr_kernel<opplus<DT>><<<cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream()>>>
     (N, A.dptr, B.dptr, dptr);
   cuda_sync_check ("cublas_vadd");
 };
 template <typename XPU, typename DT>
 void Tensor<XPU, DT>::blas_vsub (const Tensor<XPU, DT> &A, const Tensor<XPU, DT> &B)
-{ const int N = size();  CHECK_EQ (A.size(), B.size());
+{ const int64_t N = size();  CHECK_EQ (A.size(), B.size());
   binary_vexpr_kernel<opsub <DT>><<<cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream()>>>
     (N, A.dptr, B.dptr, dptr);
   cuda_sync_check ("cublas_vsub");
 };
 template <typename XPU, typename DT>
 void Tensor<XPU, DT>::blas_vmul (const Tensor<XPU, DT> &A, const Tensor<XPU, DT> &B)
-{ const int N = size();  CHECK_EQ (A.size(), B.size());
+{ const int64_t N = size();  CHECK_EQ (A.size(), B.size());
   binary_vexpr_kernel<opmul <DT>><<<cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream()>>>
     (N, A.dptr, B.dptr, dptr);
   cuda_sync_check ("cublas_vmul");
 };
 template <typename XPU, typename DT>
 void Tensor<XPU, DT>::blas_vdiv (const Tensor<XPU, DT> &A, const Tensor<XPU, DT> &B)
-{ const int N = size();  CHECK_EQ (A.size(), B.size());
+{ const int64_t N = size();  CHECK_EQ (A.size(), B.size());
   binary_vexpr_kernel<opdiv <DT>><<<cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream()>>>
     (N, A.dptr, B.dptr, dptr);
   cuda_sync_check ("cublas_vdiv");
@@ -102,82 +183,113 @@ template void TensorGPUd::blas_vmul (const TensorGPUd &A, const TensorGPUd &B);
 template void TensorGPUf::blas_vdiv (const TensorGPUf &A, const TensorGPUf &B);
 template void TensorGPUd::blas_vdiv (const TensorGPUd &A, const TensorGPUd &B);
 #else
+#ifndef USE_MKL
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::blas_vadd (const Tensor<XPU, DT> &A, const Tensor<XPU, DT> &B)
+{ const int64_t N = size();  CHECK_EQ (A.size(), B.size());
+  simd_binary<opplus> (N, A.dptr, B.dptr, dptr);
+};
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::blas_vsub (const Tensor<XPU, DT> &A, const Tensor<XPU, DT> &B)
+{ const int64_t N = size();  CHECK_EQ (A.size(), B.size());
+  simd_binary<opsub > (N, A.dptr, B.dptr, dptr);
+};
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::blas_vmul (const Tensor<XPU, DT> &A, const Tensor<XPU, DT> &B)
+{ const int64_t N = size();  CHECK_EQ (A.size(), B.size());
+  simd_binary<opmul > (N, A.dptr, B.dptr, dptr);
+};
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::blas_vdiv (const Tensor<XPU, DT> &A, const Tensor<XPU, DT> &B)
+{ const int64_t N = size();  CHECK_EQ (A.size(), B.size());
+  simd_binary<opdiv > (N, A.dptr, B.dptr, dptr);
+};
+template void TensorCPUf::blas_vadd (const TensorCPUf &A, const TensorCPUf &B);
+template void TensorCPUd::blas_vadd (const TensorCPUd &A, const TensorCPUd &B);
+template void TensorCPUf::blas_vsub (const TensorCPUf &A, const TensorCPUf &B);
+template void TensorCPUd::blas_vsub (const TensorCPUd &A, const TensorCPUd &B);
+template void TensorCPUf::blas_vmul (const TensorCPUf &A, const TensorCPUf &B);
+template void TensorCPUd::blas_vmul (const TensorCPUd &A, const TensorCPUd &B);
+template void TensorCPUf::blas_vdiv (const TensorCPUf &A, const TensorCPUf &B);
+template void TensorCPUd::blas_vdiv (const TensorCPUd &A, const TensorCPUd &B);
+#else
 template <>
 void TensorCPUf::blas_vadd (const TensorCPUf &A, const TensorCPUf &B)
-{ const int N = size();  CHECK_EQ (A.size(), B.size());
+{ const int N = size32();  CHECK_EQ (A.size(), B.size());
   vsAdd (N, A.dptr, B.dptr, dptr);
 };
 template <>
 void TensorCPUd::blas_vadd (const TensorCPUd &A, const TensorCPUd &B)
-{ const int N = size();  CHECK_EQ (A.size(), B.size());
+{ const int N = size32();  CHECK_EQ (A.size(), B.size());
   vdAdd (N, A.dptr, B.dptr, dptr);
 };
 template <>
 void TensorCPUf::blas_vsub (const TensorCPUf &A, const TensorCPUf &B)
-{ const int N = size();  CHECK_EQ (A.size(), B.size());
+{ const int N = size32();  CHECK_EQ (A.size(), B.size());
   vsSub (N, A.dptr, B.dptr, dptr);
 };
 template <>
 void TensorCPUd::blas_vsub (const TensorCPUd &A, const TensorCPUd &B)
-{ const int N = size();  CHECK_EQ (A.size(), B.size());
+{ const int N = size32();  CHECK_EQ (A.size(), B.size());
   vdSub (N, A.dptr, B.dptr, dptr);
 };
 template <>
 void TensorCPUf::blas_vmul (const TensorCPUf &A, const TensorCPUf &B)
-{ const int N = size();  CHECK_EQ (A.size(), B.size());
+{ const int N = size32();  CHECK_EQ (A.size(), B.size());
   vsMul (N, A.dptr, B.dptr, dptr);
 };
 template <>
 void TensorCPUd::blas_vmul (const TensorCPUd &A, const TensorCPUd &B)
-{ const int N = size();  CHECK_EQ (A.size(), B.size());
+{ const int N = size32();  CHECK_EQ (A.size(), B.size());
   vdMul (N, A.dptr, B.dptr, dptr);
 };
 template <>
 void TensorCPUf::blas_vdiv (const TensorCPUf &A, const TensorCPUf &B)
-{ const int N = size();  CHECK_EQ (A.size(), B.size());
+{ const int N = size32();  CHECK_EQ (A.size(), B.size());
   vsDiv (N, A.dptr, B.dptr, dptr);
 };
 template <>
 void TensorCPUd::blas_vdiv (const TensorCPUd &A, const TensorCPUd &B)
-{ const int N = size();  CHECK_EQ (A.size(), B.size());
+{ const int N = size32();  CHECK_EQ (A.size(), B.size());
   vdDiv (N, A.dptr, B.dptr, dptr);
 };
 #endif
+#endif
 
 
 
 #ifdef __CUDACC__
 template <typename XPU, typename DT>
 void Tensor<XPU, DT>::blas_vabs (const Tensor<XPU, DT> &in)
-{ const int N = size();  CHECK_EQ (N, in.size());
+{ const int64_t N = size();  CHECK_EQ (N, in.size());
   unary_vexpr_kernel<opabs<DT>><<<cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream()>>>
     (N, in.dptr, dptr);
   cuda_sync_check ("cublas_vabs");
 };
 template <typename XPU, typename DT>
 void Tensor<XPU, DT>::blas_vexp (const Tensor<XPU, DT> &in)
-{ const int N = size();  CHECK_EQ (N, in.size());
+{ const int64_t N = size();  CHECK_EQ (N, in.size());
   unary_vexpr_kernel<opexp<DT>><<<cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream()>>>
     (N, in.dptr, dptr);
   cuda_sync_check ("cublas_vexp");
 };
 template <typename XPU, typename DT>
 void Tensor<XPU, DT>::blas_vinv (const Tensor<XPU, DT> &in)
-{ const int N = size();  CHECK_EQ (N, in.size());
+{ const int64_t N = size();  CHECK_EQ (N, in.size());
   unary_vexpr_kernel<opinv<DT>><<<cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream()>>>
     (N, in.dptr, dptr);
   cuda_sync_check ("cublas_vinv");
 };
 template <typename XPU, typename DT>
 void Tensor<XPU, DT>::blas_vsqr (const Tensor<XPU, DT> &in)
-{ const int N = size();  CHECK_EQ (N, in.size());
+{ const int64_t N = size();  CHECK_EQ (N, in.size());
   unary_vexpr_kernel<opsquare<DT>><<<cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream()>>>
     (N, in.dptr, dptr);
   cuda_sync_check ("cublas_vsqr");
 };
 template <typename XPU, typename DT>
 void Tensor<XPU, DT>::blas_vsqrt(const Tensor<XPU, DT> &in)
-{ const int N = size();  CHECK_EQ (N, in.size());
+{ const int64_t N = size();  CHECK_EQ (N, in.size());
   unary_vexpr_kernel<opsqrt<DT>><<<cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream()>>>
     (N, in.dptr, dptr);
   cuda_sync_check ("cublas_vsqrt");
@@ -193,56 +305,94 @@ template void TensorGPUd::blas_vsqr (const TensorGPUd &in);
 template void TensorGPUf::blas_vsqrt(const TensorGPUf &in);
 template void TensorGPUd::blas_vsqrt(const TensorGPUd &in);
 #else
+#ifndef USE_MKL
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::blas_vabs (const Tensor<XPU, DT> &in)
+{ const int64_t N = size();  CHECK_EQ (N, in.size());
+  simd_unary<opabs> (N, in.dptr, dptr);
+};
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::blas_vexp (const Tensor<XPU, DT> &in)
+{ const int64_t N = size();  CHECK_EQ (N, in.size());
+  simd_unary<opexp> (N, in.dptr, dptr);
+};
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::blas_vinv (const Tensor<XPU, DT> &in)
+{ const int64_t N = size();  CHECK_EQ (N, in.size());
+  simd_unary<opinv> (N, in.dptr, dptr);
+};
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::blas_vsqr (const Tensor<XPU, DT> &in)
+{ const int64_t N = size();  CHECK_EQ (N, in.size());
+  simd_unary<opsquare> (N, in.dptr, dptr);
+};
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::blas_vsqrt(const Tensor<XPU, DT> &in)
+{ const int64_t N = size();  CHECK_EQ (N, in.size());
+  simd_unary<opsqrt> (N, in.dptr, dptr);
+};
+template void TensorCPUf::blas_vabs (const TensorCPUf &in);
+template void TensorCPUd::blas_vabs (const TensorCPUd &in);
+template void TensorCPUf::blas_vexp (const TensorCPUf &in);
+template void TensorCPUd::blas_vexp (const TensorCPUd &in);
+template void TensorCPUf::blas_vinv (const TensorCPUf &in);
+template void TensorCPUd::blas_vinv (const TensorCPUd &in);
+template void TensorCPUf::blas_vsqr (const TensorCPUf &in);
+template void TensorCPUd::blas_vsqr (const TensorCPUd &in);
+template void TensorCPUf::blas_vsqrt(const TensorCPUf &in);
+template void TensorCPUd::blas_vsqrt(const TensorCPUd &in);
+#else
 template <>
 void TensorCPUf::blas_vabs (const TensorCPUf &in)
-{ const int N = size();  CHECK_EQ (N, in.size());
+{ const int N = size32();  CHECK_EQ (N, in.size());
   vsAbs (N, in.dptr, dptr);
 };
 template <>
 void TensorCPUd::blas_vabs (const TensorCPUd &in)
-{ const int N = size();  CHECK_EQ (N, in.size());
+{ const int N = size32();  CHECK_EQ (N, in.size());
   vdAbs (N, in.dptr, dptr);
 };
 template <>
 void TensorCPUf::blas_vexp (const TensorCPUf &in)
-{ const int N = size();  CHECK_EQ (N, in.size());
+{ const int N = size32();  CHECK_EQ (N, in.size());
   vsExp (N, in.dptr, dptr);
 };
 template <>
 void TensorCPUd::blas_vexp (const TensorCPUd &in)
-{ const int N = size();  CHECK_EQ (N, in.size());
+{ const int N = size32();  CHECK_EQ (N, in.size());
   vdExp (N, in.dptr, dptr);
 };
 template <>
 void TensorCPUf::blas_vinv (const TensorCPUf &in)
-{ const int N = size();  CHECK_EQ (N, in.size());
+{ const int N = size32();  CHECK_EQ (N, in.size());
   vsInv (N, in.dptr, dptr);
 };
 template <>
 void TensorCPUd::blas_vinv (const TensorCPUd &in)
-{ const int N = size();  CHECK_EQ (N, in.size());
+{ const int N = size32();  CHECK_EQ (N, in.size());
   vdInv (N, in.dptr, dptr);
 };
 template <>
 void TensorCPUf::blas_vsqr (const TensorCPUf &in)
-{ const int N = size();  CHECK_EQ (N, in.size());
+{ const int N = size32();  CHECK_EQ (N, in.size());
   vsSqr (N, in.dptr, dptr);
 };
 template <>
 void TensorCPUd::blas_vsqr (const TensorCPUd &in)
-{ const int N = size();  CHECK_EQ (N, in.size());
+{ const int N = size32();  CHECK_EQ (N, in.size());
   vdSqr (N, in.dptr, dptr);
 };
 template <>
 void TensorCPUf::blas_vsqrt(const TensorCPUf &in)
-{ const int N = size();  CHECK_EQ (N, in.size());
+{ const int N = size32();  CHECK_EQ (N, in.size());
   vsSqrt(N, in.dptr, dptr);
 };
 template <>
 void TensorCPUd::blas_vsqrt(const TensorCPUd &in)
-{ const int N = size();  CHECK_EQ (N, in.size());
+{ const int N = size32();  CHECK_EQ (N, in.size());
   vdSqrt(N, in.dptr, dptr);
 };
 #endif
+#endif
 
 #endif
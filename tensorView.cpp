@@ -0,0 +1,204 @@
+#ifndef TENSOR_VIEW_
+#define TENSOR_VIEW_
+
+#include "../include/tensor.h"
+
+template <typename XPU, typename DT>
+TensorView<XPU, DT>::TensorView (DT *ptr, const Shape &s, const int did) : shape(s), dptr(ptr), did_(did)
+{ CHECK (s.get_block () == 1) << "\tblocked layouts have no strided view";
+  strd.dims[0] = s.rows;  strd.dims[1] = s.cols;  strd.dims[2] = s.chls;  strd.dims[3] = s.nums;
+  if (s.layout == kNHWC)
+  { strd.strd[0] = (int64_t)s.cols * s.chls;
+    strd.strd[1] = s.chls;
+    strd.strd[2] = 1;
+  }
+  else
+  { strd.strd[0] = s.cols;
+    strd.strd[1] = 1;
+    strd.strd[2] = (int64_t)s.cols * s.rows;
+  }
+  strd.strd[3] = (int64_t)s.cols * s.rows * s.chls;
+  shape.set_layout (kNCHW);  // 视图的shape只表示逻辑维度，存放位置由strd决定
+}
+
+template <typename XPU, typename DT>
+TensorView<XPU, DT> Tensor<XPU, DT>::view () const
+{ return TensorView<XPU, DT> (dptr, shape, did_);
+}
+
+template <typename XPU, typename DT>
+TensorView<XPU, DT> TensorView<XPU, DT>::slice (const int d, const int begin, const int end) const
+{ CHECK (d >= 1 && d <= 4);
+  CHECK (begin >= 0 && end > begin && end <= strd.dims[d-1]);
+  TensorView<XPU, DT> t = *this;
+  t.strd.dims[d-1] = end - begin;
+  t.shape = Shape (t.strd.dims[0], t.strd.dims[1], t.strd.dims[2], t.strd.dims[3]);
+  t.dptr  = dptr + begin * strd.strd[d-1];
+  return t;
+}
+
+template <typename XPU, typename DT>
+TensorView<XPU, DT> TensorView<XPU, DT>::transpose (const int d1, const int d2) const
+{ CHECK (d1 >= 1 && d1 <= 4 && d2 >= 1 && d2 <= 4);
+  TensorView<XPU, DT> t = *this;
+  std::swap (t.strd.dims[d1-1], t.strd.dims[d2-1]);
+  std::swap (t.strd.strd[d1-1], t.strd.strd[d2-1]);
+  t.shape = Shape (t.strd.dims[0], t.strd.dims[1], t.strd.dims[2], t.strd.dims[3]);
+  return t;
+}
+
+template <typename XPU, typename DT>
+bool TensorView<XPU, DT>::is_contiguous () const
+{ return strd.strd[1] == 1
+      && strd.strd[0] == cols()
+      && strd.strd[2] == (int64_t)cols() * rows()
+      && strd.strd[3] == (int64_t)cols() * rows() * chls();
+}
+
+// 元素数和最远偏移都放得进int时，kernel走32位下标
+template <typename XPU, typename DT>
+bool TensorView<XPU, DT>::is_index32 () const
+{ int64_t last = 0;
+  for (int d = 0; d < 4; ++d)
+    last += (int64_t)(strd.dims[d] - 1) * strd.strd[d];
+  return size() <= INT_MAX && last < INT_MAX;
+}
+
+#ifdef __CUDACC__
+template TensorViewGPUf::TensorView (float  *ptr, const Shape &s, const int did);
+template TensorViewGPUd::TensorView (double *ptr, const Shape &s, const int did);
+template TensorViewGPUf TensorGPUf::view () const;
+template TensorViewGPUd TensorGPUd::view () const;
+template TensorViewGPUf TensorViewGPUf::slice (const int d, const int begin, const int end) const;
+template TensorViewGPUd TensorViewGPUd::slice (const int d, const int begin, const int end) const;
+template TensorViewGPUf TensorViewGPUf::transpose (const int d1, const int d2) const;
+template TensorViewGPUd TensorViewGPUd::transpose (const int d1, const int d2) const;
+template bool TensorViewGPUf::is_contiguous () const;
+template bool TensorViewGPUd::is_contiguous () const;
+template bool TensorViewGPUf::is_index32 () const;
+template bool TensorViewGPUd::is_index32 () const;
+#else
+template TensorViewCPUf::TensorView (float  *ptr, const Shape &s, const int did);
+template TensorViewCPUd::TensorView (double *ptr, const Shape &s, const int did);
+template TensorViewCPUf TensorCPUf::view () const;
+template TensorViewCPUd TensorCPUd::view () const;
+template TensorViewCPUf TensorViewCPUf::slice (const int d, const int begin, const int end) const;
+template TensorViewCPUd TensorViewCPUd::slice (const int d, const int begin, const int end) const;
+template TensorViewCPUf TensorViewCPUf::transpose (const int d1, const int d2) const;
+template TensorViewCPUd TensorViewCPUd::transpose (const int d1, const int d2) const;
+template bool TensorViewCPUf::is_contiguous () const;
+template bool TensorViewCPUd::is_contiguous () const;
+template bool TensorViewCPUf::is_index32 () const;
+template bool TensorViewCPUd::is_index32 () const;
+#endif
+
+
+
+template <typename DT, typename IT>
+XPU_KERNEL(kernel_view_copy) (const IT num_kernels, const DT *a, const Stride sa, DT *y, const Stride sy)
+{ kernel_for (i, num_kernels)
+    y[sy.offset(i)] = a[sa.offset(i)];
+}
+
+template <class Oper, typename DT, typename IT>
+XPU_KERNEL(kernel_view_binary) (const IT num_kernels, const DT *a, const Stride sa, const DT *b, const Stride sb,
+  DT *y, const Stride sy)
+{ Oper op;
+  kernel_for (i, num_kernels)
+    y[sy.offset(i)] = op (a[sa.offset(i)], b[sb.offset(i)]);
+}
+
+template <typename XPU, typename DT>
+void TensorView<XPU, DT>::copy (const TensorView<XPU, DT> &in)
+{ const int64_t N = size();  CHECK (shape == in.shape);
+  if (is_contiguous () && in.is_contiguous ())
+  { Tensor<XPU, DT> t;  t.shape = shape;  t.dptr = dptr;  t.did_ = did_;
+    Tensor<XPU, DT> s;  s.shape = shape;  s.dptr = in.dptr;
+    t.copy (s);
+    return;
+  }
+  if (is_index32 () && in.is_index32 ())
+    XPU_KERNEL_LAUNCH (kernel_view_copy, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream(),
+      (int)N, in.dptr, in.strd, dptr, strd);
+  else
+    XPU_KERNEL_LAUNCH (kernel_view_copy, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream(),
+      N, in.dptr, in.strd, dptr, strd);
+  cuda_sync_check ("kernel_view_copy");
+}
+
+template <typename XPU, typename DT>
+void Tensor<XPU, DT>::copy (const TensorView<XPU, DT> &in)
+{ CHECK_EQ (size(), in.size());
+  Shape s (in.rows(), in.cols(), in.chls(), in.nums());  s.set_layout (shape.layout);
+  TensorView<XPU, DT> t (dptr, s, did_);
+  t.copy (in);
+}
+
+template <typename XPU, typename DT> template <class Oper>
+void TensorView<XPU, DT>::binary (const TensorView<XPU, DT> &A, const TensorView<XPU, DT> &B)
+{ const int64_t N = size();  CHECK (shape == A.shape && shape == B.shape);
+  const bool idx32 = is_index32 () && A.is_index32 () && B.is_index32 ();
+#ifdef __CUDACC__
+  if (idx32)
+    kernel_view_binary_kernel<Oper><<<cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream()>>>
+      ((int)N, A.dptr, A.strd, B.dptr, B.strd, dptr, strd);
+  else
+    kernel_view_binary_kernel<Oper><<<cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream()>>>
+      (N, A.dptr, A.strd, B.dptr, B.strd, dptr, strd);
+#else
+  if (idx32)
+    XPU_KERNEL_LAUNCH (kernel_view_binary<Oper>, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream(),
+      (int)N, A.dptr, A.strd, B.dptr, B.strd, dptr, strd);
+  else
+    XPU_KERNEL_LAUNCH (kernel_view_binary<Oper>, cuda_get_blocks(N), CUDA_NUM_THREADS, 0, get_calc_stream(),
+      N, A.dptr, A.strd, B.dptr, B.strd, dptr, strd);
+#endif
+  cuda_sync_check ("kernel_view_binary");
+}
+
+template <typename XPU, typename DT>
+void TensorView<XPU, DT>::blas_vadd (const TensorView<XPU, DT> &A, const TensorView<XPU, DT> &B)
+{ binary<opplus<DT>> (A, B);
+}
+template <typename XPU, typename DT>
+void TensorView<XPU, DT>::blas_vsub (const TensorView<XPU, DT> &A, const TensorView<XPU, DT> &B)
+{ binary<opsub <DT>> (A, B);
+}
+template <typename XPU, typename DT>
+void TensorView<XPU, DT>::blas_vmul (const TensorView<XPU, DT> &A, const TensorView<XPU, DT> &B)
+{ binary<opmul <DT>> (A, B);
+}
+template <typename XPU, typename DT>
+void TensorView<XPU, DT>::blas_vdiv (const TensorView<XPU, DT> &A, const TensorView<XPU, DT> &B)
+{ binary<opdiv <DT>> (A, B);
+}
+
+#ifdef __CUDACC__
+template void TensorViewGPUf::copy (const TensorViewGPUf &in);
+template void TensorViewGPUd::copy (const TensorViewGPUd &in);
+template void TensorGPUf::copy (const TensorViewGPUf &in);
+template void TensorGPUd::copy (const TensorViewGPUd &in);
+template void TensorViewGPUf::blas_vadd (const TensorViewGPUf &A, const TensorViewGPUf &B);
+template void TensorViewGPUd::blas_vadd (const TensorViewGPUd &A, const TensorViewGPUd &B);
+template void TensorViewGPUf::blas_vsub (const TensorViewGPUf &A, const TensorViewGPUf &B);
+template void TensorViewGPUd::blas_vsub (const TensorViewGPUd &A, const TensorViewGPUd &B);
+template void TensorViewGPUf::blas_vmul (const TensorViewGPUf &A, const TensorViewGPUf &B);
+template void TensorViewGPUd::blas_vmul (const TensorViewGPUd &A, const TensorViewGPUd &B);
+template void TensorViewGPUf::blas_vdiv (const TensorViewGPUf &A, const TensorViewGPUf &B);
+template void TensorViewGPUd::blas_vdiv (const TensorViewGPUd &A, const TensorViewGPUd &B);
+#else
+template void TensorViewCPUf::copy (const TensorViewCPUf &in);
+template void TensorViewCPUd::copy (const TensorViewCPUd &in);
+template void TensorCPUf::copy (const TensorViewCPUf &in);
+template void TensorCPUd::copy (const TensorViewCPUd &in);
+template void TensorViewCPUf::blas_vadd (const TensorViewCPUf &A, const TensorViewCPUf &B);
+template void TensorViewCPUd::blas_vadd (const TensorViewCPUd &A, const TensorViewCPUd &B);
+template void TensorViewCPUf::blas_vsub (const TensorViewCPUf &A, const TensorViewCPUf &B);
+template void TensorViewCPUd::blas_vsub (const TensorViewCPUd &A, const TensorViewCPUd &B);
+template void TensorViewCPUf::blas_vmul (const TensorViewCPUf &A, const TensorViewCPUf &B);
+template void TensorViewCPUd::blas_vmul (const TensorViewCPUd &A, const TensorViewCPUd &B);
+template void TensorViewCPUf::blas_vdiv (const TensorViewCPUf &A, const TensorViewCPUf &B);
+template void TensorViewCPUd::blas_vdiv (const TensorViewCPUd &A, const TensorViewCPUd &B);
+#endif
+
+#endif
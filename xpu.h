@@ -3,7 +3,15 @@
 
 #include <omp.h>
 #include <stdio.h>
+#include <limits.h>
 #include <sys/types.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include <vector>
   #include <cuda.h>
   #include <driver_types.h>
@@ -15,13 +23,18 @@
   #include <nppdefs.h>
 
   #include <math.h>
+// CPU后端：默认用自带的SIMD向量运算和分块GEMM，不依赖MKL；编译时定义USE_MKL才改走MKL的cblas和VML
+#ifdef USE_MKL
   #include <mkl.h>
   #include <mkl_cblas.h>
   #include <mkl_vsl.h>
   #include <mkl_vsl_functions.h>
+#endif
 
 #define CUDA_NUM_THREADS 1024
 #define CUDA_NUM_DEVICES 2
+#define XPU_GRAIN	4096  // CPU kernel最小分块，不超过一块就在调用线程上顺序执行
+#define XPU_INDEX_T(n)	decltype((n)+0)
 
 #ifdef __CUDACC__
 
@@ -43,6 +56,8 @@
     #define XPU_KERNEL_LAUNCH(name, gridDim, blockDim, sharedBytes, streamId, ...) \
       name ## _kernel<<< (gridDim) , (blockDim), (sharedBytes), (streamId) >>>(__VA_ARGS__)
   #endif
+  #define XPU_KERNEL_LAUNCH_GRAIN(name, grain, gridDim, blockDim, sharedBytes, streamId, ...) \
+    XPU_KERNEL_LAUNCH (name, gridDim, blockDim, sharedBytes, streamId, __VA_ARGS__)
 
   #define XPU_CALLABLE			__host__ __device__
   #define XPU_CALLABLE_INLINE		__host__ __device__ inline
@@ -54,10 +69,18 @@
   #define XPU_GET_ELEMENT_OFFSET	blockDim.x * blockIdx.x + threadIdx.x
   #define XPU_GET_ELEMENT_STRIDE	blockDim.x * gridDim.x
 
+  // 下标类型跟随n，num_kernels为int的kernel仍走32位下标
+  #define kernel_for(i, n) \
+    for (XPU_INDEX_T(n) i = XPU_GET_ELEMENT_OFFSET; i < n; i += XPU_GET_ELEMENT_STRIDE)
+
 #else
   #define CUDA_MANAGED false
   #define XPU_KERNEL(name)		void name
-  #define XPU_KERNEL_LAUNCH(name, gridDim, blockDim, sharedBytes, streamId, ...) name(__VA_ARGS__)
+  #define XPU_KERNEL_LAUNCH(name, gridDim, blockDim, sharedBytes, streamId, ...) \
+    XPU_KERNEL_LAUNCH_GRAIN (name, XPU_GRAIN, gridDim, blockDim, sharedBytes, streamId, __VA_ARGS__)
+  #define XPU_KERNEL_LAUNCH_GRAIN(name, grain, gridDim, blockDim, sharedBytes, streamId, ...) \
+    xpu_launch (grain, XPU_FIRST_ARG (__VA_ARGS__, 0), [&] { name (__VA_ARGS__);  })
+  #define XPU_FIRST_ARG(a, ...)		a
 
   #define XPU_CALLABLE
   #define XPU_CALLABLE_INLINE		inline
@@ -65,11 +88,11 @@
   #define XPU_GET_ELEMENT_OFFSET	0
   #define XPU_GET_ELEMENT_STRIDE	1
 
-#endif
+  // 第一个参数是num_kernels，线程池把[0, n)切块，每块执行一次kernel，kernel_for只走本块
+  #define kernel_for(i, n) \
+    for (XPU_INDEX_T(n) i = xpu_range.begin, i##_end = std::min ((XPU_INDEX_T(n))(n), (XPU_INDEX_T(n))xpu_range.end); i < i##_end; ++i)
 
-#define kernel_for(i, n) \
-  _Pragma ("omp parallel for") \
-  for (int i = XPU_GET_ELEMENT_OFFSET; i < n; i += XPU_GET_ELEMENT_STRIDE)
+#endif
 
 void cuda_nervana_load (const char* const base_path);
 void cuda_nervana_unload ();
@@ -77,7 +100,7 @@ void cuda_set_p2p (const int num_device);
 void cuda_del_p2p (const int num_device);
 void cuda_set_device (const int did);
 void cuda_stream_sync(const int did);
-int  cuda_get_blocks (const int N);
+int  cuda_get_blocks (const int64_t N);
 
 class XPUCtx {
 public:
@@ -126,6 +149,58 @@ public:
 class CPU {
 };
 
+
+
+class XPURange {
+public:
+  int64_t begin, end;
+};
+extern thread_local XPURange xpu_range;
+
+class ThreadPool {
+public:
+  explicit ThreadPool (const int nthreads);
+  ~ThreadPool ();
+  static ThreadPool& get ();
+  int  size () const { return (int)threads_.size() + 1;  }  // 调用线程也干活
+  void parallel_for (const int64_t begin, const int64_t end, const int64_t grain, const std::function<void(int64_t, int64_t)> &fn);
+  void parallel_for (const int begin, const int end, const int grain, const std::function<void(int, int)> &fn);
+private:
+  class Task {
+  public:
+    const std::function<void(int64_t, int64_t)> *fn;
+    int64_t begin, end;
+    std::atomic<int> *pending;
+  };
+  class Queue {
+  public:
+    std::mutex mtx;
+    std::deque<Task> tasks;
+  };
+  void push  (const int qid, const Task &task);
+  bool pop   (const int qid, Task &task);
+  bool steal (const int qid, Task &task);
+  void run   (const Task &task);
+  void work  (const int qid);
+  std::vector<std::thread> threads_;
+  std::vector<Queue*> queues_;
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::atomic<int> queued_;
+  bool stop_;
+};
+
+template <typename F, typename IT>
+void xpu_launch (const int grain, const IT n, const F &kernel)
+{ ThreadPool::get().parallel_for ((int64_t)0, (int64_t)n, (int64_t)grain, [&] (const int64_t begin, const int64_t end)
+  { const XPURange last = xpu_range;
+    xpu_range.begin = begin;
+    xpu_range.end   = end;
+    kernel ();
+    xpu_range = last;
+  });
+}
+
 extern std::vector<XPUCtx*> dnnctx;
 
 #endif
@@ -0,0 +1,140 @@
+#ifndef XPU_POOL_
+#define XPU_POOL_
+
+#include "../include/util.h"
+#include "../include/xpu.h"
+
+#ifndef __CUDACC__
+thread_local XPURange xpu_range = { 0, INT64_MAX };
+static thread_local int xpu_worker = -1;  // 工作线程的队列号，外部线程为-1
+
+// XPU_NUM_THREADS 环境变量指定线程数，默认每核一个
+ThreadPool& ThreadPool::get ()
+{ static ThreadPool pool ([] {
+    const char *env = getenv ("XPU_NUM_THREADS");
+    const int num = env ? atoi (env) : (int)std::thread::hardware_concurrency ();
+    return std::max (num, 1);
+  } ());
+  return pool;
+}
+
+ThreadPool::ThreadPool (const int nthreads) : queued_(0), stop_(false)
+{ for (int i = 0; i < nthreads - 1; ++i)
+    queues_.push_back (new Queue ());
+  for (int i = 0; i < nthreads - 1; ++i)
+    threads_.push_back (std::thread (&ThreadPool::work, this, i));
+  LOG (INFO) << "\tCPU  thread pool initialized\tthreads = " << nthreads;
+}
+
+ThreadPool::~ThreadPool ()
+{ { std::unique_lock<std::mutex> lock (mtx_);
+    stop_ = true;
+  }
+  cv_.notify_all ();
+  for (auto &t : threads_)
+    t.join ();
+  for (auto q : queues_)
+    delete q;
+}
+
+void ThreadPool::push (const int qid, const Task &task)
+{ { std::unique_lock<std::mutex> lock (queues_[qid]->mtx);
+    queues_[qid]->tasks.push_back (task);
+  }
+  queued_++;
+}
+
+// 自己的队列从尾部取，保持局部性
+bool ThreadPool::pop (const int qid, Task &task)
+{ if (qid < 0)
+    return false;
+  std::unique_lock<std::mutex> lock (queues_[qid]->mtx);
+  if (queues_[qid]->tasks.empty ())
+    return false;
+  task = queues_[qid]->tasks.back ();
+  queues_[qid]->tasks.pop_back ();
+  queued_--;
+  return true;
+}
+
+// 别人的队列从头部偷，拿到的是最大的那些块
+bool ThreadPool::steal (const int qid, Task &task)
+{ const int num = queues_.size ();
+  for (int k = 1; k <= num; ++k)
+  { const int vid = (qid + k + num) % num;
+    if (vid == qid)
+      continue;
+    std::unique_lock<std::mutex> lock (queues_[vid]->mtx, std::try_to_lock);
+    if (!lock.owns_lock () || queues_[vid]->tasks.empty ())
+      continue;
+    task = queues_[vid]->tasks.front ();
+    queues_[vid]->tasks.pop_front ();
+    queued_--;
+    return true;
+  }
+  return false;
+}
+
+void ThreadPool::run (const Task &task)
+{ (*task.fn) (task.begin, task.end);
+  task.pending->fetch_sub (1, std::memory_order_release);
+}
+
+void ThreadPool::work (const int qid)
+{ xpu_worker = qid;
+  Task task;
+  while (true)
+  { if (pop (qid, task) || steal (qid, task))
+    { run (task);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock (mtx_);
+    cv_.wait (lock, [this] { return stop_ || queued_ > 0;  });
+    if (stop_)
+      return;
+  }
+}
+
+// 按grain切块，块数不超过线程数的4倍；调用线程一边等一边取任务做，嵌套调用不会多开线程
+void ThreadPool::parallel_for (const int64_t begin, const int64_t end, const int64_t grain, const std::function<void(int64_t, int64_t)> &fn)
+{ const int64_t len = end - begin;
+  if (len <= 0)
+    return;
+  if (len <= grain || threads_.empty ())
+  { fn (begin, end);
+    return;
+  }
+  const int64_t split  = std::min ((len + grain - 1) / grain, (int64_t)size() * 4);
+  const int64_t step   = (len + split - 1) / split;
+  const int     chunks = (len + step - 1) / step;
+  std::atomic<int> pending (chunks);
+
+  const int qid = xpu_worker;
+  for (int c = chunks-1; c >= 1; --c)
+  { Task task;
+    task.fn      = &fn;
+    task.begin   = begin + c * step;
+    task.end     = std::min (end, task.begin + step);
+    task.pending = &pending;
+    push (qid >= 0 ? qid : c % queues_.size(), task);
+  }
+  { std::unique_lock<std::mutex> lock (mtx_);  // 与work里的检查配对，避免丢失唤醒
+  }
+  cv_.notify_all ();
+
+  Task task;
+  task.fn = &fn;  task.begin = begin;  task.end = std::min (end, begin + step);  task.pending = &pending;
+  run (task);
+  while (pending.load (std::memory_order_acquire) > 0)
+    if (pop (qid, task) || steal (qid, task))
+      run (task);
+    else
+      std::this_thread::yield ();
+}
+
+void ThreadPool::parallel_for (const int begin, const int end, const int grain, const std::function<void(int, int)> &fn)
+{ parallel_for ((int64_t)begin, (int64_t)end, (int64_t)grain, [&] (const int64_t b, const int64_t e) { fn ((int)b, (int)e);  });
+}
+#endif
+
+#endif